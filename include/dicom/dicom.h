@@ -5,6 +5,11 @@
 
 #include "version.h"
 
+// generated by dicom-dict-build, which itself includes this header
+#ifndef DCM_DICT_BUILD
+#include "dicom-tags.h"
+#endif
+
 #ifndef DCM_INCLUDED
 #define DCM_INCLUDED
 
@@ -593,6 +598,75 @@ bool dcm_is_valid_vr(const char *vr);
 DCM_EXTERN
 bool dcm_is_valid_vr_for_tag(DcmVR vr, uint32_t tag);
 
+/**
+ * Add a tag to the Dictionary.
+ *
+ * If creator is not NULL, this adds a Private Data Element. It is
+ * identified by its Private Creator, its group and the low byte of its
+ * element number, so ``0x00291008`` and ``0x00291108`` are the same
+ * Private Data Element in different blocks.
+ *
+ * If creator is NULL, this adds an extra tag, for example a retired public
+ * tag, which is looked up by its exact tag.
+ *
+ * Tags only take effect when the Dictionary is frozen with
+ * :c:func:`dcm_dict_freeze()`. Adding tags is not thread-safe, so add them
+ * all at startup.
+ *
+ * :param error: Pointer to error object
+ * :param creator: Private Creator, or NULL
+ * :param tag: Attribute Tag
+ * :param vr: Attribute Value Representation
+ * :param keyword: Attribute Keyword, or NULL
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_dict_add_private_tag(DcmError **error,
+                              const char *creator,
+                              uint32_t tag,
+                              DcmVR vr,
+                              const char *keyword);
+
+/**
+ * Freeze the Dictionary.
+ *
+ * The tags added with :c:func:`dcm_dict_add_private_tag()` are built into
+ * lookup tables which are never modified again, so any thread can read
+ * them without locking. No more tags can be added.
+ *
+ * Call this once, before you start any threads that use libdicom.
+ *
+ * :param error: Pointer to error object
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_dict_freeze(DcmError **error);
+
+/**
+ * Find the Value Representation for a Private Data Element.
+ *
+ * :param creator: Private Creator
+ * :param tag: Attribute Tag
+ *
+ * :return: the Value Representation, or DCM_VR_ERROR if the tag is unknown
+ */
+DCM_EXTERN
+DcmVR dcm_vr_from_private_tag(const char *creator, uint32_t tag);
+
+/**
+ * Look up the Keyword of a Private Data Element.
+ *
+ * :param creator: Private Creator
+ * :param tag: Attribute Tag
+ *
+ * :return: attribute Keyword, or NULL if the tag is unknown
+ */
+DCM_EXTERN
+const char *dcm_dict_keyword_from_private_tag(const char *creator,
+                                              uint32_t tag);
+
 /**
  * Determine whether a Transfer Syntax is encapsulated.
  *
@@ -839,6 +913,31 @@ bool dcm_element_set_value_numeric_multi(DcmError **error,
                                          uint32_t vm,
                                          bool steal);
 
+/**
+ * Get all the values of a numeric Data Element as an array.
+ *
+ * The array returned is the storage used by the Data Element, so no
+ * copy is made. It is laid out as `vm` values of the C type for the
+ * returned Value Representation, for example `uint16_t` for US or `double`
+ * for FD.
+ *
+ * The pointer is owned by `element` and is valid until it is destroyed.
+ *
+ * :param error: Pointer to error object
+ * :param element: Pointer to Data Element
+ * :param vr: Pointer to return location for the Value Representation
+ * :param values: Pointer to return location for the array of values
+ * :param vm: Pointer to return location for the number of values
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_element_get_value_numeric_array(DcmError **error,
+                                         const DcmElement *element,
+                                         DcmVR *vr,
+                                         const void **values,
+                                         uint32_t *vm);
+
 /**
  * Get a floating-point value from a Data Element.
  *
@@ -881,6 +980,11 @@ bool dcm_element_set_value_decimal(DcmError **error,
  *
  * Use :c:func:`dcm_element_length` to get the length of the binary value.
  *
+ * If the value was left in the File, see
+ * :c:func:`dcm_filehandle_set_bulk_threshold`, it is read now and kept
+ * in the Data Element. This is not thread-safe, and counts as using the
+ * File, so it must not overlap with any other use of it.
+ *
  * :param error: Pointer to error object
  * :param element: Pointer to Data Element
  * :param value: Pointer to return location for value
@@ -892,6 +996,30 @@ bool dcm_element_get_value_binary(DcmError **error,
                                   const DcmElement *element,
                                   const void **value);
 
+/**
+ * Read part of a binary value from a Data Element.
+ *
+ * If the value was left in the File, see
+ * :c:func:`dcm_filehandle_set_bulk_threshold`, the bytes are read from
+ * the File and not kept, so you can stream a large value in chunks. This
+ * counts as using the File, so it must not overlap with any other use of
+ * it.
+ *
+ * :param error: Pointer to error object
+ * :param element: Pointer to Data Element
+ * :param offset: Offset into the value
+ * :param buffer: Pointer to return location for the bytes
+ * :param length: Number of bytes to read
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_element_read_value_binary(DcmError **error,
+                                   const DcmElement *element,
+                                   uint32_t offset,
+                                   void *buffer,
+                                   uint32_t length);
+
 /**
  * Set the value of a Data Element to binary data.
  *
@@ -937,6 +1065,11 @@ bool dcm_element_set_value(DcmError **error,
 /**
  * Get a sequence value from a Data Element.
  *
+ * If the Sequence was left in the File, see
+ * :c:func:`dcm_filehandle_set_lazy_sequences`, it is read now and kept in
+ * the Data Element. This is not thread-safe, and counts as using the
+ * File, so it must not overlap with any other use of it.
+ *
  * :param error: Pointer to error object
  * :param element: Pointer to Data Element
  * :param value: Pointer to return location for value
@@ -1299,6 +1432,121 @@ DCM_EXTERN
 void dcm_sequence_destroy(DcmSequence *seq);
 
 
+/**
+ * Attribute path
+ *
+ * A compiled reference to a Data Element, possibly nested inside
+ * Sequence items.
+ */
+typedef struct _DcmPath DcmPath;
+
+/**
+ * Compile an attribute path.
+ *
+ * The path is a list of attributes separated by ``.``. Each attribute is
+ * either a keyword, such as ``PixelSpacing``, or a tag written as eight
+ * hexadecimal digits, such as ``00280030``. Every attribute except the
+ * last must be a Sequence and must be followed by the zero-based index of
+ * an item in square brackets, for example::
+ *
+ *     SharedFunctionalGroupsSequence[0].PixelMeasuresSequence[0].PixelSpacing
+ *
+ * Keywords are resolved to tags once, here, so the compiled path can be
+ * evaluated many times cheaply with :c:func:`dcm_path_eval`.
+ *
+ * :param error: Pointer to error object
+ * :param path: Attribute path to compile
+ *
+ * :return: Pointer to compiled path
+ */
+DCM_EXTERN
+DcmPath *dcm_path_compile(DcmError **error, const char *path);
+
+/**
+ * Find the Data Element a path refers to.
+ *
+ * A missing attribute or item is not an error, so this function does not
+ * log or allocate, and is suitable for use on fast paths. Sequences and
+ * Data Sets it passes through are locked, as with
+ * :c:func:`dcm_element_get_value_sequence` and :c:func:`dcm_sequence_get`.
+ *
+ * :param dataset: Pointer to Data Set to search
+ * :param path: Pointer to compiled path
+ *
+ * :return: Pointer to Data Element, or NULL if the path does not match
+ */
+DCM_EXTERN
+DcmElement *dcm_path_eval(const DcmDataSet *dataset, const DcmPath *path);
+
+/**
+ * Get the tag of the Data Element a path refers to.
+ *
+ * :param path: Pointer to compiled path
+ *
+ * :return: Tag of the last attribute in the path
+ */
+DCM_EXTERN
+uint32_t dcm_path_get_tag(const DcmPath *path);
+
+/**
+ * Extract one floating-point value from every item of a Sequence.
+ *
+ * The path is evaluated against each Data Set item of the Sequence, and
+ * value `index` of the Data Element it finds is written to `values`, which
+ * must have room for :c:func:`dcm_sequence_count` values. Data Elements may
+ * have any numeric Value Representation, or DS or IS.
+ *
+ * For example, with the path ``PlanePositionSequence[0].ImagePositionPatient``
+ * and index 2, this will fetch the z position of every frame from
+ * PerFrameFunctionalGroupsSequence.
+ *
+ * The function fails if any item has no suitable value.
+ *
+ * :param error: Pointer to error object
+ * :param seq: Pointer to Sequence
+ * :param path: Pointer to compiled path, relative to each item
+ * :param index: Zero-based index of value within the Data Element
+ * :param values: Array to write values to
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_sequence_extract_decimal(DcmError **error,
+                                  const DcmSequence *seq,
+                                  const DcmPath *path,
+                                  uint32_t index,
+                                  double *values);
+
+/**
+ * Extract one integer value from every item of a Sequence.
+ *
+ * As :c:func:`dcm_sequence_extract_decimal`, but Data Elements must have an
+ * integer Value Representation, or IS.
+ *
+ * :param error: Pointer to error object
+ * :param seq: Pointer to Sequence
+ * :param path: Pointer to compiled path, relative to each item
+ * :param index: Zero-based index of value within the Data Element
+ * :param values: Array to write values to
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_sequence_extract_integer(DcmError **error,
+                                  const DcmSequence *seq,
+                                  const DcmPath *path,
+                                  uint32_t index,
+                                  int64_t *values);
+
+/**
+ * Destroy a compiled path.
+ *
+ * :param path: Pointer to compiled path
+ */
+DCM_EXTERN
+void dcm_path_destroy(DcmPath *path);
+
+
 /**
  * Frame Item of Pixel Data Element
  *
@@ -1481,6 +1729,10 @@ const char *dcm_frame_get_value(const DcmFrame *frame);
 /**
  * Destroy a Frame.
  *
+ * A Frame may be shared with the frame cache of a File, see
+ * :c:func:`dcm_filehandle_set_frame_cache`, in which case it is freed
+ * when the cache drops it too.
+ *
  * :param frame: Frame
  */
 DCM_EXTERN
@@ -1683,6 +1935,70 @@ const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
 DCM_EXTERN
 const char *dcm_filehandle_get_transfer_syntax_uid(const DcmFilehandle *filehandle);
 
+/**
+ * Trust the content of a File.
+ *
+ * Use this for Files from a source you control. Data Elements read from
+ * a trusted File are not checked against the Dictionary, so a VR that is
+ * not allowed for a tag, or a string longer than its VR allows, is passed
+ * through. Value lengths are still checked, so a bad File cannot cause a
+ * read out of bounds.
+ *
+ * This affects all later reads from the File.
+ *
+ * :param filehandle: File
+ * :param trusted: Whether to trust the File
+ */
+DCM_EXTERN
+void dcm_filehandle_set_trusted(DcmFilehandle *filehandle, bool trusted);
+
+/**
+ * Leave large binary values in a File.
+ *
+ * Binary Data Elements, for example ICC profiles or encapsulated documents,
+ * with a value of at least threshold bytes are not read by
+ * :c:func:`dcm_filehandle_read_metadata`. Instead, the Data Element
+ * records where the value is, and it is read from the File when you call
+ * :c:func:`dcm_element_get_value_binary` or
+ * :c:func:`dcm_element_read_value_binary`.
+ *
+ * The File must not be destroyed while any Data Set read from it with
+ * such values is in use. Reading a value moves the read point of the
+ * File, so it counts as using the File: don't read values from one thread
+ * while another uses the File, or while asynchronous reads from it are
+ * pending.
+ *
+ * :param filehandle: File
+ * :param threshold: Size in bytes, or 0 to read all values (the default)
+ */
+DCM_EXTERN
+void dcm_filehandle_set_bulk_threshold(DcmFilehandle *filehandle,
+                                       uint32_t threshold);
+
+/**
+ * Leave top-level Sequences in a File.
+ *
+ * Sequences in the top-level Data Set are not read by
+ * :c:func:`dcm_filehandle_read_metadata`, they are only skipped over.
+ * Each Sequence is read from the File the first time you call
+ * :c:func:`dcm_element_get_value_sequence` on it, and is then kept in
+ * the Data Element. Reading a Sequence is not thread-safe.
+ *
+ * This makes opening a File with large Sequences which are rarely used,
+ * such as PerFrameFunctionalGroupsSequence, much faster.
+ *
+ * The File must not be destroyed while any Data Set read from it with
+ * such Sequences is in use. Reading a Sequence moves the read point of the
+ * File, so it counts as using the File: don't read Sequences from one
+ * thread while another uses the File, or while asynchronous reads from it
+ * are pending.
+ *
+ * :param filehandle: File
+ * :param lazy: Whether to read Sequences only when they are used
+ */
+DCM_EXTERN
+void dcm_filehandle_set_lazy_sequences(DcmFilehandle *filehandle, bool lazy);
+
 /**
  * Read metadata from a File.
  *
@@ -1762,67 +2078,991 @@ bool dcm_filehandle_prepare_read_frame(DcmError **error,
                                        DcmFilehandle *filehandle);
 
 /**
- * Read an individual Frame from a File.
+ * Cache recently read Frames in a File.
  *
- * Frames are numbered from 1 in the order they appear in the PixelData element.
+ * :c:func:`dcm_filehandle_read_frame` will return a cached Frame if it has
+ * one, and add Frames it reads to the cache. The least recently used
+ * Frames are dropped to keep the Frame data in the cache under budget.
+ *
+ * Cached Frames are shared, so you must not modify them.
  *
  * :param error: Pointer to error object
  * :param filehandle: File
- * :param frame_number: One-based frame number
+ * :param budget: Maximum size of the cache in bytes, or 0 for no cache
+ *   (the default)
  *
- * :return: Frame
+ * :return: true on success
  */
 DCM_EXTERN
-DcmFrame *dcm_filehandle_read_frame(DcmError **error,
+bool dcm_filehandle_set_frame_cache(DcmError **error,
                                     DcmFilehandle *filehandle,
-                                    uint32_t frame_number);
+                                    uint64_t budget);
 
 /**
- * Get the frame number at a position.
+ * Use the process-wide frame cache for a File.
  *
- * Given a tile row and column, get the number of the frame that should be
- * displayed at that position, taking into account any frame-positioning
- * metadata.
+ * Frames are shared between all Files using the shared cache, so many
+ * threads, each with their own File, can read the same Frame once. Files
+ * are identified by their SOPInstanceUID and transfer syntax, so this reads
+ * the metadata subset, see :c:func:`dcm_filehandle_get_metadata_subset`.
+ *
+ * Frames from the shared cache may be in use on several threads at once,
+ * so you must not modify them. The shared cache is empty until you give it
+ * a budget with :c:func:`dcm_shared_frame_cache_set_budget`.
  *
  * :param error: Pointer to error object
  * :param filehandle: File
- * :param column: Column number, from 0
- * :param row: Row number, from 0
- * :param frame_number: Return one-based frame number
+ * :param shared: Whether to use the shared cache
  *
- * :return: true on success, false for no frame available
+ * :return: true on success
  */
 DCM_EXTERN
-bool dcm_filehandle_get_frame_number(DcmError **error,
-                                     DcmFilehandle *filehandle,
-                                     uint32_t column,
-                                     uint32_t row,
-                                     uint32_t *frame_number);
+bool dcm_filehandle_set_shared_frame_cache(DcmError **error,
+                                           DcmFilehandle *filehandle,
+                                           bool shared);
 
 /**
- * Read the frame at a position in a File.
+ * Set the size of the process-wide frame cache.
  *
- * Read a frame from a File at a specified (column, row), numbered from zero.
- * This takes account of any frame positioning given in
- * PerFrameFunctionalGroupSequence.
+ * The budget is for the whole cache, and a single Frame can use all of
+ * it. The cache is split into shards with their own locks, and when it
+ * goes over budget, Frames are evicted from each shard in turn, least
+ * recently used first, until it fits. Setting the budget to 0 empties the
+ * cache, though Frames you hold remain valid.
  *
- * If the frame is missing, perhaps because this is a sparse file, this
- * function returns NULL and sets the error
- * :c:enum:`DCM_ERROR_CODE_MISSING_FRAME`. Applications can detect
- * this and render a background image.
+ * This function is thread-safe.
  *
  * :param error: Pointer to error object
+ * :param budget: Maximum size of the cache in bytes
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_shared_frame_cache_set_budget(DcmError **error, uint64_t budget);
+
+/**
+ * Get counts of hits and misses for the process-wide frame cache.
+ *
+ * :param hits: Return the number of Frames found in the cache
+ * :param misses: Return the number of Frames which were read
+ */
+DCM_EXTERN
+void dcm_shared_frame_cache_get_stats(uint64_t *hits, uint64_t *misses);
+
+/**
+ * Get counts of frame cache hits and misses for a File.
+ *
  * :param filehandle: File
- * :param column: Column number, from 0
- * :param row: Row number, from 0
+ * :param hits: Return the number of Frames found in the cache
+ * :param misses: Return the number of Frames which were read
+ */
+DCM_EXTERN
+void dcm_filehandle_get_frame_cache_stats(const DcmFilehandle *filehandle,
+                                          uint64_t *hits,
+                                          uint64_t *misses);
+
+/**
+ * A frame cache in shared memory, so several processes can read each Frame
+ * once.
+ */
+typedef struct _DcmShmFrameCache DcmShmFrameCache;
+
+/**
+ * Open a named frame cache in shared memory, creating it if necessary.
+ *
+ * The first process to open a name sets the size of the cache, and later
+ * processes use that size, whatever they ask for. Processes which open the
+ * name while another is creating it wait for it to be ready. The cache has
+ * a fixed number of slots, each holding one Frame of up to max_frame_size
+ * bytes. Larger Frames are never cached.
+ *
+ * Lookups take no locks, so a process which dies while using the cache
+ * cannot block the others. A slot left half-written by a process which
+ * died is reused once that process no longer exists, which is checked by
+ * pid. A process in a different PID namespace would look dead, so all
+ * processes sharing a cache must be in the same PID namespace.
+ *
+ * Shared memory is only available on POSIX platforms.
+ *
+ * :param error: Pointer to error object
+ * :param name: Name of the cache, for example "/my-viewer-frames"
+ * :param n_frames: Number of Frames the cache can hold
+ * :param max_frame_size: Largest Frame, in bytes
+ *
+ * :return: Shared memory frame cache
+ */
+DCM_EXTERN
+DcmShmFrameCache *dcm_shm_frame_cache_open(DcmError **error,
+                                           const char *name,
+                                           uint32_t n_frames,
+                                           uint32_t max_frame_size);
+
+/**
+ * Close a shared memory frame cache.
+ *
+ * The cache and its contents remain for other processes to use until it
+ * is removed with :c:func:`dcm_shm_frame_cache_unlink`.
+ *
+ * :param cache: Shared memory frame cache
+ */
+DCM_EXTERN
+void dcm_shm_frame_cache_destroy(DcmShmFrameCache *cache);
+
+/**
+ * Remove a named shared memory frame cache.
+ *
+ * Processes with the cache open can go on using it, and the memory is
+ * released when the last of them closes it.
+ *
+ * :param error: Pointer to error object
+ * :param name: Name of the cache
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_shm_frame_cache_unlink(DcmError **error, const char *name);
+
+/**
+ * Get counts of hits and misses for a shared memory frame cache, summed
+ * over all the processes using it.
+ *
+ * :param cache: Shared memory frame cache
+ * :param hits: Return the number of Frames found in the cache
+ * :param misses: Return the number of Frames which were read
+ */
+DCM_EXTERN
+void dcm_shm_frame_cache_get_stats(const DcmShmFrameCache *cache,
+                                   uint64_t *hits,
+                                   uint64_t *misses);
+
+/**
+ * Use a shared memory frame cache for a File.
+ *
+ * Files are identified in the same way as for
+ * :c:func:`dcm_filehandle_set_shared_frame_cache`, so this reads the
+ * metadata subset. Frames found in the cache are copied out, so you own
+ * them as usual. The filehandle does not take ownership of the cache, and
+ * you must not destroy the cache while the filehandle uses it.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param cache: Shared memory frame cache, or NULL to stop using one
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_set_shm_frame_cache(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        DcmShmFrameCache *cache);
+
+/**
+ * Read an individual Frame from a File.
+ *
+ * Frames are numbered from 1 in the order they appear in the PixelData element.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_number: One-based frame number
  *
  * :return: Frame
  */
 DCM_EXTERN
-DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
-                                             DcmFilehandle *filehandle,
-                                             uint32_t column,
-                                             uint32_t row);
+DcmFrame *dcm_filehandle_read_frame(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t frame_number);
+
+/**
+ * Read a set of Frames from a File.
+ *
+ * This gives the same Frames as calling :c:func:`dcm_filehandle_read_frame`
+ * for each one, but the reads are made together. On Linux, when libdicom is
+ * built with liburing, Files opened with
+ * :c:func:`dcm_filehandle_create_from_file` submit all the reads at once
+ * with io_uring, so fast storage can work on many at a time.
+ *
+ * If any read fails, no Frames are returned.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_numbers: One-based numbers of the Frames to read
+ * :param n_frames: Number of Frames to read
+ * :param frames: Return the Frames, in the order of frame_numbers
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_frames(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                const uint32_t *frame_numbers,
+                                uint32_t n_frames,
+                                DcmFrame **frames);
+
+/**
+ * Hint that Frames will be read soon.
+ *
+ * For Files opened with :c:func:`dcm_filehandle_create_from_file`, this
+ * asks the operating system to start reading the Frames into its cache,
+ * and returns without waiting, so a later
+ * :c:func:`dcm_filehandle_read_frame` can find its data in memory. Runs of
+ * adjacent Frames are fetched together. For other Files, and on platforms
+ * with no way to give this hint, it does nothing.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_numbers: One-based numbers of the Frames to fetch
+ * :param n_frames: Number of Frames to fetch
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_prefetch_frames(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    const uint32_t *frame_numbers,
+                                    uint32_t n_frames);
+
+/**
+ * Called on a worker thread when an asynchronous Frame read completes.
+ *
+ * On success, frame is set and error is NULL, and you own the Frame. On
+ * failure, frame is NULL and error describes the problem. The error is
+ * destroyed when the callback returns.
+ *
+ * :param error: Error object, or NULL
+ * :param frame: Frame, or NULL
+ * :param user: User data passed to :c:func:`dcm_filehandle_read_frame_async`
+ */
+typedef void (*DcmFrameCallback)(DcmError *error,
+                                 DcmFrame *frame,
+                                 void *user);
+
+/**
+ * Read a Frame on a worker thread.
+ *
+ * The read is queued and this function returns immediately. When it
+ * completes, callback is called on the worker thread. Reads from one File
+ * run one at a time, in the order they were made, so to read a File in
+ * parallel, open several filehandles for it.
+ *
+ * While reads are pending you must not use the File, except to queue more
+ * reads from the thread that made the others. Reading a binary value or
+ * a Sequence left in the File, see
+ * :c:func:`dcm_filehandle_set_bulk_threshold` and
+ * :c:func:`dcm_filehandle_set_lazy_sequences`, counts as using the File.
+ * :c:func:`dcm_filehandle_destroy` waits for pending reads to complete, so
+ * it must not be called from a callback.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_number: One-based frame number
+ * :param callback: Function to call when the read completes
+ * :param user: User data for the callback
+ *
+ * :return: true if the read was queued
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_frame_async(DcmError **error,
+                                     DcmFilehandle *filehandle,
+                                     uint32_t frame_number,
+                                     DcmFrameCallback callback,
+                                     void *user);
+
+/**
+ * Set the number of worker threads used for asynchronous reads.
+ *
+ * The default is 4. This function is thread-safe.
+ *
+ * :param error: Pointer to error object
+ * :param n_threads: Number of worker threads, at least 1
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_async_set_threads(DcmError **error, uint32_t n_threads);
+
+/**
+ * A queue of completed asynchronous reads.
+ */
+typedef struct _DcmCompletionQueue DcmCompletionQueue;
+
+/**
+ * Create a completion queue.
+ *
+ * :param error: Pointer to error object
+ *
+ * :return: Completion queue
+ */
+DCM_EXTERN
+DcmCompletionQueue *dcm_completion_queue_create(DcmError **error);
+
+/**
+ * Destroy a completion queue.
+ *
+ * Frames and errors still in the queue are destroyed. There must be no
+ * pending reads for the queue.
+ *
+ * :param queue: Completion queue
+ */
+DCM_EXTERN
+void dcm_completion_queue_destroy(DcmCompletionQueue *queue);
+
+/**
+ * Read a Frame on a worker thread, and add the result to a queue.
+ *
+ * This is the same as :c:func:`dcm_filehandle_read_frame_async`, but the
+ * result is added to queue for you to take with
+ * :c:func:`dcm_completion_queue_next`, so no code runs on worker threads.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_number: One-based frame number
+ * :param queue: Completion queue
+ * :param user: User data returned with the result
+ *
+ * :return: true if the read was queued
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_frame_queued(DcmError **error,
+                                      DcmFilehandle *filehandle,
+                                      uint32_t frame_number,
+                                      DcmCompletionQueue *queue,
+                                      void *user);
+
+/**
+ * Take the next completed read from a queue.
+ *
+ * Reads are returned in the order they complete. If wait is true, this
+ * blocks until a read completes, unless there are no pending reads for the
+ * queue. This function is thread-safe.
+ *
+ * On success, frame is set and you own it. If the read failed, frame is
+ * set to NULL and error is set, and you must clear the error.
+ *
+ * :param queue: Completion queue
+ * :param wait: Whether to wait for a read to complete
+ * :param frame: Return the Frame, or NULL if the read failed
+ * :param error: Return the error, or NULL to ignore errors
+ * :param user: Return the user data, or NULL
+ *
+ * :return: true if a completed read was returned
+ */
+DCM_EXTERN
+bool dcm_completion_queue_next(DcmCompletionQueue *queue,
+                               bool wait,
+                               DcmFrame **frame,
+                               DcmError **error,
+                               void **user);
+
+/**
+ * Get the frame number at a position.
+ *
+ * Given a tile row and column, get the number of the frame that should be
+ * displayed at that position, taking into account any frame-positioning
+ * metadata.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param column: Column number, from 0
+ * :param row: Row number, from 0
+ * :param frame_number: Return one-based frame number
+ *
+ * :return: true on success, false for no frame available
+ */
+DCM_EXTERN
+bool dcm_filehandle_get_frame_number(DcmError **error,
+                                     DcmFilehandle *filehandle,
+                                     uint32_t column,
+                                     uint32_t row,
+                                     uint32_t *frame_number);
+
+/**
+ * Read the frame at a position in a File.
+ *
+ * Read a frame from a File at a specified (column, row), numbered from zero.
+ * This takes account of any frame positioning given in
+ * PerFrameFunctionalGroupSequence.
+ *
+ * If the frame is missing, perhaps because this is a sparse file, this
+ * function returns NULL and sets the error
+ * :c:enum:`DCM_ERROR_CODE_MISSING_FRAME`. Applications can detect
+ * this and render a background image.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param column: Column number, from 0
+ * :param row: Row number, from 0
+ *
+ * :return: Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t column,
+                                             uint32_t row);
+
+/**
+ * Prefetch the tiles a viewer is likely to read next.
+ *
+ * After each :c:func:`dcm_filehandle_read_frame_position`, guess which
+ * tiles will be wanted soon and pass them to
+ * :c:func:`dcm_filehandle_prefetch_frames`. If the last two reads moved in
+ * the same direction, the tiles ahead in that direction are fetched,
+ * nearest first. Otherwise, the tiles around the one just read are fetched.
+ *
+ * Each File is a single resolution, so zooming shows up as a jump to a new
+ * File, and each File starts with no history.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param budget: Most tiles to fetch after each read, or 0 to turn
+ *   prefetch off (the default)
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_set_prefetch(DcmError **error,
+                                 DcmFilehandle *filehandle,
+                                 uint32_t budget);
+
+/**
+ * Extract one floating-point value from every item of a top-level Sequence
+ * in a File.
+ *
+ * This is :c:func:`dcm_sequence_extract_decimal`, but run directly on the
+ * file with the streaming parser, so no Data Set is built. This makes it
+ * much faster and smaller for large sequences such as
+ * PerFrameFunctionalGroupsSequence.
+ *
+ * The array of values is allocated by this function and must be freed
+ * with :c:func:`dcm_free`.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param sequence_tag: Tag of a top-level Sequence
+ * :param path: Pointer to compiled path, relative to each item
+ * :param index: Zero-based index of value within the Data Element
+ * :param values: Return array of values, one per item
+ * :param count: Return number of values
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_extract_decimal(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t sequence_tag,
+                                    const DcmPath *path,
+                                    uint32_t index,
+                                    double **values,
+                                    uint32_t *count);
+
+/**
+ * Extract one integer value from every item of a top-level Sequence
+ * in a File.
+ *
+ * As :c:func:`dcm_filehandle_extract_decimal`, but for integer values.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param sequence_tag: Tag of a top-level Sequence
+ * :param path: Pointer to compiled path, relative to each item
+ * :param index: Zero-based index of value within the Data Element
+ * :param values: Return array of values, one per item
+ * :param count: Return number of values
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_extract_integer(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t sequence_tag,
+                                    const DcmPath *path,
+                                    uint32_t index,
+                                    int64_t **values,
+                                    uint32_t *count);
+
+/**
+ * Describes one field of a C struct to fill from a File, see
+ * :c:func:`dcm_schema_create`.
+ *
+ * Numeric fields use the C type for `vr`, for example `uint16_t` for US or
+ * `double` for FD, and the value in the file is converted if necessary.
+ * Numeric values can be read from Data Elements with any numeric VR, or
+ * with DS or IS. Fields with a string VR are `char` arrays of `size` bytes,
+ * and values are truncated to fit.
+ *
+ * Fields with `vm` greater than 1 are arrays, and the first `vm` values of
+ * the Data Element are stored.
+ */
+typedef struct _DcmBinding {
+    /** Attribute path, see :c:func:`dcm_path_compile` */
+    const char *path;
+    /** Value Representation giving the C type of the field */
+    DcmVR vr;
+    /** Offset of the field in the struct, perhaps from `offsetof()` */
+    size_t offset;
+    /** For string fields, the size of each string in bytes */
+    size_t size;
+    /** Number of values to store */
+    uint32_t vm;
+    /** Fail if the Data Element is missing or has too few values */
+    bool required;
+} DcmBinding;
+
+/**
+ * A compiled set of bindings.
+ */
+typedef struct _DcmSchema DcmSchema;
+
+/**
+ * Create a schema from an array of bindings.
+ *
+ * The bindings are copied and their paths compiled, so the schema can be
+ * used on many files.
+ *
+ * :param error: Pointer to error object
+ * :param bindings: Array of bindings
+ * :param n_bindings: Number of bindings
+ *
+ * :return: Pointer to schema
+ */
+DCM_EXTERN
+DcmSchema *dcm_schema_create(DcmError **error,
+                             const DcmBinding *bindings,
+                             uint32_t n_bindings);
+
+/**
+ * Destroy a schema.
+ *
+ * :param schema: Pointer to schema
+ */
+DCM_EXTERN
+void dcm_schema_destroy(DcmSchema *schema);
+
+/**
+ * Fill a C struct from a File using a schema.
+ *
+ * Values are copied straight from the streaming parser into `record`
+ * without building a Data Set, and parsing stops as soon as every
+ * top-level Data Element the schema refers to has been passed. Fields for
+ * optional Data Elements which are not in the file, or which don't have
+ * `vm` values of the right type, are left unchanged, so initialise
+ * `record` with any defaults first.
+ *
+ * File Meta Information is not searched, use
+ * :c:func:`dcm_filehandle_get_file_meta` for that.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param schema: Pointer to schema
+ * :param record: Pointer to struct to fill
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_bind(DcmError **error,
+                         DcmFilehandle *filehandle,
+                         const DcmSchema *schema,
+                         void *record);
+
+/**
+ * Streaming parse
+ */
+
+/**
+ * The version of :c:type:`DcmParseCallbacks` described by this header. Set
+ * the `version` field of your callbacks to this value.
+ */
+#define DCM_PARSE_VERSION (1)
+
+/**
+ * Returned by streaming parse callbacks to control the parse.
+ */
+typedef enum _DcmParseControl {
+    /** Stop with an error, the callback should have set one */
+    DCM_PARSE_ERROR = 0,
+    /** Carry on parsing */
+    DCM_PARSE_CONTINUE,
+    /** From `element_begin` or `item_begin`, skip the value without
+     * reading it. For a Sequence or encapsulated Pixel Data this skips all
+     * the items */
+    DCM_PARSE_SKIP_BODY,
+    /** Skip the rest of the Sequence enclosing this Data Element or item.
+     * At the top level, this ends the parse */
+    DCM_PARSE_SKIP_SEQUENCE,
+    /** Stop parsing, with no further callbacks. From `element_begin`, the
+     * read point is left at the start of the Data Element */
+    DCM_PARSE_STOP,
+} DcmParseControl;
+
+/**
+ * The position of the parser, passed to every streaming parse callback.
+ */
+typedef struct _DcmParseInfo {
+    /** Tag of the Data Element, or `0xFFFEE000` for an item */
+    uint32_t tag;
+    /** VR of the Data Element, or of the enclosing Data Element for an
+     * item */
+    DcmVR vr;
+    /** Length of the value in bytes, `0xFFFFFFFF` for undefined length */
+    uint32_t length;
+    /** Offset of the start of the header from the start of the File */
+    int64_t offset;
+    /** Offset of the start of the value from the start of the File */
+    int64_t value_offset;
+    /** Number of Sequences enclosing this Data Element or item, 0 for the
+     * top-level Data Set */
+    uint32_t depth;
+    /** Zero-based index of this item in its Sequence */
+    uint32_t index;
+} DcmParseInfo;
+
+/**
+ * Callbacks for :c:func:`dcm_filehandle_parse`.
+ *
+ * Any callback may be NULL. Values are passed in a temporary buffer which
+ * is only valid during the callback. String values are null-terminated,
+ * with a single trailing space removed, and numeric values are in host
+ * byte order and aligned for their type. When reading from memory, binary
+ * and numeric values may point directly into the input.
+ */
+typedef struct _DcmParseCallbacks {
+    /** Must be set to :c:macro:`DCM_PARSE_VERSION` */
+    uint32_t version;
+
+    /** Called after the header of every Data Element */
+    DcmParseControl (*element_begin)(DcmError **error,
+                                     void *client,
+                                     const DcmParseInfo *info);
+
+    /** Called with the value of every Data Element which is not a Sequence
+     * or encapsulated Pixel Data */
+    DcmParseControl (*element_value)(DcmError **error,
+                                     void *client,
+                                     const DcmParseInfo *info,
+                                     const char *value);
+
+    /** Called after the last item of a Sequence or encapsulated Pixel
+     * Data, unless the body was skipped */
+    DcmParseControl (*element_end)(DcmError **error,
+                                   void *client,
+                                   const DcmParseInfo *info);
+
+    /** Called at the start of every Sequence item */
+    DcmParseControl (*item_begin)(DcmError **error,
+                                  void *client,
+                                  const DcmParseInfo *info);
+
+    /** Called with the value of every encapsulated Pixel Data item,
+     * including the Basic Offset Table */
+    DcmParseControl (*item_value)(DcmError **error,
+                                  void *client,
+                                  const DcmParseInfo *info,
+                                  const char *value);
+
+    /** Called at the end of every Sequence item */
+    DcmParseControl (*item_end)(DcmError **error,
+                                void *client,
+                                const DcmParseInfo *info);
+} DcmParseCallbacks;
+
+/**
+ * Parse the Data Set of a File, calling a set of callbacks for each
+ * Data Element and item.
+ *
+ * No Data Set is built, so this is the fastest and smallest way to scan a
+ * File. The callbacks can skip values they don't need, and stop the parse
+ * early.
+ *
+ * Parsing starts at the first Data Element after the File Meta
+ * Information and ends at the end of the File, at Data Set Trailing
+ * Padding, or when a callback returns :c:enumerator:`DCM_PARSE_STOP`.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param callbacks: Pointer to callbacks
+ * :param client: Passed to every callback
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_parse(DcmError **error,
+                          DcmFilehandle *filehandle,
+                          const DcmParseCallbacks *callbacks,
+                          void *client);
+
+/**
+ * Build a table of contents for the top-level Data Set of a File.
+ *
+ * This reads the header of each top-level Data Element and seeks over the
+ * value, so it is much faster than reading the metadata. The table is
+ * sorted by tag and is kept in the File, so it is only built once.
+ *
+ * The read point of the File is not changed.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param length: Return the number of entries
+ *
+ * :return: Pointer to the entries, which must not be freed
+ */
+DCM_EXTERN
+const DcmParseInfo *dcm_filehandle_build_toc(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t *length);
+
+/**
+ * Find a top-level Data Element in the table of contents of a File.
+ *
+ * :param filehandle: File
+ * :param tag: Attribute Tag
+ *
+ * :return: Pointer to the entry, or NULL if the tag is not in the table or
+ *   :c:func:`dcm_filehandle_build_toc` has not been called
+ */
+DCM_EXTERN
+const DcmParseInfo *dcm_filehandle_find_toc_entry(const DcmFilehandle *filehandle,
+                                                  uint32_t tag);
+
+/**
+ * Read a single top-level Data Element from a File.
+ *
+ * This uses the table of contents, building it if necessary, to seek
+ * directly to the Data Element. Sequences are read in full. Encapsulated
+ * Pixel Data cannot be read this way, use
+ * :c:func:`dcm_filehandle_read_frame` instead.
+ *
+ * The read point of the File is not changed.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param tag: Attribute Tag
+ *
+ * :return: Pointer to a new Data Element, which you must destroy
+ */
+DCM_EXTERN
+DcmElement *dcm_filehandle_read_element(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        uint32_t tag);
+
+/**
+ * Pull reader
+ */
+
+/**
+ * A reader which returns parse events one at a time, see
+ * :c:func:`dcm_filehandle_create_reader`.
+ */
+typedef struct _DcmReader DcmReader;
+
+/**
+ * The kinds of event a reader can return.
+ */
+typedef enum _DcmReaderEventType {
+    /** The end of the Data Set, there are no more events */
+    DCM_READER_EVENT_END = 0,
+    /** A Data Element with a value */
+    DCM_READER_EVENT_ELEMENT,
+    /** The start of a Sequence, or of encapsulated Pixel Data */
+    DCM_READER_EVENT_SEQUENCE_BEGIN,
+    /** The end of a Sequence, or of encapsulated Pixel Data */
+    DCM_READER_EVENT_SEQUENCE_END,
+    /** The start of a Sequence item */
+    DCM_READER_EVENT_ITEM_BEGIN,
+    /** The end of a Sequence item */
+    DCM_READER_EVENT_ITEM_END,
+    /** An item of encapsulated Pixel Data, with a value */
+    DCM_READER_EVENT_FRAGMENT,
+} DcmReaderEventType;
+
+/**
+ * An event from :c:func:`dcm_reader_next`.
+ */
+typedef struct _DcmReaderEvent {
+    /** The kind of event */
+    DcmReaderEventType type;
+    /** The Data Element or item, as for :c:type:`DcmParseCallbacks` */
+    DcmParseInfo info;
+} DcmReaderEvent;
+
+/**
+ * Create a reader for the Data Set of a File.
+ *
+ * The reader starts at the first Data Element after the File Meta
+ * Information. It shares the read point of the Filehandle, so don't call
+ * other functions on the Filehandle until the reader has been destroyed.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ *
+ * :return: Pointer to reader
+ */
+DCM_EXTERN
+DcmReader *dcm_filehandle_create_reader(DcmError **error,
+                                        DcmFilehandle *filehandle);
+
+/**
+ * Get the next event from a reader.
+ *
+ * Values are only read if you call :c:func:`dcm_reader_get_value`,
+ * otherwise they are skipped.
+ *
+ * :param error: Pointer to error object
+ * :param reader: Pointer to reader
+ * :param event: Return the event
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_reader_next(DcmError **error,
+                     DcmReader *reader,
+                     DcmReaderEvent *event);
+
+/**
+ * Read the value for the current event.
+ *
+ * Only element and fragment events have a value. The value is formatted
+ * as for :c:type:`DcmParseCallbacks`, and is only valid until the next call
+ * to the reader.
+ *
+ * :param error: Pointer to error object
+ * :param reader: Pointer to reader
+ *
+ * :return: Pointer to the value
+ */
+DCM_EXTERN
+const char *dcm_reader_get_value(DcmError **error, DcmReader *reader);
+
+/**
+ * Skip the body of the current Data Element or item.
+ *
+ * After a sequence begin event, this skips all the items and there is no
+ * matching sequence end event. After an item begin event, this skips the
+ * contents of the item, and the next event is the item end.
+ *
+ * :param error: Pointer to error object
+ * :param reader: Pointer to reader
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_reader_skip_body(DcmError **error, DcmReader *reader);
+
+/**
+ * Skip the rest of the current Sequence item, so the next event is the item
+ * end.
+ *
+ * At the top level, this skips the rest of the Data Set.
+ *
+ * :param error: Pointer to error object
+ * :param reader: Pointer to reader
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_reader_skip_item(DcmError **error, DcmReader *reader);
+
+/**
+ * Destroy a reader.
+ *
+ * :param reader: Pointer to reader
+ */
+DCM_EXTERN
+void dcm_reader_destroy(DcmReader *reader);
+
+/**
+ * Push parser
+ */
+
+/**
+ * A parser you feed input to as it arrives, see
+ * :c:func:`dcm_parser_create`.
+ */
+typedef struct _DcmParser DcmParser;
+
+/**
+ * Create a parser for a Data Set which arrives in chunks, for example from
+ * a socket or a message queue.
+ *
+ * The input is a Data Set with no File Preamble or File Meta Information.
+ * As each chunk is fed in, the parser calls the callbacks for every Data
+ * Element and item it can complete, exactly as
+ * :c:func:`dcm_filehandle_parse` would, and keeps any partial element
+ * until more input arrives. No seekable IO is needed.
+ *
+ * Values are passed to callbacks whole, so the parser holds a complete
+ * value in memory before it calls ``element_value`` or ``item_value``.
+ * Values which are skipped are discarded as they arrive.
+ *
+ * Only Implicit VR Little Endian, Explicit VR Little Endian and the
+ * encapsulated (compressed) Transfer Syntaxes are supported. Big Endian and
+ * Deflated Data Sets fail with :c:enumerator:`DCM_ERROR_CODE_INVALID`.
+ *
+ * :param error: Pointer to error object
+ * :param transfer_syntax_uid: Transfer Syntax of the Data Set, or NULL for
+ *   Explicit VR Little Endian
+ * :param callbacks: Pointer to callbacks
+ * :param client: Passed to every callback
+ *
+ * :return: Pointer to parser
+ */
+DCM_EXTERN
+DcmParser *dcm_parser_create(DcmError **error,
+                             const char *transfer_syntax_uid,
+                             const DcmParseCallbacks *callbacks,
+                             void *client);
+
+/**
+ * Trust the input to a parser.
+ *
+ * Headers are not checked against the Dictionary, see
+ * :c:func:`dcm_filehandle_set_trusted()`.
+ *
+ * :param parser: Pointer to parser
+ * :param trusted: Whether to trust the input
+ */
+DCM_EXTERN
+void dcm_parser_set_trusted(DcmParser *parser, bool trusted);
+
+/**
+ * Feed the next chunk of input to a parser.
+ *
+ * Callbacks are called from inside this function. Chunks can be of any
+ * size, and can split Data Elements anywhere. Once a callback returns
+ * :c:enumerator:`DCM_PARSE_STOP`, further input is ignored.
+ *
+ * :param error: Pointer to error object
+ * :param parser: Pointer to parser
+ * :param chunk: Pointer to the input, which is copied if needed
+ * :param length: Number of bytes of input
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_parser_feed(DcmError **error,
+                     DcmParser *parser,
+                     const char *chunk,
+                     size_t length);
+
+/**
+ * Tell a parser that there is no more input.
+ *
+ * This parses any remaining input, and fails if the Data Set is
+ * incomplete.
+ *
+ * :param error: Pointer to error object
+ * :param parser: Pointer to parser
+ *
+ * :return: true if the Data Set was complete
+ */
+DCM_EXTERN
+bool dcm_parser_finish(DcmError **error, DcmParser *parser);
+
+/**
+ * Destroy a parser.
+ *
+ * :param parser: Pointer to parser
+ */
+DCM_EXTERN
+void dcm_parser_destroy(DcmParser *parser);
 
 /**
  * Scan a file and print the entire structure to stdout.
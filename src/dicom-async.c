@@ -0,0 +1,469 @@
+/*
+ * Read frames on a pool of worker threads.
+ */
+
+#include "config.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+
+/* Worker threads take filehandles with pending reads from a single queue,
+ * and run one read at a time. A filehandle is only ever on the queue once,
+ * so each is read by one worker at a time, and a filehandle with many
+ * pending reads can't hold up the others.
+ */
+#define DEFAULT_THREADS (4)
+
+#ifdef _WIN32
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define MUTEX_LOCK(M) AcquireSRWLockExclusive(M)
+#define MUTEX_UNLOCK(M) ReleaseSRWLockExclusive(M)
+#define COND_INIT(C) InitializeConditionVariable(C)
+#define COND_DESTROY(C)
+#define COND_WAIT(C, M) SleepConditionVariableSRW(C, M, INFINITE, 0)
+#define COND_SIGNAL(C) WakeConditionVariable(C)
+#define COND_BROADCAST(C) WakeAllConditionVariable(C)
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#define MUTEX_LOCK(M) pthread_mutex_lock(M)
+#define MUTEX_UNLOCK(M) pthread_mutex_unlock(M)
+#define COND_INIT(C) pthread_cond_init(C, NULL)
+#define COND_DESTROY(C) pthread_cond_destroy(C)
+#define COND_WAIT(C, M) pthread_cond_wait(C, M)
+#define COND_SIGNAL(C) pthread_cond_signal(C)
+#define COND_BROADCAST(C) pthread_cond_broadcast(C)
+#endif
+
+struct Completion {
+    DcmFrame *frame;
+    DcmError *error;
+    void *user;
+    struct Completion *next;
+};
+
+struct Job {
+    DcmFilehandle *filehandle;
+    uint32_t frame_number;
+
+    // one of these is set
+    DcmFrameCallback callback;
+    DcmCompletionQueue *queue;
+    void *user;
+
+    // made when the read is queued, so delivering the result can't fail
+    struct Completion *completion;
+
+    struct Job *next;
+};
+
+struct _DcmAsyncState {
+    // pending reads, in the order they were made
+    struct Job *head;
+    struct Job *tail;
+
+    // reads not yet delivered, including the one being run
+    uint32_t pending;
+    Cond idle;
+
+    // on the pool queue, or being run by a worker
+    bool scheduled;
+    DcmAsyncState *next;
+};
+
+struct _DcmCompletionQueue {
+    Mutex lock;
+    Cond ready;
+
+    struct Completion *head;
+    struct Completion *tail;
+
+    // reads made against this queue which have not been taken from it
+    uint32_t outstanding;
+};
+
+// everything here is guarded by pool_lock
+static Mutex pool_lock;
+static Cond pool_work;
+static DcmAsyncState *pool_head;
+static DcmAsyncState *pool_tail;
+static uint32_t pool_threads = DEFAULT_THREADS;
+static uint32_t pool_running;
+
+#ifdef _WIN32
+// zero is SRWLOCK_INIT and CONDITION_VARIABLE_INIT
+static void pool_init(void)
+{
+}
+#else
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_init_once(void)
+{
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_work, NULL);
+}
+
+static void pool_init(void)
+{
+    pthread_once(&pool_once, pool_init_once);
+}
+#endif
+
+
+static void mutex_init(Mutex *mutex)
+{
+#ifdef _WIN32
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+
+static void mutex_destroy(Mutex *mutex)
+{
+#ifdef _WIN32
+    USED(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+
+static void deliver(struct Job *job, DcmFrame *frame, DcmError *error)
+{
+    if (job->callback) {
+        job->callback(error, frame, job->user);
+        dcm_error_clear(&error);
+        return;
+    }
+
+    DcmCompletionQueue *queue = job->queue;
+    struct Completion *completion = job->completion;
+    completion->frame = frame;
+    completion->error = error;
+    completion->user = job->user;
+    completion->next = NULL;
+
+    MUTEX_LOCK(&queue->lock);
+    if (queue->tail) {
+        queue->tail->next = completion;
+    } else {
+        queue->head = completion;
+    }
+    queue->tail = completion;
+    COND_BROADCAST(&queue->ready);
+    MUTEX_UNLOCK(&queue->lock);
+}
+
+
+static void pool_push(DcmAsyncState *state)
+{
+    state->next = NULL;
+    if (pool_tail) {
+        pool_tail->next = state;
+    } else {
+        pool_head = state;
+    }
+    pool_tail = state;
+}
+
+
+static void worker(void)
+{
+    MUTEX_LOCK(&pool_lock);
+
+    for (;;) {
+        if (pool_running > pool_threads) {
+            break;
+        }
+        if (pool_head == NULL) {
+            COND_WAIT(&pool_work, &pool_lock);
+            continue;
+        }
+
+        DcmAsyncState *state = pool_head;
+        pool_head = state->next;
+        if (pool_head == NULL) {
+            pool_tail = NULL;
+        }
+
+        struct Job *job = state->head;
+        state->head = job->next;
+        if (state->head == NULL) {
+            state->tail = NULL;
+        }
+
+        MUTEX_UNLOCK(&pool_lock);
+
+        DcmError *error = NULL;
+        DcmFrame *frame = dcm_filehandle_read_frame(&error,
+                                                    job->filehandle,
+                                                    job->frame_number);
+        deliver(job, frame, error);
+        free(job);
+
+        MUTEX_LOCK(&pool_lock);
+
+        // back of the queue, to be fair to other filehandles
+        if (state->head) {
+            pool_push(state);
+        } else {
+            state->scheduled = false;
+        }
+        state->pending -= 1;
+        if (state->pending == 0) {
+            COND_BROADCAST(&state->idle);
+        }
+    }
+
+    pool_running -= 1;
+    MUTEX_UNLOCK(&pool_lock);
+}
+
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+{
+    USED(arg);
+    worker();
+    return 0;
+}
+#else
+static void *worker_main(void *arg)
+{
+    USED(arg);
+    worker();
+    return NULL;
+}
+#endif
+
+
+// call with pool_lock held
+static bool pool_start(DcmError **error)
+{
+    while (pool_running < pool_threads) {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, worker_main, NULL, 0, NULL);
+        bool started = thread != NULL;
+        if (started) {
+            CloseHandle(thread);
+        }
+#else
+        pthread_t thread;
+        bool started = pthread_create(&thread, NULL, worker_main, NULL) == 0;
+        if (started) {
+            pthread_detach(thread);
+        }
+#endif
+        if (!started) {
+            // we can carry on with fewer threads, as long as we have one
+            if (pool_running > 0) {
+                break;
+            }
+            dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                          "starting worker threads failed",
+                          "unable to create thread");
+            return false;
+        }
+        pool_running += 1;
+    }
+
+    return true;
+}
+
+
+bool dcm_async_set_threads(DcmError **error, uint32_t n_threads)
+{
+    if (n_threads == 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "setting worker threads failed",
+                      "there must be at least one thread");
+        return false;
+    }
+
+    pool_init();
+
+    MUTEX_LOCK(&pool_lock);
+    pool_threads = n_threads;
+    // extra threads notice and exit, new ones start with the next read
+    COND_BROADCAST(&pool_work);
+    MUTEX_UNLOCK(&pool_lock);
+
+    return true;
+}
+
+
+DcmAsyncState *dcm_async_state_create(DcmError **error)
+{
+    DcmAsyncState *state = DCM_NEW(error, DcmAsyncState);
+    if (state == NULL) {
+        return NULL;
+    }
+    COND_INIT(&state->idle);
+
+    return state;
+}
+
+
+void dcm_async_state_destroy(DcmAsyncState *state)
+{
+    if (state) {
+        pool_init();
+
+        MUTEX_LOCK(&pool_lock);
+        while (state->pending > 0) {
+            COND_WAIT(&state->idle, &pool_lock);
+        }
+        MUTEX_UNLOCK(&pool_lock);
+
+        COND_DESTROY(&state->idle);
+        free(state);
+    }
+}
+
+
+bool dcm_async_read_frame(DcmError **error,
+                          DcmAsyncState *state,
+                          DcmFilehandle *filehandle,
+                          uint32_t frame_number,
+                          DcmFrameCallback callback,
+                          DcmCompletionQueue *queue,
+                          void *user)
+{
+    struct Job *job = DCM_NEW(error, struct Job);
+    if (job == NULL) {
+        return false;
+    }
+    job->filehandle = filehandle;
+    job->frame_number = frame_number;
+    job->callback = callback;
+    job->queue = queue;
+    job->user = user;
+    if (queue) {
+        job->completion = DCM_NEW(error, struct Completion);
+        if (job->completion == NULL) {
+            free(job);
+            return false;
+        }
+    }
+
+    pool_init();
+
+    MUTEX_LOCK(&pool_lock);
+    if (!pool_start(error)) {
+        MUTEX_UNLOCK(&pool_lock);
+        free(job->completion);
+        free(job);
+        return false;
+    }
+
+    if (queue) {
+        // the queue has its own lock, but it always nests inside ours
+        MUTEX_LOCK(&queue->lock);
+        queue->outstanding += 1;
+        MUTEX_UNLOCK(&queue->lock);
+    }
+
+    if (state->tail) {
+        state->tail->next = job;
+    } else {
+        state->head = job;
+    }
+    state->tail = job;
+    state->pending += 1;
+
+    if (!state->scheduled) {
+        state->scheduled = true;
+        pool_push(state);
+        COND_SIGNAL(&pool_work);
+    }
+    MUTEX_UNLOCK(&pool_lock);
+
+    return true;
+}
+
+
+DcmCompletionQueue *dcm_completion_queue_create(DcmError **error)
+{
+    DcmCompletionQueue *queue = DCM_NEW(error, DcmCompletionQueue);
+    if (queue == NULL) {
+        return NULL;
+    }
+    mutex_init(&queue->lock);
+    COND_INIT(&queue->ready);
+
+    return queue;
+}
+
+
+bool dcm_completion_queue_next(DcmCompletionQueue *queue,
+                               bool wait,
+                               DcmFrame **frame,
+                               DcmError **error,
+                               void **user)
+{
+    MUTEX_LOCK(&queue->lock);
+    while (wait && queue->head == NULL && queue->outstanding > 0) {
+        COND_WAIT(&queue->ready, &queue->lock);
+    }
+
+    struct Completion *completion = queue->head;
+    if (completion) {
+        queue->head = completion->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->outstanding -= 1;
+    }
+    MUTEX_UNLOCK(&queue->lock);
+
+    if (completion == NULL) {
+        return false;
+    }
+
+    *frame = completion->frame;
+    if (user) {
+        *user = completion->user;
+    }
+    if (error) {
+        *error = completion->error;
+    } else {
+        dcm_error_clear(&completion->error);
+    }
+    free(completion);
+
+    return true;
+}
+
+
+void dcm_completion_queue_destroy(DcmCompletionQueue *queue)
+{
+    if (queue) {
+        struct Completion *completion = queue->head;
+        while (completion) {
+            struct Completion *next = completion->next;
+            dcm_frame_destroy(completion->frame);
+            dcm_error_clear(&completion->error);
+            free(completion);
+            completion = next;
+        }
+
+        COND_DESTROY(&queue->ready);
+        mutex_destroy(&queue->lock);
+        free(queue);
+    }
+}
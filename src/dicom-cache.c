@@ -0,0 +1,898 @@
+/*
+ * Caches of frames, so repeated reads of the same frame need no IO.
+ */
+
+#include "config.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SHM_OPEN
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uthash.h"
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+
+/* The key is the frame number followed by the identity of the file, with
+ * no terminating null.
+ */
+#define MAX_KEY_LENGTH (sizeof(uint32_t) + DCM_MAX_CACHE_IDENTITY)
+
+
+struct CacheEntry {
+    DcmFrame *frame;
+    UT_hash_handle hh;
+    unsigned key_length;
+    char key[];
+};
+
+
+struct _DcmFrameCache {
+    // the hash keeps entries in the order they were added, so we re-add
+    // entries when they are used, and the head is always the least recently
+    // used
+    struct CacheEntry *entries;
+
+    // bytes of frame data we hold, and the most we may hold
+    uint64_t size;
+    uint64_t budget;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+
+static unsigned make_key(char *key, const char *identity, uint32_t number)
+{
+    size_t identity_length = strlen(identity);
+
+    memcpy(key, &number, sizeof(number));
+    memcpy(key + sizeof(number), identity, identity_length);
+
+    return (unsigned) (sizeof(number) + identity_length);
+}
+
+
+DcmFrameCache *dcm_frame_cache_create(DcmError **error, uint64_t budget)
+{
+    DcmFrameCache *cache = DCM_NEW(error, DcmFrameCache);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->budget = budget;
+
+    return cache;
+}
+
+
+static void cache_remove(DcmFrameCache *cache, struct CacheEntry *entry)
+{
+    HASH_DELETE(hh, cache->entries, entry);
+    cache->size -= dcm_frame_get_length(entry->frame);
+    dcm_frame_destroy(entry->frame);
+    free(entry);
+}
+
+
+// evict from the least recently used end until length more bytes fit
+static void cache_make_room(DcmFrameCache *cache, uint64_t length)
+{
+    struct CacheEntry *entry, *tmp;
+
+    HASH_ITER(hh, cache->entries, entry, tmp) {
+        if (cache->size + length <= cache->budget) {
+            break;
+        }
+        cache_remove(cache, entry);
+    }
+}
+
+
+void dcm_frame_cache_destroy(DcmFrameCache *cache)
+{
+    if (cache) {
+        struct CacheEntry *entry, *tmp;
+
+        HASH_ITER(hh, cache->entries, entry, tmp) {
+            cache_remove(cache, entry);
+        }
+        free(cache);
+    }
+}
+
+
+DcmFrame *dcm_frame_cache_get(DcmFrameCache *cache,
+                              const char *identity,
+                              uint32_t number)
+{
+    char key[MAX_KEY_LENGTH];
+    unsigned key_length = make_key(key, identity, number);
+    struct CacheEntry *entry;
+
+    HASH_FIND(hh, cache->entries, key, key_length, entry);
+    if (entry == NULL) {
+        cache->misses += 1;
+        return NULL;
+    }
+
+    // move to the most recently used end
+    HASH_DELETE(hh, cache->entries, entry);
+    HASH_ADD(hh, cache->entries, key, entry->key_length, entry);
+    cache->hits += 1;
+
+    return dcm_frame_ref(entry->frame);
+}
+
+
+bool dcm_frame_cache_put(DcmError **error,
+                         DcmFrameCache *cache,
+                         const char *identity,
+                         DcmFrame *frame)
+{
+    char key[MAX_KEY_LENGTH];
+    unsigned key_length = make_key(key,
+                                   identity,
+                                   dcm_frame_get_number(frame));
+    uint64_t length = dcm_frame_get_length(frame);
+    struct CacheEntry *entry;
+
+    // too large to ever fit, or already there
+    HASH_FIND(hh, cache->entries, key, key_length, entry);
+    if (length > cache->budget || entry) {
+        return true;
+    }
+
+    entry = DCM_MALLOC(error, sizeof(struct CacheEntry) + key_length);
+    if (entry == NULL) {
+        return false;
+    }
+    entry->frame = dcm_frame_ref(frame);
+    entry->key_length = key_length;
+    memcpy(entry->key, key, key_length);
+
+    cache_make_room(cache, length);
+    HASH_ADD(hh, cache->entries, key, entry->key_length, entry);
+    cache->size += length;
+
+    return true;
+}
+
+
+void dcm_frame_cache_get_stats(const DcmFrameCache *cache,
+                               uint64_t *hits,
+                               uint64_t *misses)
+{
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+
+/* The shared cache is split into shards by key, each with its own lock,
+ * so threads reading different frames rarely wait for each other.
+ *
+ * The budget is for the whole cache, and a small lock guards the count of
+ * bytes held in all shards. When a put takes the cache over budget, we
+ * evict the least recently used frames shard by shard, starting after the
+ * shard we added to, until it fits again. A shard lock can be taken before
+ * the size lock, but never the other way round.
+ */
+#define SHARED_CACHE_SHARDS (64)
+
+#ifdef _WIN32
+typedef SRWLOCK Mutex;
+#define MUTEX_LOCK(M) AcquireSRWLockExclusive(M)
+#define MUTEX_UNLOCK(M) ReleaseSRWLockExclusive(M)
+#else
+typedef pthread_mutex_t Mutex;
+#define MUTEX_LOCK(M) pthread_mutex_lock(M)
+#define MUTEX_UNLOCK(M) pthread_mutex_unlock(M)
+#endif
+
+struct Shard {
+    Mutex lock;
+    DcmFrameCache *cache;
+};
+
+static struct Shard shared_shards[SHARED_CACHE_SHARDS];
+
+// bytes of frame data in all shards, and the most we may hold
+static Mutex shared_size_lock;
+static uint64_t shared_size;
+static uint64_t shared_budget;
+
+#ifdef _WIN32
+// zero is SRWLOCK_INIT, so there's nothing to do
+static void shared_cache_init(void)
+{
+}
+#else
+static pthread_once_t shared_cache_once = PTHREAD_ONCE_INIT;
+
+static void shared_cache_init_shards(void)
+{
+    for (int i = 0; i < SHARED_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shared_shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&shared_size_lock, NULL);
+}
+
+static void shared_cache_init(void)
+{
+    pthread_once(&shared_cache_once, shared_cache_init_shards);
+}
+#endif
+
+
+static int shared_cache_shard(const char *identity, uint32_t number)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ number;
+    hash *= 16777619u;
+    for (const char *p = identity; *p; p++) {
+        hash ^= (unsigned char) *p;
+        hash *= 16777619u;
+    }
+
+    return hash % SHARED_CACHE_SHARDS;
+}
+
+
+// call with the shard locked, after its size has changed from old_size
+static void shared_cache_account(struct Shard *shard, uint64_t old_size)
+{
+    uint64_t new_size = shard->cache ? shard->cache->size : 0;
+
+    MUTEX_LOCK(&shared_size_lock);
+    shared_size = shared_size - old_size + new_size;
+    MUTEX_UNLOCK(&shared_size_lock);
+}
+
+
+static bool shared_cache_over_budget(void)
+{
+    MUTEX_LOCK(&shared_size_lock);
+    bool over = shared_size > shared_budget;
+    MUTEX_UNLOCK(&shared_size_lock);
+
+    return over;
+}
+
+
+// evict from each shard in turn, starting with first, until we're in budget
+static void shared_cache_trim(int first)
+{
+    for (int i = 0; i < SHARED_CACHE_SHARDS; i++) {
+        int index = (first + i) % SHARED_CACHE_SHARDS;
+        struct Shard *shard = &shared_shards[index];
+        struct CacheEntry *entry, *tmp;
+
+        if (!shared_cache_over_budget()) {
+            break;
+        }
+
+        MUTEX_LOCK(&shard->lock);
+        if (shard->cache) {
+            HASH_ITER(hh, shard->cache->entries, entry, tmp) {
+                if (!shared_cache_over_budget()) {
+                    break;
+                }
+                uint64_t old_size = shard->cache->size;
+                cache_remove(shard->cache, entry);
+                shared_cache_account(shard, old_size);
+            }
+        }
+        MUTEX_UNLOCK(&shard->lock);
+    }
+}
+
+
+bool dcm_shared_frame_cache_set_budget(DcmError **error, uint64_t budget)
+{
+    shared_cache_init();
+
+    MUTEX_LOCK(&shared_size_lock);
+    shared_budget = budget;
+    MUTEX_UNLOCK(&shared_size_lock);
+
+    for (int i = 0; i < SHARED_CACHE_SHARDS; i++) {
+        struct Shard *shard = &shared_shards[i];
+        bool success = true;
+
+        MUTEX_LOCK(&shard->lock);
+        uint64_t old_size = shard->cache ? shard->cache->size : 0;
+        if (budget == 0) {
+            // frames in use stay valid, since they hold a reference
+            dcm_frame_cache_destroy(shard->cache);
+            shard->cache = NULL;
+        } else if (shard->cache) {
+            // each shard may hold up to the whole budget, so a single frame
+            // can be as large as the budget
+            shard->cache->budget = budget;
+            cache_make_room(shard->cache, 0);
+        } else {
+            shard->cache = dcm_frame_cache_create(error, budget);
+            success = shard->cache != NULL;
+        }
+        shared_cache_account(shard, old_size);
+        MUTEX_UNLOCK(&shard->lock);
+
+        if (!success) {
+            return false;
+        }
+    }
+
+    shared_cache_trim(0);
+
+    return true;
+}
+
+
+void dcm_shared_frame_cache_get_stats(uint64_t *hits, uint64_t *misses)
+{
+    *hits = 0;
+    *misses = 0;
+
+    shared_cache_init();
+
+    for (int i = 0; i < SHARED_CACHE_SHARDS; i++) {
+        struct Shard *shard = &shared_shards[i];
+
+        MUTEX_LOCK(&shard->lock);
+        if (shard->cache) {
+            *hits += shard->cache->hits;
+            *misses += shard->cache->misses;
+        }
+        MUTEX_UNLOCK(&shard->lock);
+    }
+}
+
+
+DcmFrame *dcm_shared_frame_cache_get(const char *identity, uint32_t number)
+{
+    int index = shared_cache_shard(identity, number);
+    struct Shard *shard = &shared_shards[index];
+    DcmFrame *frame = NULL;
+
+    shared_cache_init();
+
+    MUTEX_LOCK(&shard->lock);
+    if (shard->cache) {
+        frame = dcm_frame_cache_get(shard->cache, identity, number);
+    }
+    MUTEX_UNLOCK(&shard->lock);
+
+    return frame;
+}
+
+
+bool dcm_shared_frame_cache_put(DcmError **error,
+                                const char *identity,
+                                DcmFrame *frame)
+{
+    int index = shared_cache_shard(identity, dcm_frame_get_number(frame));
+    struct Shard *shard = &shared_shards[index];
+    bool success = true;
+
+    shared_cache_init();
+
+    MUTEX_LOCK(&shard->lock);
+    if (shard->cache) {
+        uint64_t old_size = shard->cache->size;
+        success = dcm_frame_cache_put(error, shard->cache, identity, frame);
+        shared_cache_account(shard, old_size);
+    }
+    MUTEX_UNLOCK(&shard->lock);
+
+    // the frame we just added is the last to go
+    shared_cache_trim(index + 1);
+
+    return success;
+}
+
+
+/* The shared memory cache is a table of fixed-size slots, split into
+ * buckets of SHM_WAYS slots. A frame can only go in the bucket its key
+ * hashes to, and replaces the least recently used slot there.
+ *
+ * Each slot has a sequence number which is odd while the slot is being
+ * written. Readers copy the frame out and then check the sequence number
+ * has not changed, so lookups take no locks, and writers claim a slot with
+ * a compare-and-swap, passing over slots another process is writing.
+ *
+ * A writer which dies leaves its slot odd. The low 32 bits of the sequence
+ * number count writes, and while a slot is odd the high 32 bits hold the
+ * writer's pid, so claiming a slot and recording who claimed it is a
+ * single compare-and-swap. A slot whose writer no longer exists can be
+ * claimed by another writer.
+ * We never take a slot from a writer which is alive, however long it
+ * takes, since it would go on writing over whatever the new owner puts
+ * there. The pid check only works within one PID namespace: a writer in
+ * another namespace looks dead, so all processes sharing a cache must be
+ * in the same one.
+ */
+#define SHM_MAGIC (0x4d534344)
+#define SHM_VERSION (3)
+#define SHM_WAYS (4)
+
+/* Processes which open a cache just after another creates it wait for the
+ * creator to set it up, polling every SHM_OPEN_POLL_MS for up to
+ * SHM_OPEN_POLLS times.
+ */
+#define SHM_OPEN_POLL_MS (10)
+#define SHM_OPEN_POLLS (200)
+
+struct ShmHeader {
+    // set last, once the rest of the header is ready
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_buckets;
+    uint32_t slot_size;
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct ShmSlot {
+    uint64_t sequence;
+    // the tick of the last use
+    uint64_t used;
+
+    uint32_t key_length;
+    uint32_t length;
+    char key[MAX_KEY_LENGTH];
+    // followed by slot_size bytes of frame data
+};
+
+struct _DcmShmFrameCache {
+    struct ShmHeader *header;
+    size_t size;
+    size_t stride;
+};
+
+
+#ifdef HAVE_SHM_OPEN
+static size_t shm_stride(uint32_t slot_size)
+{
+    size_t stride = sizeof(struct ShmSlot) + slot_size;
+
+    // keep the sequence numbers aligned
+    return (stride + 63) & ~((size_t) 63);
+}
+
+
+static struct ShmSlot *shm_slot(const DcmShmFrameCache *cache,
+                                uint32_t bucket,
+                                uint32_t way)
+{
+    char *slots = (char *) cache->header + sizeof(struct ShmHeader);
+    size_t index = (size_t) bucket * SHM_WAYS + way;
+
+    return (struct ShmSlot *) (slots + index * cache->stride);
+}
+
+
+static void shm_pause(void)
+{
+    struct timespec pause = {0, SHM_OPEN_POLL_MS * 1000000L};
+
+    (void) nanosleep(&pause, NULL);
+}
+
+
+// true if the writer of an odd sequence number has died
+static bool shm_slot_abandoned(uint64_t sequence)
+{
+    pid_t writer = (pid_t) (sequence >> 32);
+
+    return writer > 0 && kill(writer, 0) != 0 && errno == ESRCH;
+}
+
+
+// the sequence number for a write by us ... an even sequence becomes odd,
+// an abandoned odd one stays odd
+static uint64_t shm_claim_sequence(uint64_t sequence)
+{
+    uint32_t count = (uint32_t) sequence;
+
+    count += count % 2 == 1 ? 2 : 1;
+
+    return ((uint64_t) (uint32_t) getpid() << 32) | count;
+}
+
+
+static uint32_t shm_bucket(const DcmShmFrameCache *cache,
+                           const char *key,
+                           unsigned key_length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < key_length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash % cache->header->n_buckets;
+}
+
+
+DcmShmFrameCache *dcm_shm_frame_cache_open(DcmError **error,
+                                           const char *name,
+                                           uint32_t n_frames,
+                                           uint32_t max_frame_size)
+{
+    uint32_t n_buckets = n_frames / SHM_WAYS + !!(n_frames % SHM_WAYS);
+    size_t stride = shm_stride(max_frame_size);
+    size_t size = sizeof(struct ShmHeader) +
+                  (size_t) n_buckets * SHM_WAYS * stride;
+    if (n_buckets == 0 ||
+        (size - sizeof(struct ShmHeader)) / SHM_WAYS / stride != n_buckets) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "opening shared memory cache failed",
+                      "bad cache size");
+        return NULL;
+    }
+
+    DcmShmFrameCache *cache = DCM_NEW(error, DcmShmFrameCache);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    // the first process to open the segment sets it up
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+                      "opening shared memory cache failed",
+                      "unable to open %s - %s", name, strerror(errno));
+        free(cache);
+        return NULL;
+    }
+
+    struct stat info;
+    if (created) {
+        if (ftruncate(fd, (off_t) size) != 0) {
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                          "opening shared memory cache failed",
+                          "unable to size %s - %s", name, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            free(cache);
+            return NULL;
+        }
+    } else {
+        // the creator sets the whole size at once, so any size will do
+        for (int poll = 0; ; poll++) {
+            if (fstat(fd, &info) != 0) {
+                dcm_error_set(error, DCM_ERROR_CODE_IO,
+                              "opening shared memory cache failed",
+                              "unable to stat %s - %s",
+                              name, strerror(errno));
+                close(fd);
+                free(cache);
+                return NULL;
+            }
+            if (info.st_size > 0 || poll == SHM_OPEN_POLLS) {
+                break;
+            }
+            shm_pause();
+        }
+        if ((size_t) info.st_size < sizeof(struct ShmHeader)) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "opening shared memory cache failed",
+                          "%s is not a frame cache, or is not ready", name);
+            close(fd);
+            free(cache);
+            return NULL;
+        }
+        size = (size_t) info.st_size;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+                      "opening shared memory cache failed",
+                      "unable to map %s - %s", name, strerror(errno));
+        if (created) {
+            shm_unlink(name);
+        }
+        free(cache);
+        return NULL;
+    }
+    cache->header = (struct ShmHeader *) map;
+    cache->size = size;
+
+    if (created) {
+        // the new segment is all zeros, so every slot is empty
+        cache->header->version = SHM_VERSION;
+        cache->header->n_buckets = n_buckets;
+        cache->header->slot_size = (uint32_t) (stride - sizeof(struct ShmSlot));
+        __atomic_store_n(&cache->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        // and then writes the header
+        uint32_t magic;
+        for (int poll = 0; ; poll++) {
+            magic = __atomic_load_n(&cache->header->magic, __ATOMIC_ACQUIRE);
+            if (magic == SHM_MAGIC || poll == SHM_OPEN_POLLS) {
+                break;
+            }
+            shm_pause();
+        }
+
+        // the geometry of an existing segment wins over what we asked for
+        if (magic != SHM_MAGIC ||
+            cache->header->version != SHM_VERSION ||
+            sizeof(struct ShmHeader) +
+                (size_t) cache->header->n_buckets * SHM_WAYS *
+                shm_stride(cache->header->slot_size) > size) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "opening shared memory cache failed",
+                          "%s is not a frame cache, or is not ready", name);
+            munmap(map, size);
+            free(cache);
+            return NULL;
+        }
+    }
+    cache->stride = shm_stride(cache->header->slot_size);
+
+    return cache;
+}
+
+
+void dcm_shm_frame_cache_destroy(DcmShmFrameCache *cache)
+{
+    if (cache) {
+        munmap(cache->header, cache->size);
+        free(cache);
+    }
+}
+
+
+bool dcm_shm_frame_cache_unlink(DcmError **error, const char *name)
+{
+    if (shm_unlink(name) != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+                      "removing shared memory cache failed",
+                      "unable to remove %s - %s", name, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+void dcm_shm_frame_cache_get_stats(const DcmShmFrameCache *cache,
+                                   uint64_t *hits,
+                                   uint64_t *misses)
+{
+    *hits = __atomic_load_n(&cache->header->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->header->misses, __ATOMIC_RELAXED);
+}
+
+
+char *dcm_shm_frame_cache_get(DcmShmFrameCache *cache,
+                              const char *identity,
+                              uint32_t number,
+                              uint32_t *length)
+{
+    struct ShmHeader *header = cache->header;
+    char key[MAX_KEY_LENGTH];
+    unsigned key_length = make_key(key, identity, number);
+    uint32_t bucket = shm_bucket(cache, key, key_length);
+
+    for (uint32_t way = 0; way < SHM_WAYS; way++) {
+        struct ShmSlot *slot = shm_slot(cache, bucket, way);
+        uint64_t sequence = __atomic_load_n(&slot->sequence,
+                                            __ATOMIC_ACQUIRE);
+        uint32_t slot_length = slot->length;
+
+        if (sequence == 0 ||
+            sequence % 2 == 1 ||
+            slot->key_length != key_length ||
+            slot_length == 0 ||
+            slot_length > header->slot_size ||
+            memcmp(slot->key, key, key_length) != 0) {
+            continue;
+        }
+
+        char *data = malloc(slot_length);
+        if (data == NULL) {
+            break;
+        }
+        memcpy(data, (char *) slot + sizeof(struct ShmSlot), slot_length);
+
+        // if a writer got in while we were copying, we may have a mix of
+        // two frames
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+            free(data);
+            break;
+        }
+
+        uint64_t tick = __atomic_add_fetch(&header->tick, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->used, tick, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&header->hits, 1, __ATOMIC_RELAXED);
+        *length = slot_length;
+
+        return data;
+    }
+
+    __atomic_add_fetch(&header->misses, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+
+void dcm_shm_frame_cache_put(DcmShmFrameCache *cache,
+                             const char *identity,
+                             uint32_t number,
+                             const char *data,
+                             uint32_t length)
+{
+    struct ShmHeader *header = cache->header;
+    char key[MAX_KEY_LENGTH];
+    unsigned key_length = make_key(key, identity, number);
+    uint32_t bucket = shm_bucket(cache, key, key_length);
+
+    if (length == 0 || length > header->slot_size) {
+        return;
+    }
+
+    // pick an empty slot, a slot abandoned by a dead writer, or the least
+    // recently used, passing over slots being written
+    struct ShmSlot *victim = NULL;
+    uint64_t victim_sequence = 0;
+    uint64_t victim_used = UINT64_MAX;
+    for (uint32_t way = 0; way < SHM_WAYS; way++) {
+        struct ShmSlot *slot = shm_slot(cache, bucket, way);
+        uint64_t sequence = __atomic_load_n(&slot->sequence,
+                                            __ATOMIC_ACQUIRE);
+        uint64_t used = __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+
+        if (sequence % 2 == 1) {
+            if (shm_slot_abandoned(sequence)) {
+                victim = slot;
+                victim_sequence = sequence;
+                break;
+            }
+            continue;
+        }
+        if (sequence == 0) {
+            victim = slot;
+            victim_sequence = sequence;
+            break;
+        }
+        if (used < victim_used) {
+            victim = slot;
+            victim_sequence = sequence;
+            victim_used = used;
+        }
+    }
+
+    uint64_t sequence = victim_sequence;
+    uint64_t claimed = shm_claim_sequence(sequence);
+    if (victim == NULL ||
+        !__atomic_compare_exchange_n(&victim->sequence,
+                                     &sequence,
+                                     claimed,
+                                     false,
+                                     __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) {
+        // every slot is busy, or someone got in before us
+        return;
+    }
+
+    victim->key_length = key_length;
+    victim->length = length;
+    memcpy(victim->key, key, key_length);
+    memcpy((char *) victim + sizeof(struct ShmSlot), data, length);
+
+    uint64_t tick = __atomic_add_fetch(&header->tick, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->used, tick, __ATOMIC_RELAXED);
+
+    // only fails if another writer has decided we are dead, in which case
+    // we publish nothing ... publishing clears our pid
+    (void) __atomic_compare_exchange_n(&victim->sequence,
+                                       &claimed,
+                                       (uint32_t) claimed + 1,
+                                       false,
+                                       __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+}
+#else
+DcmShmFrameCache *dcm_shm_frame_cache_open(DcmError **error,
+                                           const char *name,
+                                           uint32_t n_frames,
+                                           uint32_t max_frame_size)
+{
+    USED(name);
+    USED(n_frames);
+    USED(max_frame_size);
+
+    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                  "opening shared memory cache failed",
+                  "shared memory is not supported on this platform");
+
+    return NULL;
+}
+
+
+void dcm_shm_frame_cache_destroy(DcmShmFrameCache *cache)
+{
+    USED(cache);
+}
+
+
+bool dcm_shm_frame_cache_unlink(DcmError **error, const char *name)
+{
+    USED(name);
+
+    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                  "removing shared memory cache failed",
+                  "shared memory is not supported on this platform");
+
+    return false;
+}
+
+
+void dcm_shm_frame_cache_get_stats(const DcmShmFrameCache *cache,
+                                   uint64_t *hits,
+                                   uint64_t *misses)
+{
+    USED(cache);
+
+    *hits = 0;
+    *misses = 0;
+}
+
+
+char *dcm_shm_frame_cache_get(DcmShmFrameCache *cache,
+                              const char *identity,
+                              uint32_t number,
+                              uint32_t *length)
+{
+    USED(cache);
+    USED(identity);
+    USED(number);
+    USED(length);
+
+    return NULL;
+}
+
+
+void dcm_shm_frame_cache_put(DcmShmFrameCache *cache,
+                             const char *identity,
+                             uint32_t number,
+                             const char *data,
+                             uint32_t length)
+{
+    USED(cache);
+    USED(identity);
+    USED(number);
+    USED(data);
+    USED(length);
+}
+#endif
@@ -19,6 +19,10 @@
 #include <string.h>
 #include <inttypes.h>
 
+#if defined(_WIN32) && !defined(__GNUC__)
+#include <windows.h>
+#endif
+
 #include "utarray.h"
 #include "uthash.h"
 
@@ -33,6 +37,16 @@ struct _DcmElement {
     uint32_t vm;
     bool assigned;
 
+    // made from trusted input, so values are not checked against the
+    // dictionary
+    bool trusted;
+
+    // a binary value or sequence left in the input, read on first use
+    DcmBulkRead bulk_read;
+    DcmSequenceRead sequence_read;
+    void *bulk_client;
+    int64_t bulk_offset;
+
     // Store values for multiplicity 1 (the most common case)
     // inside the element to reduce malloc/frees during build
     union {
@@ -95,6 +109,9 @@ struct _DcmDataSet {
 
 
 struct _DcmFrame {
+    // frames can be shared with a frame cache, and between threads
+    volatile long references;
+
     uint32_t number;
     const char *data;
     uint32_t length;
@@ -167,9 +184,13 @@ static int compare_tags(const void *a, const void *b)
 }
 
 
-DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
+static DcmElement *element_create(DcmError **error,
+                                  uint32_t tag,
+                                  DcmVR vr,
+                                  bool trusted)
 {
-    if (!dcm_is_valid_vr_for_tag(vr, tag)) {
+    if (trusted ?
+        (vr < 0 || vr >= DCM_VR_LAST) : !dcm_is_valid_vr_for_tag(vr, tag)) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
                       "incorrect tag",
                       "tag %08x does not allow VR %s",
@@ -184,11 +205,26 @@ DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
     }
     element->tag = tag;
     element->vr = vr;
+    element->trusted = trusted;
 
     return element;
 }
 
 
+DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
+{
+    return element_create(error, tag, vr, false);
+}
+
+
+DcmElement *dcm_element_create_trusted(DcmError **error,
+                                       uint32_t tag,
+                                       DcmVR vr)
+{
+    return element_create(error, tag, vr, true);
+}
+
+
 void dcm_element_destroy(DcmElement *element)
 {
     if (element) {
@@ -377,6 +413,13 @@ static bool dcm_element_validate(DcmError **error, DcmElement *element)
         return false;
     }
 
+    // the parser has already checked the length is a whole number of
+    // values, and there is nothing else we need for safety
+    if (element->trusted) {
+        element->assigned = true;
+        return true;
+    }
+
     if (!dcm_is_valid_vr_for_tag(element->vr, element->tag)) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
                       "data element validation failed",
@@ -753,6 +796,30 @@ bool dcm_element_set_value_numeric_multi(DcmError **error,
 }
 
 
+bool dcm_element_get_value_numeric_array(DcmError **error,
+                                         const DcmElement *element,
+                                         DcmVR *vr,
+                                         const void **values,
+                                         uint32_t *vm)
+{
+    if (!element_check_assigned(error, element) ||
+        !element_check_numeric(error, element)) {
+        return false;
+    }
+
+    // single values are held in the element, multiple values in an array
+    if (element->vm == 1) {
+        *values = &element->value.single;
+    } else {
+        *values = element->value.multi.sl;
+    }
+    *vr = element->vr;
+    *vm = element->vm;
+
+    return true;
+}
+
+
 // the float values
 
 // use a VR to marshall a double pointer into a float
@@ -869,12 +936,69 @@ bool dcm_element_get_value_binary(DcmError **error,
         return false;
     }
 
+    if (element->bulk_read && element->value.single.bytes == NULL) {
+        char *bytes = DCM_MALLOC(error, MAX(element->length, 1));
+        if (bytes == NULL ||
+            !element->bulk_read(error,
+                                element->bulk_client,
+                                element->bulk_offset,
+                                bytes,
+                                element->length)) {
+            free(bytes);
+            return false;
+        }
+
+        // the value is fetched once and then kept, like any other
+        DcmElement *loaded = (DcmElement *) element;
+        loaded->value.single.bytes = bytes;
+        loaded->value_pointer = bytes;
+    }
+
     *value = element->value.single.bytes;
 
     return true;
 }
 
 
+bool dcm_element_read_value_binary(DcmError **error,
+                                   const DcmElement *element,
+                                   uint32_t offset,
+                                   void *buffer,
+                                   uint32_t length)
+{
+    if (!element_check_assigned(error, element) ||
+        !element_check_binary(error, element)) {
+        return false;
+    }
+
+    if (offset > element->length ||
+        length > element->length - offset) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "reading binary value failed",
+                      "%u bytes at offset %u is outside the value of "
+                      "element tag %08x",
+                      length,
+                      offset,
+                      element->tag);
+        return false;
+    }
+
+    if (element->bulk_read && element->value.single.bytes == NULL) {
+        return element->bulk_read(error,
+                                  element->bulk_client,
+                                  element->bulk_offset + offset,
+                                  buffer,
+                                  length);
+    }
+
+    if (length > 0) {
+        memcpy(buffer, element->value.single.bytes + offset, length);
+    }
+
+    return true;
+}
+
+
 bool dcm_element_set_value_binary(DcmError **error,
                                   DcmElement *element,
                                   void *value,
@@ -915,6 +1039,28 @@ bool dcm_element_set_value_binary(DcmError **error,
 }
 
 
+bool dcm_element_set_value_bulk(DcmError **error,
+                                DcmElement *element,
+                                DcmBulkRead read,
+                                void *client,
+                                int64_t offset,
+                                uint32_t length)
+{
+    if (!element_check_not_assigned(error, element) ||
+        !element_check_binary(error, element)) {
+        return false;
+    }
+
+    element->bulk_read = read;
+    element->bulk_client = client;
+    element->bulk_offset = offset;
+    element->vm = 1;
+    element_set_length(element, length);
+
+    return dcm_element_validate(error, element);
+}
+
+
 /* Set a value from a generic byte buffer. The byte buffer must have been
  * correctly formatted.
  */
@@ -976,6 +1122,65 @@ bool dcm_element_set_value(DcmError **error,
     return true;
 }
 
+bool dcm_element_set_value_borrowed(DcmError **error,
+                                    DcmElement *element,
+                                    const char *value,
+                                    uint32_t length)
+{
+    size_t size;
+
+    // the element never writes to a value it holds, so we can drop const
+    switch (dcm_dict_vr_class(element->vr)) {
+        case DCM_VR_CLASS_BINARY:
+            if (!dcm_element_set_value_binary(error,
+                                              element,
+                                              (char *) value,
+                                              length,
+                                              true)) {
+                return false;
+            }
+            break;
+
+        case DCM_VR_CLASS_NUMERIC_DECIMAL:
+        case DCM_VR_CLASS_NUMERIC_INTEGER:
+            // arrays are read in place, so they must be aligned, and single
+            // values are copied into the element anyway
+            size = dcm_dict_vr_size(element->vr);
+            if (size > 0 &&
+                length % size == 0 &&
+                length / size > 1 &&
+                (uintptr_t) value % size == 0) {
+                if (!dcm_element_set_value_numeric_multi(error,
+                                                         element,
+                                                         (char *) value,
+                                                         length / size,
+                                                         true)) {
+                    return false;
+                }
+                break;
+            }
+
+            return dcm_element_set_value(error,
+                                         element,
+                                         (char *) value,
+                                         length,
+                                         false);
+
+        default:
+            return dcm_element_set_value(error,
+                                         element,
+                                         (char *) value,
+                                         length,
+                                         false);
+    }
+
+    // we set the value as if we'd stolen it, but it's not ours to free
+    element->value_pointer = NULL;
+
+    return true;
+}
+
+
 // Sequence Data Element
 
 static bool element_check_sequence(DcmError **error,
@@ -994,12 +1199,37 @@ static bool element_check_sequence(DcmError **error,
 }
 
 
+/* Read a sequence left in the input. This is the first time anyone has
+ * looked at the value, so we can fill it in on a const element.
+ */
+static bool element_load_sequence(DcmError **error, const DcmElement *element)
+{
+    if (element->sequence_read == NULL || element->value.single.sq) {
+        return true;
+    }
+
+    DcmSequence *seq = element->sequence_read(error,
+                                              element->bulk_client,
+                                              element->bulk_offset);
+    if (seq == NULL) {
+        return false;
+    }
+
+    DcmElement *loaded = (DcmElement *) element;
+    loaded->value.single.sq = seq;
+    loaded->sequence_pointer = seq;
+
+    return true;
+}
+
+
 bool dcm_element_get_value_sequence(DcmError **error,
                                     const DcmElement *element,
                                     DcmSequence **value)
 {
     if (!element_check_assigned(error, element) ||
-        !element_check_sequence(error, element)) {
+        !element_check_sequence(error, element) ||
+        !element_load_sequence(error, element)) {
         return false;
     }
 
@@ -1010,6 +1240,20 @@ bool dcm_element_get_value_sequence(DcmError **error,
 }
 
 
+DcmSequence *dcm_element_peek_sequence(const DcmElement *element)
+{
+    if (!element->assigned ||
+        element->vr != DCM_VR_SQ ||
+        !element_load_sequence(NULL, element)) {
+        return NULL;
+    }
+
+    dcm_sequence_lock(element->value.single.sq);
+
+    return element->value.single.sq;
+}
+
+
 bool dcm_element_set_value_sequence(DcmError **error,
                                     DcmElement *element,
                                     DcmSequence *value)
@@ -1047,6 +1291,30 @@ bool dcm_element_set_value_sequence(DcmError **error,
 }
 
 
+bool dcm_element_set_value_sequence_lazy(DcmError **error,
+                                         DcmElement *element,
+                                         DcmSequenceRead read,
+                                         void *client,
+                                         int64_t offset,
+                                         uint32_t length)
+{
+    if (!element_check_not_assigned(error, element) ||
+        !element_check_sequence(error, element)) {
+        return false;
+    }
+
+    element->sequence_read = read;
+    element->bulk_client = client;
+    element->bulk_offset = offset;
+    element->vm = 1;
+    if (length != 0xffffffff) {
+        element_set_length(element, length);
+    }
+
+    return dcm_element_validate(error, element);
+}
+
+
 DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
 {
     uint32_t i;
@@ -1054,7 +1322,10 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
 
     dcm_log_debug("clone Data Element '%08x'", element->tag);
 
-    DcmElement *clone = dcm_element_create(error, element->tag, element->vr);
+    DcmElement *clone = element_create(error,
+                                       element->tag,
+                                       element->vr,
+                                       element->trusted);
     if (clone == NULL) {
         return NULL;
     }
@@ -1063,6 +1334,15 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
     DcmVRClass vr_class = dcm_dict_vr_class(element->vr);
     switch (vr_class) {
         case DCM_VR_CLASS_SEQUENCE:
+            if (element->sequence_read && element->value.single.sq == NULL) {
+                // share the reference, the clone can read its own copy
+                clone->sequence_read = element->sequence_read;
+                clone->bulk_client = element->bulk_client;
+                clone->bulk_offset = element->bulk_offset;
+                clone->vm = 1;
+                break;
+            }
+
             if (!dcm_element_get_value_sequence(error, element, &from_seq)) {
                 dcm_element_destroy(clone);
                 return NULL;
@@ -1134,7 +1414,13 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
             break;
 
         case DCM_VR_CLASS_BINARY:
-            if (element->value.single.bytes) {
+            if (element->bulk_read && element->value.single.bytes == NULL) {
+                // share the reference, the clone can fetch its own copy
+                clone->bulk_read = element->bulk_read;
+                clone->bulk_client = element->bulk_client;
+                clone->bulk_offset = element->bulk_offset;
+                clone->vm = 1;
+            } else if (element->value.single.bytes) {
                 clone->value.single.bytes = DCM_MALLOC(error, element->length);
                 if (clone->value.single.bytes == NULL) {
                     dcm_element_destroy(clone);
@@ -1195,7 +1481,7 @@ char *dcm_element_value_to_string(const DcmElement *element)
     double d;
     int64_t i;
     const char *str;
-    const void *val;
+    unsigned char bytes[16];
     uint32_t n;
 
     if (element->vm > 1) {
@@ -1242,12 +1528,19 @@ char *dcm_element_value_to_string(const DcmElement *element)
                 break;
 
             case DCM_VR_CLASS_BINARY:
-                (void) dcm_element_get_value_binary(NULL, element, &val);
+                // only read the start, so we don't fetch a large value
+                // left in the input just to print it
                 n = MIN(16, dcm_element_get_length(element));
+                if (!dcm_element_read_value_binary(NULL,
+                                                   element,
+                                                   0,
+                                                   bytes,
+                                                   n)) {
+                    n = 0;
+                }
 
                 for (i = 0; i < n; i++) {
-                    result = dcm_printf_append(result, "%02x",
-                                               ((unsigned char *) val)[i]);
+                    result = dcm_printf_append(result, "%02x", bytes[i]);
                     if (size > 0 &&
                         i % size == size - 1) {
                         result = dcm_printf_append(result, " ");
@@ -1697,6 +1990,23 @@ DcmDataSet *dcm_sequence_get(DcmError **error,
 }
 
 
+DcmDataSet *dcm_sequence_peek(const DcmSequence *seq, uint32_t index)
+{
+    if (index >= utarray_len(seq->items)) {
+        return NULL;
+    }
+
+    struct SequenceItem *seq_item = sequence_get_index(seq, index);
+    if (seq_item->dataset == NULL) {
+        return NULL;
+    }
+
+    dcm_dataset_lock(seq_item->dataset);
+
+    return seq_item->dataset;
+}
+
+
 DcmDataSet *dcm_sequence_steal(DcmError **error,
                                const DcmSequence *seq, uint32_t index)
 {
@@ -1829,6 +2139,7 @@ DcmFrame *dcm_frame_create(DcmError **error,
     if (frame == NULL) {
         return NULL;
     }
+    frame->references = 1;
 
     frame->photometric_interpretation = dcm_strdup(error,
                                                    photometric_interpretation);
@@ -1939,9 +2250,26 @@ const char *dcm_frame_get_value(const DcmFrame *frame)
 }
 
 
+#if defined(_WIN32) && !defined(__GNUC__)
+#define REF(P) InterlockedIncrement(P)
+#define UNREF(P) InterlockedDecrement(P)
+#else
+#define REF(P) __atomic_add_fetch(P, 1, __ATOMIC_RELAXED)
+#define UNREF(P) __atomic_sub_fetch(P, 1, __ATOMIC_ACQ_REL)
+#endif
+
+
+DcmFrame *dcm_frame_ref(DcmFrame *frame)
+{
+    REF(&frame->references);
+
+    return frame;
+}
+
+
 void dcm_frame_destroy(DcmFrame *frame)
 {
-    if (frame) {
+    if (frame && UNREF(&frame->references) == 0) {
         if (frame->data) {
             free((char*)frame->data);
         }
@@ -12,116 +12,279 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "uthash.h"
-
 #include <dicom/dicom.h>
 #include "pdicom.h"
 #include "dicom-dict-tables.h"
 
-#define EMPTY 0xffffffff
-#define MAX_PROBES 10
+// the average number of keys in each first level bucket
+#define BUCKET_SIZE 4
+#define MAX_DISPLACEMENT UINT16_MAX
 
 static FILE *c;
 static FILE *h;
 
-static void make_table(const char *name, const void *items, int count,
-                       int item_size, int key_offset, int key_len,
-                       bool string_key_skip_empty)
+struct Key {
+    int index;
+    uint32_t hash;
+    unsigned bucket;
+};
+
+static unsigned *bucket_sizes;
+
+static int compare_buckets(const void *a, const void *b)
 {
-    int table_len = count * 4;
-    unsigned *table = malloc(sizeof(unsigned) * table_len);
-    for (int i = 0; i < table_len; i++) {
-        table[i] = EMPTY;
+    unsigned bucket_a = *(const unsigned *) a;
+    unsigned bucket_b = *(const unsigned *) b;
+
+    // largest first, then by number so the output is stable
+    if (bucket_sizes[bucket_a] != bucket_sizes[bucket_b]) {
+        return bucket_sizes[bucket_a] > bucket_sizes[bucket_b] ? -1 : 1;
     }
 
+    return bucket_a < bucket_b ? -1 : bucket_a > bucket_b;
+}
+
+/* Make a minimal perfect hash table with hash and displace. Keys are split
+ * into buckets by hash, then for each bucket, largest first, we search for
+ * a displacement that puts all its keys into free cells. A lookup is then
+ * one hash, one displacement load, one table load and one compare.
+ */
+static void make_table(const char *name, const void *items, int count,
+                       int item_size, int key_offset, bool string_key)
+{
     #define KEY(index) ((const void *) \
         ((const char *) items + (index) * item_size + key_offset))
-    int probe_counts[MAX_PROBES] = {0};
+    struct Key *keys = malloc(sizeof(struct Key) * count);
+    size_t n_keys = 0;
     for (int i = 0; i < count; i++) {
-        if (string_key_skip_empty && ! *(const char *) KEY(i)) {
-            continue;
+        if (string_key) {
+            // empty keys can't be looked up
+            if (! *(const char *) KEY(i)) {
+                continue;
+            }
+            keys[n_keys].hash = dcm_dict_hash_keyword(KEY(i));
+        } else {
+            keys[n_keys].hash = dcm_dict_hash_tag(*(const uint32_t *) KEY(i));
         }
-        int this_key_len = key_len ? key_len : (int) strlen(KEY(i));
-        unsigned hash;
-        HASH_VALUE(KEY(i), this_key_len, hash);
-        int cell, probe;
-        for (probe = 0, cell = hash % table_len;
-             probe < MAX_PROBES && table[cell] != EMPTY;
-             cell = (hash + ++probe) % table_len) {
-            if (!memcmp(KEY(i), KEY(table[cell]), this_key_len)) {
-                fprintf(stderr, "%s: Duplicate key at %d\n", name, i);
+        keys[n_keys].index = i;
+        n_keys++;
+    }
+    if (n_keys == 0 || n_keys > UINT16_MAX) {
+        fprintf(stderr, "%s: Bad number of keys\n", name);
+        exit(1);
+    }
+
+    // keys with the same hash can never be separated
+    for (size_t i = 0; i < n_keys; i++) {
+        for (size_t j = i + 1; j < n_keys; j++) {
+            if (keys[i].hash == keys[j].hash) {
+                const void *a = KEY(keys[i].index);
+                const void *b = KEY(keys[j].index);
+                bool same = string_key ? !strcmp(a, b) : !memcmp(a, b, 4);
+                fprintf(stderr, "%s: %s at %d\n",
+                        name,
+                        same ? "Duplicate key" : "Hash collision",
+                        keys[j].index);
                 exit(1);
             }
         }
-        if (probe >= MAX_PROBES) {
-            fprintf(stderr, "%s: Too many probes at %d\n", name, i);
+    }
+
+    size_t table_len = n_keys;
+    size_t n_buckets = (n_keys + BUCKET_SIZE - 1) / BUCKET_SIZE;
+    bucket_sizes = calloc(n_buckets, sizeof(unsigned));
+    unsigned *order = malloc(sizeof(unsigned) * n_buckets);
+    for (size_t i = 0; i < n_keys; i++) {
+        keys[i].bucket = keys[i].hash % n_buckets;
+        bucket_sizes[keys[i].bucket]++;
+    }
+    for (size_t i = 0; i < n_buckets; i++) {
+        order[i] = i;
+    }
+    qsort(order, n_buckets, sizeof(unsigned), compare_buckets);
+
+    unsigned *table = malloc(sizeof(unsigned) * table_len);
+    bool *used = calloc(table_len, sizeof(bool));
+    unsigned *displacement = calloc(n_buckets, sizeof(unsigned));
+    size_t *cells = malloc(sizeof(size_t) * n_keys);
+    size_t *members = malloc(sizeof(size_t) * n_keys);
+    long total_tries = 0;
+    for (size_t b = 0; b < n_buckets && bucket_sizes[order[b]] > 0; b++) {
+        unsigned bucket = order[b];
+        size_t n_members = 0;
+        for (size_t i = 0; i < n_keys; i++) {
+            if (keys[i].bucket == bucket) {
+                members[n_members++] = i;
+            }
+        }
+
+        unsigned d;
+        for (d = 0; d <= MAX_DISPLACEMENT; d++) {
+            size_t placed;
+            for (placed = 0; placed < n_members; placed++) {
+                uint32_t hash = keys[members[placed]].hash;
+                size_t cell = dcm_dict_hash_displace(hash, d) % table_len;
+                if (used[cell]) {
+                    break;
+                }
+                // claim cells as we go, so keys in this bucket can't share
+                used[cell] = true;
+                cells[placed] = cell;
+            }
+            if (placed == n_members) {
+                break;
+            }
+            for (size_t i = 0; i < placed; i++) {
+                used[cells[i]] = false;
+            }
+        }
+        if (d > MAX_DISPLACEMENT) {
+            fprintf(stderr, "%s: No displacement for bucket %u\n",
+                    name, bucket);
             exit(1);
         }
-        table[cell] = i;
-        probe_counts[probe]++;
+
+        displacement[bucket] = d;
+        for (size_t i = 0; i < n_members; i++) {
+            table[cells[i]] = keys[members[i]].index;
+        }
+        total_tries += d + 1;
     }
 
-    int repr_bits = count > UINT8_MAX ? 16 : 8;
-    unsigned empty_repr = (1 << repr_bits) - 1;
-    fprintf(c, "const unsigned %s_len = %d;\n", name, table_len);
+    fprintf(c, "const unsigned %s_len = %zu;\n", name, table_len);
     fprintf(h, "extern const unsigned %s_len;\n", name);
-    fprintf(c, "const uint%d_t %s_empty = 0x%x;\n", repr_bits, name, empty_repr);
-    fprintf(h, "extern const uint%d_t %s_empty;\n", repr_bits, name);
-    fprintf(c, "const uint%d_t %s_dict[%u] = {", repr_bits, name, table_len);
-    fprintf(h, "extern const uint%d_t %s_dict[];\n\n", repr_bits, name);
-    for (int i = 0; i < table_len; i++) {
+    fprintf(c, "const unsigned %s_n_buckets = %zu;\n", name, n_buckets);
+    fprintf(h, "extern const unsigned %s_n_buckets;\n", name);
+    fprintf(c, "const uint16_t %s_displacement[%zu] = {", name, n_buckets);
+    fprintf(h, "extern const uint16_t %s_displacement[];\n", name);
+    for (size_t i = 0; i < n_buckets; i++) {
         if (!(i % 8)) {
             fprintf(c, "\n");
         }
-        fprintf(c, "0x%x, ", table[i] == EMPTY ? empty_repr : table[i]);
+        fprintf(c, "0x%x, ", displacement[i]);
+    }
+    fprintf(c, "\n};\n\n");
+    fprintf(c, "const uint16_t %s_dict[%zu] = {", name, table_len);
+    fprintf(h, "extern const uint16_t %s_dict[];\n\n", name);
+    for (size_t i = 0; i < table_len; i++) {
+        if (!(i % 8)) {
+            fprintf(c, "\n");
+        }
+        fprintf(c, "0x%x, ", table[i]);
     }
     fprintf(c, "\n};\n\n");
-    free(table);
 
     if (getenv("DEBUG_DICT")) {
-        double total_probes = 0;
-        for (int i = 0; i < MAX_PROBES; i++) {
-            total_probes += probe_counts[i] * (i + 1);
+        fprintf(stderr, "%-40s: %.3f tries/bucket, %7zu bytes\n",
+                name, (double) total_tries / n_buckets,
+                (table_len + n_buckets) * 2);
+    }
+
+    free(members);
+    free(cells);
+    free(displacement);
+    free(used);
+    free(table);
+    free(order);
+    free(bucket_sizes);
+    free(keys);
+}
+
+
+/* VRs are two upper case letters, so we can map them to DcmVR with a direct
+ * 26 x 26 table and no hashing.
+ */
+static void make_vr_index(const char *name)
+{
+    int8_t table[26 * 26];
+    for (int i = 0; i < 26 * 26; i++) {
+        table[i] = DCM_VR_ERROR;
+    }
+
+    for (int i = 0; i < dcm_vr_table_len; i++) {
+        const char *str = dcm_vr_table[i].str;
+        if (str[0] < 'A' || str[0] > 'Z' ||
+            str[1] < 'A' || str[1] > 'Z' ||
+            str[2] != '\0') {
+            fprintf(stderr, "%s: Bad VR at %d\n", name, i);
+            exit(1);
+        }
+        table[(str[0] - 'A') * 26 + str[1] - 'A'] = dcm_vr_table[i].vr;
+    }
+
+    fprintf(c, "const int8_t %s[%d] = {", name, 26 * 26);
+    fprintf(h, "extern const int8_t %s[];\n\n", name);
+    for (int i = 0; i < 26 * 26; i++) {
+        if (!(i % 26)) {
+            fprintf(c, "\n");
+        }
+        fprintf(c, "%d, ", table[i]);
+    }
+    fprintf(c, "\n};\n\n");
+}
+
+/* The public header of tag constants, so neither we nor applications need
+ * to look up keywords at run time.
+ */
+static void make_tags_header(FILE *t)
+{
+    fprintf(t, "/* Tag constants from the DICOM data dictionary.\n");
+    fprintf(t, " *\n");
+    fprintf(t, " * Generated by dicom-dict-build, do not edit.\n");
+    fprintf(t, " */\n\n");
+    fprintf(t, "#ifndef DCM_TAGS_H\n");
+    fprintf(t, "#define DCM_TAGS_H\n\n");
+
+    for (int i = 0; i < dcm_attribute_table_len; i++) {
+        const struct _DcmAttribute *attribute = &dcm_attribute_table[i];
+
+        // retired tags have no keyword
+        if (!attribute->keyword[0]) {
+            continue;
+        }
+
+        fprintf(t, "#define DCM_TAG_%s 0x%08x\n",
+                attribute->keyword, attribute->tag);
+
+        // only tags with a single VR get a VR constant
+        if (attribute->vr_tag >= 0 &&
+            attribute->vr_tag < (DcmVRTag) DCM_VR_LAST) {
+            fprintf(t, "#define DCM_TAG_%s_VR DCM_VR_%s\n",
+                    attribute->keyword,
+                    dcm_vr_table[attribute->vr_tag].str);
         }
-        fprintf(stderr, "%-40s: %.3f probes/lookup, %7d bytes\n",
-                name, total_probes / count, table_len * (repr_bits / 8));
     }
+
+    fprintf(t, "\n#endif\n");
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s c-file h-file\n", argv[0]);
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s c-file h-file tags-file\n", argv[0]);
         return 1;
     }
 
     c = fopen(argv[1], "w");
     h = fopen(argv[2], "w");
-    if (c == NULL || h == NULL) {
+    FILE *t = fopen(argv[3], "w");
+    if (c == NULL || h == NULL || t == NULL) {
         fprintf(stderr, "Couldn't open files\n");
         return 1;
     }
 
     fprintf(c, "#include <stdint.h>\n\n");
-    fprintf(h, "#define LOOKUP_MAX_PROBES %d\n\n", MAX_PROBES);
 
     #define ITEM_SIZE(table) sizeof((table)[0])
-    #define FIELD_SIZE(table, field) sizeof((table)[0].field)
     #define FIELD_OFFSET(table, field) \
         ((int) ((const char *) &(table)[0].field - (const char *) &(table)[0]))
 
-    make_table("dcm_vrtable_from_str",
-               dcm_vr_table, dcm_vr_table_len,
-               ITEM_SIZE(dcm_vr_table),
-               FIELD_OFFSET(dcm_vr_table, str),
-               0,  // strlen
-               false);
+    make_vr_index("dcm_vr_from_chars");
 
     make_table("dcm_attribute_from_tag",
                dcm_attribute_table, dcm_attribute_table_len,
                ITEM_SIZE(dcm_attribute_table),
                FIELD_OFFSET(dcm_attribute_table, tag),
-               FIELD_SIZE(dcm_attribute_table, tag),
                false);
 
     // The "" keyword appears several times and is used for retired tags ...
@@ -130,10 +293,11 @@ int main(int argc, char **argv)
                dcm_attribute_table, dcm_attribute_table_len,
                ITEM_SIZE(dcm_attribute_table),
                FIELD_OFFSET(dcm_attribute_table, keyword),
-               0,  // strlen
                true);
 
-    if (fclose(c) || fclose(h)) {
+    make_tags_header(t);
+
+    if (fclose(c) || fclose(h) || fclose(t)) {
         fprintf(stderr, "Couldn't write files\n");
         return 1;
     }
@@ -4962,3 +4962,43 @@ const struct _DcmAttribute dcm_attribute_table[] = {
 
 const int dcm_attribute_table_len = sizeof(dcm_attribute_table) /
                                     sizeof(struct _DcmAttribute);
+
+
+// the 32-bit finaliser from MurmurHash3, it mixes every input bit into every
+// output bit
+static uint32_t mix(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= UINT32_C(0x85ebca6b);
+    value ^= value >> 13;
+    value *= UINT32_C(0xc2b2ae35);
+    value ^= value >> 16;
+
+    return value;
+}
+
+
+uint32_t dcm_dict_hash_tag(uint32_t tag)
+{
+    return mix(tag);
+}
+
+
+// FNV-1a
+uint32_t dcm_dict_hash_keyword(const char *keyword)
+{
+    uint32_t hash = UINT32_C(0x811c9dc5);
+
+    for (const char *p = keyword; *p; p++) {
+        hash ^= (unsigned char) *p;
+        hash *= UINT32_C(0x01000193);
+    }
+
+    return hash;
+}
+
+
+uint32_t dcm_dict_hash_displace(uint32_t hash, uint32_t displacement)
+{
+    return mix(hash ^ (displacement * UINT32_C(0x9e3779b9)));
+}
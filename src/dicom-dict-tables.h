@@ -73,3 +73,11 @@ struct _DcmAttribute {
 
 extern const struct _DcmAttribute dcm_attribute_table[];
 extern const int dcm_attribute_table_len;
+
+/* Hashes for the perfect hash tables made by dicom-dict-build. The tables
+ * are made on the build machine, so these work on values rather than bytes
+ * in memory, and give the same result whatever the byte order.
+ */
+uint32_t dcm_dict_hash_tag(uint32_t tag);
+uint32_t dcm_dict_hash_keyword(const char *keyword);
+uint32_t dcm_dict_hash_displace(uint32_t hash, uint32_t displacement);
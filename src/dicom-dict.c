@@ -17,58 +17,50 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "uthash.h"
-
 #include <dicom/dicom.h>
 #include "pdicom.h"
 #include "dicom-dict-lookup.h"
 #include "dicom-dict-tables.h"
 
-#define LOOKUP(table, field, hash, key, key_len, out) do {		\
-        unsigned hash_value;						\
-        HASH_VALUE(key, key_len, hash_value);				\
-        for (int probe = 0; true; probe++) {				\
-            int i = hash ## _dict[(hash_value + probe) % hash ## _len];	\
-            if (i == hash ## _empty || probe == LOOKUP_MAX_PROBES) {	\
-                (out) = NULL;						\
-                break;							\
-            } else if (!memcmp(key, &(table)[i].field, key_len)) {	\
-                (out) = &(table)[i];					\
-                break;							\
-            }								\
-        }								\
+/* The tables are perfect hashes, so this finds the only entry the key can
+ * be in, and the caller must compare it.
+ */
+#define LOOKUP(table, hash_value, out) do {				\
+        uint32_t hash = (hash_value);					\
+        uint16_t displacement =						\
+            table ## _displacement[hash % table ## _n_buckets];	\
+        unsigned cell =							\
+            dcm_dict_hash_displace(hash, displacement) % table ## _len;	\
+        (out) = &dcm_attribute_table[table ## _dict[cell]];		\
     } while (0)
 
 
-static const struct _DcmVRTable *vrtable_from_vr(const char *vr)
+DcmVR dcm_dict_vr_from_chars(const char *chars)
 {
-    const struct _DcmVRTable *table;
+    unsigned first = (unsigned char) chars[0] - 'A';
+    unsigned second = (unsigned char) chars[1] - 'A';
 
-    LOOKUP(dcm_vr_table, str,
-           dcm_vrtable_from_str, vr, strlen(vr),
-           table);
+    if (first < 26 && second < 26) {
+        return (DcmVR) dcm_vr_from_chars[first * 26 + second];
+    }
 
-    return table;
+    return DCM_VR_ERROR;
 }
 
 
 bool dcm_is_valid_vr(const char *str)
 {
-    const struct _DcmVRTable *table;
-
-    return str &&
-        (table = vrtable_from_vr(str)) &&
-        table->vr != DCM_VR_ERROR;
+    return dcm_dict_vr_from_str(str) != DCM_VR_ERROR;
 }
 
 
 DcmVR dcm_dict_vr_from_str(const char *str)
 {
-    const struct _DcmVRTable *table;
-
     if (str &&
-        (table = vrtable_from_vr(str))) {
-        return table->vr;
+        str[0] != '\0' &&
+        str[1] != '\0' &&
+        str[2] == '\0') {
+        return dcm_dict_vr_from_chars(str);
     }
 
     return DCM_VR_ERROR;
@@ -126,6 +118,32 @@ int dcm_dict_vr_header_length(DcmVR vr)
 }
 
 
+/* Private tags and extra tags added at run time. They are collected in a
+ * list, then frozen into sorted tables which are never modified again, so
+ * lookups need no locking.
+ */
+struct PrivateTag {
+    // index into the sorted creator table, or -1 for an extra tag
+    int creator;
+
+    // for private tags, the group and the low byte of the element
+    uint32_t tag;
+    DcmVR vr;
+    char *keyword;
+};
+
+struct PrivateDictionary {
+    char **creators;
+    int n_creators;
+
+    struct PrivateTag *tags;
+    int n_tags;
+};
+
+static const struct PrivateTag *extra_tag_from_tag(uint32_t tag);
+static const struct PrivateTag *extra_tag_from_keyword(const char *keyword);
+
+
 static const struct _DcmAttribute *attribute_from_tag(uint32_t tag)
 {
     const struct _DcmAttribute *attribute;
@@ -137,11 +155,9 @@ static const struct _DcmAttribute *attribute_from_tag(uint32_t tag)
         tag = 0x00080000;
     }
 
-    LOOKUP(dcm_attribute_table, tag,
-           dcm_attribute_from_tag, &tag, sizeof(tag),
-           attribute);
+    LOOKUP(dcm_attribute_from_tag, dcm_dict_hash_tag(tag), attribute);
 
-    return attribute;
+    return attribute->tag == tag ? attribute : NULL;
 }
 
 
@@ -170,12 +186,17 @@ bool dcm_is_valid_tag(uint32_t tag)
 DcmVR dcm_vr_from_tag(uint32_t tag)
 {
     const struct _DcmAttribute *attribute;
+    const struct PrivateTag *extra;
 
-    if (!(attribute = attribute_from_tag(tag))) {
-        return DCM_VR_ERROR;
+    if ((attribute = attribute_from_tag(tag))) {
+        return (DcmVR) attribute->vr_tag;
+    }
+
+    if ((extra = extra_tag_from_tag(tag))) {
+        return extra->vr;
     }
 
-    return (DcmVR) attribute->vr_tag;
+    return DCM_VR_ERROR;
 }
 
 
@@ -222,11 +243,16 @@ bool dcm_is_valid_vr_for_tag(DcmVR vr, uint32_t tag)
 const char *dcm_dict_keyword_from_tag(uint32_t tag)
 {
     const struct _DcmAttribute *attribute;
+    const struct PrivateTag *extra;
 
     if ((attribute = attribute_from_tag(tag))) {
         return attribute->keyword;
     }
 
+    if ((extra = extra_tag_from_tag(tag))) {
+        return extra->keyword;
+    }
+
     return NULL;
 }
 
@@ -235,11 +261,11 @@ static const struct _DcmAttribute *attribute_from_keyword(const char *keyword)
 {
     const struct _DcmAttribute *attribute;
 
-    LOOKUP(dcm_attribute_table, keyword,
-           dcm_attribute_from_keyword, keyword, strlen(keyword),
+    LOOKUP(dcm_attribute_from_keyword,
+           dcm_dict_hash_keyword(keyword),
            attribute);
 
-    return attribute;
+    return strcmp(attribute->keyword, keyword) == 0 ? attribute : NULL;
 }
 
 
@@ -247,8 +273,318 @@ uint32_t dcm_dict_tag_from_keyword(const char *keyword)
 {
     const struct _DcmAttribute *attribute = attribute_from_keyword(keyword);
     if (!attribute) {
+        const struct PrivateTag *extra = extra_tag_from_keyword(keyword);
+
         // use this as "bad keyword"
-        return 0xffffffff;
+        return extra ? extra->tag : 0xffffffff;
     }
     return attribute->tag;
 }
+
+
+// tags added so far, with the creator stored as a string
+struct PendingTag {
+    char *creator;
+    uint32_t tag;
+    DcmVR vr;
+    char *keyword;
+};
+
+static struct PendingTag *pending_tags = NULL;
+static int n_pending_tags = 0;
+
+static const struct PrivateDictionary *private_dictionary = NULL;
+
+
+static uint32_t private_key(uint32_t tag)
+{
+    return (tag & 0xffff0000) | (tag & 0xff);
+}
+
+
+bool dcm_dict_add_private_tag(DcmError **error,
+                              const char *creator,
+                              uint32_t tag,
+                              DcmVR vr,
+                              const char *keyword)
+{
+    if (private_dictionary) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "adding tag failed",
+                      "the dictionary has been frozen");
+        return false;
+    }
+
+    if (vr < 0 || vr >= DCM_VR_LAST) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "adding tag failed",
+                      "tag %08x has an invalid VR", tag);
+        return false;
+    }
+
+    if (creator) {
+        if (!dcm_is_private_tag(tag) || (tag & 0xffff) < 0x1000) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "adding tag failed",
+                          "tag %08x is not a private data element", tag);
+            return false;
+        }
+        tag = private_key(tag);
+    } else if (attribute_from_tag(tag)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "adding tag failed",
+                      "tag %08x is already in the dictionary", tag);
+        return false;
+    }
+
+    for (int i = 0; i < n_pending_tags; i++) {
+        const struct PendingTag *pending = &pending_tags[i];
+        bool same_creator = creator && pending->creator ?
+            strcmp(creator, pending->creator) == 0 :
+            creator == pending->creator;
+
+        if (same_creator && pending->tag == tag) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "adding tag failed",
+                          "tag %08x has already been added", tag);
+            return false;
+        }
+    }
+
+    struct PendingTag *new_tags = dcm_realloc(error,
+        pending_tags,
+        sizeof(struct PendingTag) * (n_pending_tags + 1));
+    if (new_tags == NULL) {
+        return false;
+    }
+    pending_tags = new_tags;
+
+    struct PendingTag pending = {
+        .tag = tag,
+        .vr = vr,
+    };
+    if ((creator && !(pending.creator = dcm_strdup(error, creator))) ||
+        (keyword && !(pending.keyword = dcm_strdup(error, keyword)))) {
+        free(pending.creator);
+        return false;
+    }
+    pending_tags[n_pending_tags++] = pending;
+
+    return true;
+}
+
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+static int compare_private_tags(const void *a, const void *b)
+{
+    const struct PrivateTag *x = (const struct PrivateTag *) a;
+    const struct PrivateTag *y = (const struct PrivateTag *) b;
+
+    if (x->creator != y->creator) {
+        return x->creator < y->creator ? -1 : 1;
+    }
+
+    return x->tag < y->tag ? -1 : x->tag > y->tag;
+}
+
+
+static int private_creator_index(const struct PrivateDictionary *dictionary,
+                                 const char *creator)
+{
+    char **found = bsearch(&creator,
+                           dictionary->creators,
+                           dictionary->n_creators,
+                           sizeof(char *),
+                           compare_strings);
+
+    return found ? (int) (found - dictionary->creators) : -1;
+}
+
+
+bool dcm_dict_freeze(DcmError **error)
+{
+    if (private_dictionary) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "freezing dictionary failed",
+                      "the dictionary has already been frozen");
+        return false;
+    }
+
+    struct PrivateDictionary *dictionary =
+        DCM_NEW(error, struct PrivateDictionary);
+    if (dictionary == NULL) {
+        return false;
+    }
+
+    if (n_pending_tags > 0) {
+        dictionary->creators = DCM_NEW_ARRAY(error, n_pending_tags, char *);
+        dictionary->tags = DCM_NEW_ARRAY(error,
+                                         n_pending_tags,
+                                         struct PrivateTag);
+        if (dictionary->creators == NULL || dictionary->tags == NULL) {
+            free(dictionary->creators);
+            free(dictionary->tags);
+            free(dictionary);
+            return false;
+        }
+    }
+
+    // nothing can fail from here on, so the strings can move from the
+    // pending list to the frozen tables
+    int n_creators = 0;
+    for (int i = 0; i < n_pending_tags; i++) {
+        if (pending_tags[i].creator) {
+            dictionary->creators[n_creators++] = pending_tags[i].creator;
+        }
+    }
+    qsort(dictionary->creators, n_creators, sizeof(char *), compare_strings);
+
+    // keep the first copy of each creator, the others are freed below
+    for (int i = 0; i < n_creators; i++) {
+        if (dictionary->n_creators == 0 ||
+            strcmp(dictionary->creators[dictionary->n_creators - 1],
+                   dictionary->creators[i]) != 0) {
+            dictionary->creators[dictionary->n_creators++] =
+                dictionary->creators[i];
+        }
+    }
+
+    for (int i = 0; i < n_pending_tags; i++) {
+        struct PendingTag *pending = &pending_tags[i];
+        int creator = -1;
+
+        if (pending->creator) {
+            creator = private_creator_index(dictionary, pending->creator);
+            if (dictionary->creators[creator] != pending->creator) {
+                free(pending->creator);
+            }
+        }
+
+        dictionary->tags[i] = (struct PrivateTag) {
+            .creator = creator,
+            .tag = pending->tag,
+            .vr = pending->vr,
+            .keyword = pending->keyword,
+        };
+    }
+    dictionary->n_tags = n_pending_tags;
+
+    qsort(dictionary->tags,
+          dictionary->n_tags,
+          sizeof(struct PrivateTag),
+          compare_private_tags);
+
+    free(pending_tags);
+    pending_tags = NULL;
+    n_pending_tags = 0;
+
+    private_dictionary = dictionary;
+
+    return true;
+}
+
+
+static const struct PrivateTag *private_tag_lookup(int creator, uint32_t tag)
+{
+    const struct PrivateDictionary *dictionary = private_dictionary;
+
+    if (dictionary == NULL || dictionary->n_tags == 0) {
+        return NULL;
+    }
+
+    struct PrivateTag key = {
+        .creator = creator,
+        .tag = creator < 0 ? tag : private_key(tag),
+    };
+
+    return bsearch(&key,
+                   dictionary->tags,
+                   dictionary->n_tags,
+                   sizeof(struct PrivateTag),
+                   compare_private_tags);
+}
+
+
+bool dcm_dict_has_private(void)
+{
+    const struct PrivateDictionary *dictionary = private_dictionary;
+
+    return dictionary && dictionary->n_creators > 0;
+}
+
+
+int dcm_dict_private_creator(const char *creator)
+{
+    const struct PrivateDictionary *dictionary = private_dictionary;
+
+    return dictionary && creator ?
+        private_creator_index(dictionary, creator) : -1;
+}
+
+
+DcmVR dcm_dict_private_vr(int creator, uint32_t tag)
+{
+    const struct PrivateTag *private_tag;
+
+    if (creator < 0 ||
+        !(private_tag = private_tag_lookup(creator, tag))) {
+        return DCM_VR_ERROR;
+    }
+
+    return private_tag->vr;
+}
+
+
+DcmVR dcm_vr_from_private_tag(const char *creator, uint32_t tag)
+{
+    return dcm_dict_private_vr(dcm_dict_private_creator(creator), tag);
+}
+
+
+const char *dcm_dict_keyword_from_private_tag(const char *creator,
+                                              uint32_t tag)
+{
+    const struct PrivateTag *private_tag;
+    int index = dcm_dict_private_creator(creator);
+
+    if (index < 0 ||
+        !(private_tag = private_tag_lookup(index, tag))) {
+        return NULL;
+    }
+
+    return private_tag->keyword;
+}
+
+
+static const struct PrivateTag *extra_tag_from_tag(uint32_t tag)
+{
+    return private_tag_lookup(-1, tag);
+}
+
+
+static const struct PrivateTag *extra_tag_from_keyword(const char *keyword)
+{
+    const struct PrivateDictionary *dictionary = private_dictionary;
+
+    if (dictionary == NULL) {
+        return NULL;
+    }
+
+    // extra tags sort first, and there are not many of them
+    for (int i = 0;
+         i < dictionary->n_tags && dictionary->tags[i].creator < 0;
+         i++) {
+        const char *extra_keyword = dictionary->tags[i].keyword;
+
+        if (extra_keyword && strcmp(extra_keyword, keyword) == 0) {
+            return &dictionary->tags[i];
+        }
+    }
+
+    return NULL;
+}
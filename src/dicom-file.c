@@ -16,6 +16,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 
 #include "utarray.h"
 
@@ -34,6 +35,21 @@ struct _DcmFilehandle {
     bool implicit;
     const uint32_t *stop_tags;
 
+    // skip checks against the dictionary, see dcm_filehandle_set_trusted()
+    bool trusted;
+
+    // we are reading a dataset the filehandle keeps, so elements can use
+    // values in place in the input
+    bool borrow;
+
+    // binary values this large or larger are left in the input, see
+    // dcm_filehandle_set_bulk_threshold()
+    uint32_t bulk_threshold;
+
+    // leave top-level sequences in the input, see
+    // dcm_filehandle_set_lazy_sequences()
+    bool lazy_sequences;
+
     // start of image metadata
     int64_t offset;
     // just after read_metadata
@@ -47,6 +63,37 @@ struct _DcmFilehandle {
     DcmDataSet *file_meta;
     DcmDataSet *meta;
 
+    // top-level elements sorted by tag, see dcm_filehandle_build_toc()
+    DcmParseInfo *toc;
+    uint32_t toc_length;
+
+    // recently read frames, see dcm_filehandle_set_frame_cache()
+    DcmFrameCache *frame_cache;
+
+    // our key in the shared and shared memory frame caches, see
+    // dcm_filehandle_set_shared_frame_cache()
+    char *cache_identity;
+    bool shared_frame_cache;
+
+    // not ours, see dcm_filehandle_set_shm_frame_cache()
+    DcmShmFrameCache *shm_frame_cache;
+
+    // the most tiles to hint after each positioned read, and room for
+    // their frame numbers, see dcm_filehandle_set_prefetch()
+    uint32_t prefetch_budget;
+    uint32_t *prefetch_frames;
+
+    // reads running on worker threads, see
+    // dcm_filehandle_read_frame_async()
+    DcmAsyncState *async;
+
+    // the last positioned read, and the direction of the move to it
+    bool have_last_position;
+    uint32_t last_column;
+    uint32_t last_row;
+    int pan_columns;
+    int pan_rows;
+
     // image properties we need to track
     uint32_t frame_width;
     uint32_t frame_height;
@@ -70,11 +117,6 @@ struct _DcmFilehandle {
     // the last top level tag the scanner saw
     uint32_t last_tag;
 
-    // used to count frames as we scan per frame functional group sequence
-    uint32_t frame_number;
-    int32_t column_position;
-    int32_t row_position;
-
     // indent for file print
     int indent;
 
@@ -105,7 +147,6 @@ DcmFilehandle *dcm_filehandle_create(DcmError **error, DcmIO *io)
     filehandle->transfer_syntax_uid = NULL;
     filehandle->pixel_data_offset = 0;
     filehandle->last_tag = 0xffffffff;
-    filehandle->frame_number = 0;
     filehandle->layout = DCM_LAYOUT_FULL;
     filehandle->frame_index = NULL;
     utarray_new(filehandle->index_stack, &ut_int_icd);
@@ -174,6 +215,9 @@ static void dcm_filehandle_clear(DcmFilehandle *filehandle)
 void dcm_filehandle_destroy(DcmFilehandle *filehandle)
 {
     if (filehandle) {
+        // workers may still be reading from us
+        dcm_async_state_destroy(filehandle->async);
+
         dcm_filehandle_clear(filehandle);
 
         if (filehandle->transfer_syntax_uid) {
@@ -188,6 +232,20 @@ void dcm_filehandle_destroy(DcmFilehandle *filehandle)
             free(filehandle->offset_table);
         }
 
+        if (filehandle->toc) {
+            free(filehandle->toc);
+        }
+
+        dcm_frame_cache_destroy(filehandle->frame_cache);
+
+        if (filehandle->cache_identity) {
+            free(filehandle->cache_identity);
+        }
+
+        if (filehandle->prefetch_frames) {
+            free(filehandle->prefetch_frames);
+        }
+
         dcm_io_close(filehandle->io);
 
         utarray_free(filehandle->index_stack);
@@ -268,10 +326,9 @@ static bool dcm_offset(DcmError **error,
 
 static bool get_tag_int(DcmError **error,
                         const DcmDataSet *dataset,
-                        const char *keyword,
+                        uint32_t tag,
                         int64_t *result)
 {
-    uint32_t tag = dcm_dict_tag_from_keyword(keyword);
     DcmElement *element = dcm_dataset_get(error, dataset, tag);
     return element &&
          dcm_element_get_value_integer(error, element, 0, result);
@@ -280,10 +337,9 @@ static bool get_tag_int(DcmError **error,
 
 static bool get_tag_str(DcmError **error,
                         const DcmDataSet *dataset,
-                        const char *keyword,
+                        uint32_t tag,
                         const char **result)
 {
-    uint32_t tag = dcm_dict_tag_from_keyword(keyword);
     DcmElement *element = dcm_dataset_get(error, dataset, tag);
     return element &&
          dcm_element_get_value_string(error, element, 0, result);
@@ -295,7 +351,7 @@ static bool get_num_frames(DcmError **error,
                            uint32_t *number_of_frames)
 {
     const char *value;
-    if (!get_tag_str(error, metadata, "NumberOfFrames", &value)) {
+    if (!get_tag_str(error, metadata, DCM_TAG_NumberOfFrames, &value)) {
         *number_of_frames = 1;
         return true;
     }
@@ -323,7 +379,7 @@ static bool get_frame_offset(DcmError **error,
     // optional, defaults to 0
     int64_t value;
     if (!get_tag_int(NULL,
-        metadata, "ConcatenationFrameOffsetNumber", &value)) {
+        metadata, DCM_TAG_ConcatenationFrameOffsetNumber, &value)) {
         value = 0;
     }
 
@@ -342,8 +398,8 @@ static bool get_frame_size(DcmError **error,
     int64_t width;
     int64_t height;
 
-    if (!get_tag_int(error, metadata, "Columns", &width) ||
-        !get_tag_int(error, metadata, "Rows", &height)) {
+    if (!get_tag_int(error, metadata, DCM_TAG_Columns, &width) ||
+        !get_tag_int(error, metadata, DCM_TAG_Rows, &height)) {
         return false;
     }
     if (width <= 0 || height <= 0) {
@@ -377,12 +433,14 @@ static bool get_tiles(DcmError **error,
     // TotalPixelMatrixColumns is optional and defaults to Columns, ie. one
     // frame across
     width = frame_width;
-    (void) get_tag_int(NULL, metadata, "TotalPixelMatrixColumns", &width);
+    (void) get_tag_int(NULL,
+        metadata, DCM_TAG_TotalPixelMatrixColumns, &width);
 
     // TotalPixelMatrixColumns is optional and defaults to Columns, ie. one
     // frame across
     height = frame_width;
-    (void) get_tag_int(NULL, metadata, "TotalPixelMatrixRows", &height);
+    (void) get_tag_int(NULL,
+        metadata, DCM_TAG_TotalPixelMatrixRows, &height);
 
     if (width <= 0 || height <= 0) {
         dcm_error_set(error, DCM_ERROR_CODE_PARSE,
@@ -457,6 +515,17 @@ static bool parse_meta_sequence_begin(DcmError **error,
 }
 
 
+static DcmElement *filehandle_element_create(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t tag,
+                                             DcmVR vr)
+{
+    return filehandle->trusted ?
+        dcm_element_create_trusted(error, tag, vr) :
+        dcm_element_create(error, tag, vr);
+}
+
+
 static bool parse_meta_sequence_end(DcmError **error,
                                     void *client,
                                     uint32_t tag,
@@ -467,7 +536,10 @@ static bool parse_meta_sequence_end(DcmError **error,
 
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmElement *element = dcm_element_create(error, tag, vr);
+    DcmElement *element = filehandle_element_create(error,
+                                                    filehandle,
+                                                    tag,
+                                                    vr);
     if (element == NULL) {
         return false;
     }
@@ -501,14 +573,256 @@ static bool parse_meta_element_create(DcmError **error,
 {
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmElement *element = dcm_element_create(error, tag, vr);
+    DcmElement *element = filehandle_element_create(error,
+                                                    filehandle,
+                                                    tag,
+                                                    vr);
+    if (element == NULL) {
+        return false;
+    }
+
+    // a value in memory we are reading from lives as long as we do
+    bool borrow = filehandle->borrow &&
+                  dcm_io_contains(filehandle->io, value, length);
+
+    DcmDataSet *dataset = *((DcmDataSet **)
+            utarray_back(filehandle->dataset_stack));
+    if (!(borrow ?
+          dcm_element_set_value_borrowed(error, element, value, length) :
+          dcm_element_set_value(error, element, value, length, false)) ||
+        !dcm_dataset_insert(error, dataset, element)) {
+        dcm_element_destroy(element);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool parse_meta_defer(void *client,
+                             uint32_t tag,
+                             DcmVR vr,
+                             uint32_t length)
+{
+    const DcmFilehandle *filehandle = (const DcmFilehandle *) client;
+
+    USED(tag);
+
+    if (dcm_dict_vr_class(vr) == DCM_VR_CLASS_SEQUENCE) {
+        return filehandle->lazy_sequences;
+    }
+
+    return filehandle->bulk_threshold > 0 &&
+           length >= filehandle->bulk_threshold;
+}
+
+
+/* Fetch a value left in the input, putting the read point back afterwards
+ * so we don't disturb any read in progress.
+ */
+static bool filehandle_read_bulk(DcmError **error,
+                                 void *client,
+                                 int64_t offset,
+                                 char *buffer,
+                                 uint32_t length)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    int64_t position;
+    int64_t bulk_position;
+
+    if (!dcm_offset(error, filehandle, &position) ||
+        !dcm_seekset(error, filehandle, offset)) {
+        return false;
+    }
+
+    bulk_position = offset;
+    bool success = dcm_require(error,
+                               filehandle,
+                               buffer,
+                               length,
+                               &bulk_position);
+
+    return dcm_seekset(error, filehandle, position) && success;
+}
+
+
+static bool parse_meta_element_defer(DcmError **error,
+                                     void *client,
+                                     uint32_t tag,
+                                     DcmVR vr,
+                                     int64_t offset,
+                                     uint32_t length)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    DcmElement *element = filehandle_element_create(error,
+                                                    filehandle,
+                                                    tag,
+                                                    vr);
+    if (element == NULL) {
+        return false;
+    }
+
+    DcmDataSet *dataset = *((DcmDataSet **)
+            utarray_back(filehandle->dataset_stack));
+    if (!dcm_element_set_value_bulk(error,
+                                    element,
+                                    filehandle_read_bulk,
+                                    filehandle,
+                                    offset,
+                                    length) ||
+        !dcm_dataset_insert(error, dataset, element)) {
+        dcm_element_destroy(element);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Reading a lazy sequence, the dataset enclosing it is our own and is
+ * thrown away, and the sequence itself is left on the stack for us.
+ */
+static bool parse_lazy_dataset_end(DcmError **error, void *client)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    if (utarray_len(filehandle->dataset_stack) == 1) {
+        DcmDataSet *dataset = *((DcmDataSet **)
+                utarray_back(filehandle->dataset_stack));
+        dcm_dataset_destroy(dataset);
+        utarray_pop_back(filehandle->dataset_stack);
+        return true;
+    }
+
+    return parse_meta_dataset_end(error, client);
+}
+
+
+static bool parse_lazy_sequence_end(DcmError **error,
+                                    void *client,
+                                    uint32_t tag,
+                                    DcmVR vr,
+                                    uint32_t length)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    if (utarray_len(filehandle->sequence_stack) == 1) {
+        return true;
+    }
+
+    return parse_meta_sequence_end(error, client, tag, vr, length);
+}
+
+
+// stop at the first top-level element after the sequence
+static bool parse_lazy_stop(void *client,
+                            uint32_t tag,
+                            DcmVR vr,
+                            uint32_t length)
+{
+    const DcmFilehandle *filehandle = (const DcmFilehandle *) client;
+
+    USED(tag);
+    USED(vr);
+    USED(length);
+
+    return utarray_len(filehandle->sequence_stack) > 0;
+}
+
+
+/* Read a sequence left in the input. We parse with stacks of our own and
+ * put the read point back afterwards, so we don't disturb any read in
+ * progress.
+ */
+static DcmSequence *filehandle_read_sequence(DcmError **error,
+                                             void *client,
+                                             int64_t offset)
+{
+    // nested sequences are read now, only binary values are left behind
+    static DcmParse parse = {
+        .dataset_begin = parse_meta_dataset_begin,
+        .dataset_end = parse_lazy_dataset_end,
+        .sequence_begin = parse_meta_sequence_begin,
+        .sequence_end = parse_lazy_sequence_end,
+        .element_create = parse_meta_element_create,
+        .stop = parse_lazy_stop,
+        .defer = parse_meta_defer,
+        .element_defer = parse_meta_element_defer,
+    };
+
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    UT_array *dataset_stack = filehandle->dataset_stack;
+    UT_array *sequence_stack = filehandle->sequence_stack;
+    DcmSequence *sequence = NULL;
+    int64_t position;
+
+    if (!dcm_offset(error, filehandle, &position) ||
+        !dcm_seekset(error, filehandle, offset)) {
+        return NULL;
+    }
+
+    utarray_new(filehandle->dataset_stack, &ut_ptr_icd);
+    utarray_new(filehandle->sequence_stack, &ut_ptr_icd);
+
+    bool success = dcm_parse_dataset(error,
+                                     filehandle->io,
+                                     filehandle->implicit,
+                                     filehandle->trusted,
+                                     &parse,
+                                     filehandle);
+    if (success &&
+        utarray_len(filehandle->dataset_stack) == 0 &&
+        utarray_len(filehandle->sequence_stack) == 1) {
+        sequence = *((DcmSequence **) utarray_back(filehandle->sequence_stack));
+        utarray_clear(filehandle->sequence_stack);
+    } else if (success) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "reading sequence failed",
+                      "no sequence at offset %" PRId64,
+                      offset);
+    }
+
+    dcm_filehandle_clear(filehandle);
+    utarray_free(filehandle->dataset_stack);
+    utarray_free(filehandle->sequence_stack);
+    filehandle->dataset_stack = dataset_stack;
+    filehandle->sequence_stack = sequence_stack;
+
+    if (!dcm_seekset(error, filehandle, position)) {
+        dcm_sequence_destroy(sequence);
+        return NULL;
+    }
+
+    return sequence;
+}
+
+
+static bool parse_meta_sequence_defer(DcmError **error,
+                                      void *client,
+                                      uint32_t tag,
+                                      DcmVR vr,
+                                      int64_t offset,
+                                      uint32_t length)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    DcmElement *element = filehandle_element_create(error,
+                                                    filehandle,
+                                                    tag,
+                                                    vr);
     if (element == NULL) {
         return false;
     }
 
     DcmDataSet *dataset = *((DcmDataSet **)
             utarray_back(filehandle->dataset_stack));
-    if (!dcm_element_set_value(error, element, value, length, false) ||
+    if (!dcm_element_set_value_sequence_lazy(error,
+                                             element,
+                                             filehandle_read_sequence,
+                                             filehandle,
+                                             offset,
+                                             length) ||
         !dcm_dataset_insert(error, dataset, element)) {
         dcm_element_destroy(element);
         return false;
@@ -572,11 +886,14 @@ static DcmDataSet *dcm_filehandle_read_file_meta(DcmError **error,
     utarray_push_back(filehandle->sequence_stack, &sequence);
 
     // parse all of the first group
-    if (!dcm_parse_group(error,
-                         filehandle->io,
-                         false,
-                         &parse,
-                         filehandle)) {
+    filehandle->borrow = true;
+    bool success = dcm_parse_group(error,
+                                   filehandle->io,
+                                   false,
+                                   &parse,
+                                   filehandle);
+    filehandle->borrow = false;
+    if (!success) {
         return NULL;
     }
 
@@ -647,7 +964,9 @@ const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
             return NULL;
         }
 
-        DcmElement *element = dcm_dataset_get(error, file_meta, 0x00020010);
+        DcmElement *element = dcm_dataset_get(error,
+                                              file_meta,
+                                              TAG_TRANSFER_SYNTAX_UID);
         if (element == NULL) {
             dcm_dataset_destroy(file_meta);
             return NULL;
@@ -687,6 +1006,25 @@ const char *dcm_filehandle_get_transfer_syntax_uid(const DcmFilehandle *filehand
 }
 
 
+void dcm_filehandle_set_trusted(DcmFilehandle *filehandle, bool trusted)
+{
+    filehandle->trusted = trusted;
+}
+
+
+void dcm_filehandle_set_bulk_threshold(DcmFilehandle *filehandle,
+                                       uint32_t threshold)
+{
+    filehandle->bulk_threshold = threshold;
+}
+
+
+void dcm_filehandle_set_lazy_sequences(DcmFilehandle *filehandle, bool lazy)
+{
+    filehandle->lazy_sequences = lazy;
+}
+
+
 static bool parse_meta_stop(void *client,
                             uint32_t tag,
                             DcmVR vr,
@@ -717,28 +1055,28 @@ static bool set_pixel_description(DcmError **error,
     int64_t value;
     const char *string;
 
-    element = dcm_dataset_get(error, metadata, 0x00280010);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_Rows);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
     }
     desc->rows = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280011);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_Columns);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
     }
     desc->columns = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280002);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_SamplesPerPixel);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
     }
     desc->samples_per_pixel = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280100);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_BitsAllocated);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
@@ -757,14 +1095,14 @@ static bool set_pixel_description(DcmError **error,
     }
     desc->bits_allocated = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280101);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_BitsStored);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
     }
     desc->bits_stored = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280103);
+    element = dcm_dataset_get(error, metadata, DCM_TAG_PixelRepresentation);
     if (element == NULL ||
         !dcm_element_get_value_integer(error, element, 0, &value)) {
         return false;
@@ -774,7 +1112,8 @@ static bool set_pixel_description(DcmError **error,
     // required if samples per pixel > 1, defaults to 0 (interleaved)
     desc->planar_configuration = 0;
     if (desc->samples_per_pixel > 1) {
-        element = dcm_dataset_get(error, metadata, 0x00280006);
+        element = dcm_dataset_get(error,
+                                  metadata, DCM_TAG_PlanarConfiguration);
         if (element == NULL ||
             !dcm_element_get_value_integer(error, element, 0, &value)) {
             return false;
@@ -782,7 +1121,8 @@ static bool set_pixel_description(DcmError **error,
         desc->planar_configuration = (uint16_t) value;
     }
 
-    element = dcm_dataset_get(error, metadata, 0x00280004);
+    element = dcm_dataset_get(error,
+                              metadata, DCM_TAG_PhotometricInterpretation);
     if (element == NULL ||
         !dcm_element_get_value_string(error, element, 0, &string)) {
         return false;
@@ -814,6 +1154,9 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
         .sequence_end = parse_meta_sequence_end,
         .element_create = parse_meta_element_create,
         .stop = parse_meta_stop,
+        .defer = parse_meta_defer,
+        .element_defer = parse_meta_element_defer,
+        .sequence_defer = parse_meta_sequence_defer,
     };
 
     // only get the file_meta if it's not there ... we don't want to rewind
@@ -837,6 +1180,7 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
     if (!dcm_parse_dataset(error,
                            filehandle->io,
                            filehandle->implicit,
+                           filehandle->trusted,
                            &parse,
                            filehandle)) {
         return NULL;
@@ -893,9 +1237,12 @@ const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
             return NULL;
         }
 
+        // we keep this dataset, so it can use values in place
+        filehandle->borrow = true;
         DcmDataSet *meta = dcm_filehandle_read_metadata(error,
                                                         filehandle,
                                                         stop_tags);
+        filehandle->borrow = false;
         if (meta == NULL) {
             return NULL;
         }
@@ -928,7 +1275,8 @@ const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
         // we flip to SPARSE if there's a per frame functional group sequence
         // containing frame positions, see below
         const char *type;
-        if (get_tag_str(NULL, meta, "DimensionOrganizationType", &type)) {
+        if (get_tag_str(NULL,
+            meta, DCM_TAG_DimensionOrganizationType, &type)) {
             if (strcmp(type, "TILED_SPARSE") == 0 || strcmp(type, "3D") == 0) {
                 filehandle->layout = DCM_LAYOUT_SPARSE;
             } else if (strcmp(type, "TILED_FULL") == 0) {
@@ -950,159 +1298,344 @@ const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
 }
 
 
-static bool parse_frame_index_sequence_begin(DcmError **error,
-                                             void *client,
-                                             uint32_t tag,
-                                             DcmVR vr,
-                                             uint32_t length)
+static int compare_toc_entries(const void *a, const void *b)
 {
-    USED(error);
-    USED(vr);
-    USED(length);
-
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
-
-    if (tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE) {
-        filehandle->column_position = -1;
-        filehandle->row_position = -1;
-    }
+    uint32_t tag_a = ((const DcmParseInfo *) a)->tag;
+    uint32_t tag_b = ((const DcmParseInfo *) b)->tag;
 
-    return true;
+    return tag_a < tag_b ? -1 : tag_a > tag_b;
 }
 
 
-static bool parse_frame_index_sequence_end(DcmError **error,
-                                           void *client,
-                                           uint32_t tag,
-                                           DcmVR vr,
-                                           uint32_t length)
+static bool read_toc(DcmError **error, DcmFilehandle *filehandle)
 {
-    USED(vr);
-    USED(length);
+    // always rewind to the start of the dataset
+    if (!dcm_filehandle_get_file_meta(error, filehandle)) {
+        return false;
+    }
 
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    DcmReader *reader = dcm_reader_create(error,
+                                          filehandle->io,
+                                          filehandle->implicit,
+                                          filehandle->trusted);
+    if (reader == NULL) {
+        return false;
+    }
 
-    // have we seen a valid pair of tile positions
-    if (tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE &&
-        filehandle->column_position != -1 &&
-        filehandle->row_position != -1) {
-        // we don't support fractional tile positioning ... they must be
-        // exactly aligned on tile boundaries
-        if ((filehandle->column_position - 1) % filehandle->frame_width != 0 ||
-            (filehandle->row_position - 1) % filehandle->frame_height != 0) {
-            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                          "reading PerFrameFunctionalGroupsSequence failed",
-                          "unsupported frame alignment");
+    uint32_t size = 64;
+    uint32_t length = 0;
+    DcmParseInfo *toc = DCM_NEW_ARRAY(error, size, DcmParseInfo);
+    if (toc == NULL) {
+        dcm_reader_destroy(reader);
+        return false;
+    }
+
+    DcmReaderEvent event;
+    for (;;) {
+        if (!dcm_reader_next(error, reader, &event)) {
+            free(toc);
+            dcm_reader_destroy(reader);
             return false;
         }
 
-        // map the position of the tile to the frame number
-        int col = (filehandle->column_position - 1) / filehandle->frame_width;
-        int row = (filehandle->row_position - 1) / filehandle->frame_height;
-        uint32_t index = col + row * filehandle->tiles_across;
-        if (index < filehandle->num_tiles) {
-            filehandle->frame_index[index] = filehandle->frame_number;
+        if (event.type == DCM_READER_EVENT_END) {
+            break;
+        }
 
-            // we have something meaningful in per frame functional group
-            // sequence, so we must display in SPARSE mode
-            filehandle->layout = DCM_LAYOUT_SPARSE;
+        if (length == size) {
+            DcmParseInfo *new_toc = dcm_realloc(error,
+                                                toc,
+                                                2 * size * sizeof(*toc));
+            if (new_toc == NULL) {
+                free(toc);
+                dcm_reader_destroy(reader);
+                return false;
+            }
+            toc = new_toc;
+            size *= 2;
         }
 
-        // end of TAG_PLANE_POSITION_SLIDE_SEQUENCE, so we're on to the next
-        // frame
-        filehandle->frame_number += 1;
+        // we only want headers, so the reader skips values, and we skip
+        // the contents of sequences and encapsulated pixeldata
+        toc[length++] = event.info;
+        if (event.type == DCM_READER_EVENT_SEQUENCE_BEGIN &&
+            !dcm_reader_skip_body(error, reader)) {
+            free(toc);
+            dcm_reader_destroy(reader);
+            return false;
+        }
     }
 
+    dcm_reader_destroy(reader);
+
+    // datasets should be in tag order, but don't rely on it
+    qsort(toc, length, sizeof(*toc), compare_toc_entries);
+
+    filehandle->toc = toc;
+    filehandle->toc_length = length;
+
     return true;
 }
 
 
-static bool parse_frame_index_element_create(DcmError **error,
-                                             void *client,
-                                             uint32_t tag,
-                                             DcmVR vr,
-                                             char *value,
-                                             uint32_t length)
+const DcmParseInfo *dcm_filehandle_build_toc(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t *length)
 {
-    USED(error);
+    if (filehandle->toc == NULL) {
+        int64_t position;
 
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
-
-    switch (tag) {
-    case TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
-        if (vr == DCM_VR_SL && length == 4) {
-            int32_t *sl = (int32_t *) value;
-
-            filehandle->column_position = sl[0];
+        if (!dcm_offset(error, filehandle, &position) ||
+            !read_toc(error, filehandle) ||
+            !dcm_seekset(error, filehandle, position)) {
+            return NULL;
         }
-        break;
+    }
 
-    case TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
-        if (vr == DCM_VR_SL && length == 4) {
-            int32_t *sl = (int32_t *) value;
+    *length = filehandle->toc_length;
+
+    return filehandle->toc;
+}
 
-            filehandle->row_position = sl[0];
-        }
-        break;
 
-    default:
-        break;
+const DcmParseInfo *dcm_filehandle_find_toc_entry(const DcmFilehandle *filehandle,
+                                                  uint32_t tag)
+{
+    if (filehandle->toc == NULL) {
+        return NULL;
     }
 
-    return true;
+    DcmParseInfo key = { .tag = tag };
+
+    return bsearch(&key,
+                   filehandle->toc,
+                   filehandle->toc_length,
+                   sizeof(DcmParseInfo),
+                   compare_toc_entries);
 }
 
 
-static bool parse_frame_index_stop(void *client,
-                                   uint32_t tag,
-                                   DcmVR vr,
-                                   uint32_t length)
+static bool read_toc_element_value(DcmError **error,
+                                   DcmFilehandle *filehandle,
+                                   const DcmParseInfo *entry,
+                                   DcmElement *element)
 {
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    if (!dcm_seekset(error, filehandle, entry->offset)) {
+        return false;
+    }
 
-    USED(vr);
-    USED(length);
+    DcmReader *reader = dcm_reader_create(error,
+                                          filehandle->io,
+                                          filehandle->implicit,
+                                          filehandle->trusted);
+    if (reader == NULL) {
+        return false;
+    }
 
-    filehandle->last_tag = tag;
+    DcmReaderEvent event;
+    const char *value;
+    bool success = dcm_reader_next(error, reader, &event) &&
+                   (value = dcm_reader_get_value(error, reader)) &&
+                   dcm_element_set_value(error,
+                                         element,
+                                         (char *) value,
+                                         event.info.length,
+                                         false);
 
-    return tag != TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE;
+    dcm_reader_destroy(reader);
+
+    return success;
 }
 
 
-static bool read_frame_index(DcmError **error,
-                             DcmFilehandle *filehandle)
+DcmElement *dcm_filehandle_read_element(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        uint32_t tag)
 {
-    static DcmParse parse = {
-        .sequence_begin = parse_frame_index_sequence_begin,
-        .sequence_end = parse_frame_index_sequence_end,
-        .element_create = parse_frame_index_element_create,
-        .stop = parse_frame_index_stop,
-    };
+    uint32_t length;
+    if (!dcm_filehandle_build_toc(error, filehandle, &length)) {
+        return NULL;
+    }
 
-    dcm_log_debug("reading PerFrameFunctionalGroupSequence");
+    const DcmParseInfo *entry = dcm_filehandle_find_toc_entry(filehandle,
+                                                              tag);
+    if (entry == NULL) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "reading element failed",
+                      "no top-level element with tag %08x",
+                      tag);
+        return NULL;
+    }
 
-    filehandle->frame_index = DCM_NEW_ARRAY(error,
-                                            filehandle->num_tiles,
-                                            uint32_t);
-    if (filehandle->frame_index == NULL) {
-        return false;
+    bool is_sequence =
+        dcm_dict_vr_class(entry->vr) == DCM_VR_CLASS_SEQUENCE;
+    if (!is_sequence && entry->length == 0xffffffff) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "reading element failed",
+                      "element %08x is encapsulated pixel data, "
+                      "use dcm_filehandle_read_frame()",
+                      tag);
+        return NULL;
     }
 
-    // we may not have all frames ... set to missing initially
-    for (uint32_t i = 0; i < filehandle->num_tiles; i++) {
-        filehandle->frame_index[i] = 0xffffffff;
+    DcmElement *element = filehandle_element_create(error,
+                                                    filehandle,
+                                                    entry->tag,
+                                                    entry->vr);
+    if (element == NULL) {
+        return NULL;
     }
 
-    // parse just the per-frame stuff
-    filehandle->frame_number = 0;
-    if (!dcm_parse_dataset(error,
-                           filehandle->io,
-                           filehandle->implicit,
-                           &parse,
-                           filehandle)) {
+    int64_t position;
+    if (!dcm_offset(error, filehandle, &position)) {
+        dcm_element_destroy(element);
+        return NULL;
+    }
+
+    bool success;
+    if (is_sequence) {
+        DcmSequence *sequence = filehandle_read_sequence(error,
+                                                         filehandle,
+                                                         entry->offset);
+        success = sequence &&
+                  dcm_element_set_value_sequence(error, element, sequence);
+        if (sequence && !success) {
+            dcm_sequence_destroy(sequence);
+        }
+    } else {
+        success = read_toc_element_value(error, filehandle, entry, element);
+    }
+
+    if (!dcm_seekset(error, filehandle, position) || !success) {
+        dcm_element_destroy(element);
+        return NULL;
+    }
+
+    return element;
+}
+
+
+/* Read the tile position of each frame from PerFrameFunctionalGroupsSequence.
+ * The read point must be at the start of the sequence.
+ */
+static bool read_frame_index(DcmError **error,
+                             DcmFilehandle *filehandle)
+{
+    dcm_log_debug("reading PerFrameFunctionalGroupSequence");
+
+    filehandle->frame_index = DCM_NEW_ARRAY(error,
+                                            filehandle->num_tiles,
+                                            uint32_t);
+    if (filehandle->frame_index == NULL) {
+        return false;
+    }
+
+    // we may not have all frames ... set to missing initially
+    for (uint32_t i = 0; i < filehandle->num_tiles; i++) {
+        filehandle->frame_index[i] = 0xffffffff;
+    }
+
+    DcmReader *reader = dcm_reader_create(error,
+                                          filehandle->io,
+                                          filehandle->implicit,
+                                          filehandle->trusted);
+    if (reader == NULL) {
         return false;
     }
 
+    uint32_t frame_number = 0;
+    int32_t column_position = -1;
+    int32_t row_position = -1;
+    DcmReaderEvent event;
+    const char *value;
+    do {
+        if (!dcm_reader_next(error, reader, &event)) {
+            dcm_reader_destroy(reader);
+            return false;
+        }
+
+        switch (event.type) {
+        case DCM_READER_EVENT_SEQUENCE_BEGIN:
+            if (event.info.tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE) {
+                column_position = -1;
+                row_position = -1;
+            } else if (event.info.depth > 0 &&
+                       !dcm_reader_skip_body(error, reader)) {
+                // we only need the plane position from each item
+                dcm_reader_destroy(reader);
+                return false;
+            }
+            break;
+
+        case DCM_READER_EVENT_ELEMENT:
+            if ((event.info.tag ==
+                     TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX ||
+                 event.info.tag ==
+                     TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX) &&
+                event.info.vr == DCM_VR_SL &&
+                event.info.length == 4) {
+                if (!(value = dcm_reader_get_value(error, reader))) {
+                    dcm_reader_destroy(reader);
+                    return false;
+                }
+
+                int32_t position;
+                memcpy(&position, value, sizeof(position));
+                if (event.info.tag ==
+                    TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX) {
+                    column_position = position;
+                } else {
+                    row_position = position;
+                }
+            }
+            break;
+
+        case DCM_READER_EVENT_SEQUENCE_END:
+            // have we seen a valid pair of tile positions
+            if (event.info.tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE &&
+                column_position != -1 &&
+                row_position != -1) {
+                // we don't support fractional tile positioning ... they must
+                // be exactly aligned on tile boundaries
+                if ((column_position - 1) % filehandle->frame_width != 0 ||
+                    (row_position - 1) % filehandle->frame_height != 0) {
+                    dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                                  "reading PerFrameFunctionalGroupsSequence "
+                                  "failed",
+                                  "unsupported frame alignment");
+                    dcm_reader_destroy(reader);
+                    return false;
+                }
+
+                // map the position of the tile to the frame number
+                int col = (column_position - 1) / filehandle->frame_width;
+                int row = (row_position - 1) / filehandle->frame_height;
+                uint32_t index = col + row * filehandle->tiles_across;
+                if (index < filehandle->num_tiles) {
+                    filehandle->frame_index[index] = frame_number;
+
+                    // we have something meaningful in per frame functional
+                    // group sequence, so we must display in SPARSE mode
+                    filehandle->layout = DCM_LAYOUT_SPARSE;
+                }
+
+                // end of TAG_PLANE_POSITION_SLIDE_SEQUENCE, so we're on to
+                // the next frame
+                frame_number += 1;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        // stop at the end of PerFrameFunctionalGroupsSequence
+    } while (event.type != DCM_READER_EVENT_END &&
+             !(event.type == DCM_READER_EVENT_SEQUENCE_END &&
+               event.info.depth == 0));
+
+    dcm_reader_destroy(reader);
+
     return true;
 }
 
@@ -1141,6 +1674,7 @@ static bool read_skip_to(DcmError **error,
     if (!dcm_parse_dataset(error,
                            filehandle->io,
                            filehandle->implicit,
+                           filehandle->trusted,
                            &parse,
                            filehandle)) {
         return false;
@@ -1204,6 +1738,7 @@ read_extended_offsets(DcmError **error,
     if (!dcm_parse_dataset(error,
                            filehandle->io,
                            filehandle->implicit,
+                           filehandle->trusted,
                            &parse,
                            filehandle)) {
         return false;
@@ -1331,30 +1866,150 @@ bool dcm_filehandle_prepare_read_frame(DcmError **error,
 }
 
 
-DcmFrame *dcm_filehandle_read_frame(DcmError **error,
+bool dcm_filehandle_set_frame_cache(DcmError **error,
                                     DcmFilehandle *filehandle,
-                                    uint32_t frame_number)
+                                    uint64_t budget)
 {
-    dcm_log_debug("read frame number #%u", frame_number);
+    DcmFrameCache *cache = NULL;
+
+    if (budget > 0 &&
+        !(cache = dcm_frame_cache_create(error, budget))) {
+        return false;
+    }
+
+    dcm_frame_cache_destroy(filehandle->frame_cache);
+    filehandle->frame_cache = cache;
+
+    return true;
+}
+
+
+static bool set_cache_identity(DcmError **error, DcmFilehandle *filehandle)
+{
+    if (filehandle->cache_identity) {
+        return true;
+    }
+
+    // the same instance in the same transfer syntax has the same frames,
+    // whichever file it comes from
+    const DcmDataSet *metadata = dcm_filehandle_get_metadata_subset(error,
+                                                                    filehandle);
+    const char *sop_instance_uid;
+    if (metadata == NULL ||
+        !get_tag_str(error,
+                     metadata,
+                     DCM_TAG_SOPInstanceUID,
+                     &sop_instance_uid)) {
+        return false;
+    }
+
+    char *identity = dcm_printf_append(NULL,
+                                       "%s\\%s",
+                                       sop_instance_uid,
+                                       filehandle->transfer_syntax_uid);
+    if (identity == NULL || strlen(identity) > DCM_MAX_CACHE_IDENTITY) {
+        free(identity);
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "enabling shared frame cache failed",
+                      "bad SOPInstanceUID");
+        return false;
+    }
+    filehandle->cache_identity = identity;
+
+    return true;
+}
+
+
+bool dcm_filehandle_set_shared_frame_cache(DcmError **error,
+                                           DcmFilehandle *filehandle,
+                                           bool shared)
+{
+    if (shared && !set_cache_identity(error, filehandle)) {
+        return false;
+    }
+    filehandle->shared_frame_cache = shared;
+
+    return true;
+}
+
+
+bool dcm_filehandle_set_shm_frame_cache(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        DcmShmFrameCache *cache)
+{
+    if (cache && !set_cache_identity(error, filehandle)) {
+        return false;
+    }
+    filehandle->shm_frame_cache = cache;
+
+    return true;
+}
+
+
+void dcm_filehandle_get_frame_cache_stats(const DcmFilehandle *filehandle,
+                                          uint64_t *hits,
+                                          uint64_t *misses)
+{
+    *hits = 0;
+    *misses = 0;
+    if (filehandle->frame_cache) {
+        dcm_frame_cache_get_stats(filehandle->frame_cache, hits, misses);
+    }
+}
+
 
+static bool check_frame_number(DcmError **error,
+                               DcmFilehandle *filehandle,
+                               uint32_t frame_number)
+{
     if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
-        return NULL;
+        return false;
     }
 
     if (frame_number == 0) {
         dcm_error_set(error, DCM_ERROR_CODE_PARSE,
                       "reading frame item failed",
                       "frame number must be non-zero");
-        return NULL;
+        return false;
     }
     if (frame_number > filehandle->num_frames) {
         dcm_error_set(error, DCM_ERROR_CODE_PARSE,
                       "reading frame item failed",
                       "frame number must be less than %u",
                       filehandle->num_frames);
-        return NULL;
+        return false;
     }
 
+    return true;
+}
+
+
+static DcmFrame *create_frame(DcmError **error,
+                              DcmFilehandle *filehandle,
+                              uint32_t frame_number,
+                              char *frame_data,
+                              uint32_t length)
+{
+    return dcm_frame_create(error,
+                            frame_number,
+                            frame_data,
+                            length,
+                            filehandle->desc.rows,
+                            filehandle->desc.columns,
+                            filehandle->desc.samples_per_pixel,
+                            filehandle->desc.bits_allocated,
+                            filehandle->desc.bits_stored,
+                            filehandle->desc.pixel_representation,
+                            filehandle->desc.planar_configuration,
+                            filehandle->desc.photometric_interpretation,
+                            filehandle->desc.transfer_syntax_uid);
+}
+
+
+static DcmFrame *read_frame(DcmError **error,
+                            DcmFilehandle *filehandle,
+                            uint32_t frame_number)
+{
     // we are zero-based from here on
     uint32_t i = frame_number - 1;
 
@@ -1389,86 +2044,1337 @@ DcmFrame *dcm_filehandle_read_frame(DcmError **error,
         return NULL;
     }
 
-    return dcm_frame_create(error,
-                            frame_number,
-                            frame_data,
-                            length,
-                            filehandle->desc.rows,
-                            filehandle->desc.columns,
-                            filehandle->desc.samples_per_pixel,
-                            filehandle->desc.bits_allocated,
-                            filehandle->desc.bits_stored,
-                            filehandle->desc.pixel_representation,
-                            filehandle->desc.planar_configuration,
-                            filehandle->desc.photometric_interpretation,
-                            filehandle->desc.transfer_syntax_uid);
+    return create_frame(error, filehandle, frame_number, frame_data, length);
 }
 
 
-bool dcm_filehandle_get_frame_number(DcmError **error,
-                                     DcmFilehandle *filehandle,
-                                     uint32_t column,
-                                     uint32_t row,
-                                     uint32_t *frame_number)
+/* Look for a frame in our caches, and add it to the nearer caches if we
+ * find it in a further one. Sets *frame to NULL on a miss.
+ */
+static bool find_cached_frame(DcmError **error,
+                              DcmFilehandle *filehandle,
+                              uint32_t frame_number,
+                              DcmFrame **frame)
 {
-    dcm_log_debug("Get frame number at (%u, %u)", column, row);
-
-    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
-        return false;
+    DcmFrameCache *cache = filehandle->frame_cache;
+    const char *identity = filehandle->shared_frame_cache ?
+                           filehandle->cache_identity : NULL;
+    DcmShmFrameCache *shm = filehandle->shm_frame_cache;
+    DcmFrame *found = NULL;
+
+    // a frame can only be in a cache if it has been read before, so
+    // there's no need to prepare or check the frame number
+    if (cache && (*frame = dcm_frame_cache_get(cache, "", frame_number))) {
+        return true;
     }
 
-    if (column >= filehandle->tiles_across ||
-        row >= filehandle->tiles_down) {
-        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                      "reading Frame position failed",
-                      "column and Row must be less than %u, %u",
-                      filehandle->tiles_across,
-                      filehandle->tiles_down);
-        return false;
+    if (identity) {
+        found = dcm_shared_frame_cache_get(identity, frame_number);
     }
 
-    int64_t index = column + row * filehandle->tiles_across;
-    if (filehandle->layout == DCM_LAYOUT_SPARSE) {
-        index = filehandle->frame_index[index];
-        if (index == 0xffffffff) {
-            dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
-                          "no frame",
-                          "no frame at position (%u, %u)", column, row);
+    if (found == NULL && shm) {
+        // we need the pixel description to make a frame
+        if (!check_frame_number(error, filehandle, frame_number)) {
             return false;
         }
-    } else {
-        // subtract the start of this file, for catenation support
-        index -= filehandle->frame_offset;
-        if (index < 0 || index >= (int64_t) filehandle->num_frames) {
-            dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
-                          "no frame",
-                          "no frame at position (%u, %u)", column, row);
+
+        uint32_t length;
+        char *frame_data = dcm_shm_frame_cache_get(shm,
+                                                   filehandle->cache_identity,
+                                                   frame_number,
+                                                   &length);
+        if (frame_data &&
+            !(found = create_frame(error,
+                                   filehandle,
+                                   frame_number,
+                                   frame_data,
+                                   length))) {
+            return false;
+        }
+
+        if (found &&
+            identity &&
+            !dcm_shared_frame_cache_put(error, identity, found)) {
+            dcm_frame_destroy(found);
             return false;
         }
     }
 
-    // frame numbers are from 1, and are always uint32
-    if (frame_number)
-        *frame_number = (uint32_t) (index + 1);
+    if (found && cache && !dcm_frame_cache_put(error, cache, "", found)) {
+        dcm_frame_destroy(found);
+        return false;
+    }
+
+    *frame = found;
 
     return true;
 }
 
 
-DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
-                                             DcmFilehandle *filehandle,
-                                             uint32_t column,
-                                             uint32_t row)
+// add a frame we have read to all our caches
+static bool cache_frame(DcmError **error,
+                        DcmFilehandle *filehandle,
+                        DcmFrame *frame)
 {
-    dcm_log_debug("Read frame position (%u, %u)", column, row);
+    DcmFrameCache *cache = filehandle->frame_cache;
+    const char *identity = filehandle->shared_frame_cache ?
+                           filehandle->cache_identity : NULL;
+    DcmShmFrameCache *shm = filehandle->shm_frame_cache;
 
-    uint32_t frame_number;
-    if (!dcm_filehandle_get_frame_number(error,
-            filehandle, column, row, &frame_number)) {
+    if (shm) {
+        dcm_shm_frame_cache_put(shm,
+                                filehandle->cache_identity,
+                                dcm_frame_get_number(frame),
+                                dcm_frame_get_value(frame),
+                                dcm_frame_get_length(frame));
+    }
+
+    return (!cache || dcm_frame_cache_put(error, cache, "", frame)) &&
+           (!identity || dcm_shared_frame_cache_put(error, identity, frame));
+}
+
+
+DcmFrame *dcm_filehandle_read_frame(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t frame_number)
+{
+    dcm_log_debug("read frame number #%u", frame_number);
+
+    DcmFrame *frame;
+    if (!find_cached_frame(error, filehandle, frame_number, &frame)) {
+        return NULL;
+    }
+    if (frame) {
+        return frame;
+    }
+
+    if (!check_frame_number(error, filehandle, frame_number)) {
+        return NULL;
+    }
+
+    frame = read_frame(error, filehandle, frame_number);
+    if (frame && !cache_frame(error, filehandle, frame)) {
+        dcm_frame_destroy(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+
+/* The bytes a frame occupies in the file, if we can tell without parsing
+ * it. We can't tell where the last encapsulated frame ends.
+ */
+static bool get_frame_range(DcmFilehandle *filehandle,
+                            uint32_t frame_number,
+                            int64_t *offset,
+                            int64_t *length)
+{
+    const char *syntax = dcm_filehandle_get_transfer_syntax_uid(filehandle);
+    uint32_t i = frame_number - 1;
+
+    *offset = filehandle->pixel_data_offset +
+              filehandle->first_frame_offset +
+              filehandle->offset_table[i];
+
+    if (!dcm_is_encapsulated_transfer_syntax(syntax)) {
+        // the same size dcm_parse_frame() reads
+        *length = (uint32_t) (filehandle->desc.rows *
+                              filehandle->desc.columns *
+                              filehandle->desc.samples_per_pixel *
+                              (filehandle->desc.bits_allocated / 8));
+    } else if (frame_number < filehandle->num_frames) {
+        *length = filehandle->offset_table[i + 1] -
+                  filehandle->offset_table[i];
+    } else {
+        return false;
+    }
+
+    return *length > 0 && *length <= 0xFFFFFFFF;
+}
+
+
+// make a frame from the bytes get_frame_range() gave, which we own
+static DcmFrame *frame_from_range(DcmError **error,
+                                  DcmFilehandle *filehandle,
+                                  uint32_t frame_number,
+                                  char *buffer,
+                                  int64_t length)
+{
+    const char *syntax = dcm_filehandle_get_transfer_syntax_uid(filehandle);
+
+    if (!dcm_is_encapsulated_transfer_syntax(syntax)) {
+        return create_frame(error,
+                            filehandle,
+                            frame_number,
+                            buffer,
+                            (uint32_t) length);
+    }
+
+    DcmIO *io = dcm_io_create_from_memory(error, buffer, length);
+    if (io == NULL) {
+        free(buffer);
+        return NULL;
+    }
+
+    uint32_t frame_length;
+    char *frame_data = dcm_parse_encapsulated_frame(error,
+                                                    io,
+                                                    filehandle->implicit,
+                                                    length,
+                                                    &frame_length);
+    dcm_io_close(io);
+    free(buffer);
+    if (frame_data == NULL) {
+        return NULL;
+    }
+
+    return create_frame(error,
+                        filehandle,
+                        frame_number,
+                        frame_data,
+                        frame_length);
+}
+
+
+bool dcm_filehandle_read_frames(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                const uint32_t *frame_numbers,
+                                uint32_t n_frames,
+                                DcmFrame **frames)
+{
+    dcm_log_debug("read %u frames", n_frames);
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        frames[i] = NULL;
+    }
+    if (n_frames == 0) {
+        return true;
+    }
+
+    DcmIORead *reads = DCM_NEW_ARRAY(error, n_frames, DcmIORead);
+    if (reads == NULL) {
+        return false;
+    }
+    // the index in frames of each read
+    uint32_t *read_index = DCM_NEW_ARRAY(error, n_frames, uint32_t);
+    if (read_index == NULL) {
+        free(reads);
+        return false;
+    }
+
+    // cached frames, and frames we can't find the end of, are done now,
+    // the rest are read together
+    uint32_t n_reads = 0;
+    bool success = true;
+    for (uint32_t i = 0; i < n_frames; i++) {
+        uint32_t frame_number = frame_numbers[i];
+        int64_t offset;
+        int64_t length;
+
+        if (!check_frame_number(error, filehandle, frame_number) ||
+            !find_cached_frame(error, filehandle, frame_number, &frames[i])) {
+            success = false;
+            break;
+        }
+        if (frames[i]) {
+            continue;
+        }
+
+        if (!get_frame_range(filehandle, frame_number, &offset, &length)) {
+            frames[i] = read_frame(error, filehandle, frame_number);
+            if (frames[i] == NULL ||
+                !cache_frame(error, filehandle, frames[i])) {
+                success = false;
+                break;
+            }
+            continue;
+        }
+
+        char *buffer = DCM_MALLOC(error, length);
+        if (buffer == NULL) {
+            success = false;
+            break;
+        }
+        reads[n_reads].offset = offset;
+        reads[n_reads].length = length;
+        reads[n_reads].buffer = buffer;
+        read_index[n_reads] = i;
+        n_reads += 1;
+    }
+
+    // batch reads can move the read point
+    int64_t position;
+    success = success &&
+              dcm_offset(error, filehandle, &position) &&
+              dcm_io_read_batch(error, filehandle->io, reads, n_reads) &&
+              dcm_seekset(error, filehandle, position);
+
+    for (uint32_t j = 0; j < n_reads; j++) {
+        if (!success) {
+            free(reads[j].buffer);
+            continue;
+        }
+
+        uint32_t i = read_index[j];
+        frames[i] = frame_from_range(error,
+                                     filehandle,
+                                     frame_numbers[i],
+                                     reads[j].buffer,
+                                     reads[j].length);
+        if (frames[i] == NULL ||
+            !cache_frame(error, filehandle, frames[i])) {
+            success = false;
+        }
+    }
+
+    free(reads);
+    free(read_index);
+
+    if (!success) {
+        for (uint32_t i = 0; i < n_frames; i++) {
+            dcm_frame_destroy(frames[i]);
+            frames[i] = NULL;
+        }
+    }
+
+    return success;
+}
+
+
+
+
+static bool read_frame_async(DcmError **error,
+                             DcmFilehandle *filehandle,
+                             uint32_t frame_number,
+                             DcmFrameCallback callback,
+                             DcmCompletionQueue *queue,
+                             void *user)
+{
+    dcm_log_debug("read frame number #%u asynchronously", frame_number);
+
+    if (filehandle->async == NULL &&
+        !(filehandle->async = dcm_async_state_create(error))) {
+        return false;
+    }
+
+    return dcm_async_read_frame(error,
+                                filehandle->async,
+                                filehandle,
+                                frame_number,
+                                callback,
+                                queue,
+                                user);
+}
+
+
+bool dcm_filehandle_read_frame_async(DcmError **error,
+                                     DcmFilehandle *filehandle,
+                                     uint32_t frame_number,
+                                     DcmFrameCallback callback,
+                                     void *user)
+{
+    return read_frame_async(error,
+                            filehandle,
+                            frame_number,
+                            callback,
+                            NULL,
+                            user);
+}
+
+
+bool dcm_filehandle_read_frame_queued(DcmError **error,
+                                      DcmFilehandle *filehandle,
+                                      uint32_t frame_number,
+                                      DcmCompletionQueue *queue,
+                                      void *user)
+{
+    return read_frame_async(error,
+                            filehandle,
+                            frame_number,
+                            NULL,
+                            queue,
+                            user);
+}
+
+
+bool dcm_filehandle_prefetch_frames(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    const uint32_t *frame_numbers,
+                                    uint32_t n_frames)
+{
+    dcm_log_debug("prefetch %u frames", n_frames);
+
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return false;
+    }
+
+    int64_t frames_offset = filehandle->pixel_data_offset +
+                            filehandle->first_frame_offset;
+
+    // merge runs of adjacent frames into a single hint
+    int64_t start = 0;
+    int64_t end = 0;
+    for (uint32_t i = 0; i < n_frames; i++) {
+        uint32_t frame_number = frame_numbers[i];
+        if (frame_number == 0 || frame_number > filehandle->num_frames) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "prefetching frames failed",
+                          "frame number %u out of range", frame_number);
+            return false;
+        }
+
+        // zero-based, and the last frame runs to the end of the file
+        uint32_t j = frame_number - 1;
+        int64_t frame_start = frames_offset + filehandle->offset_table[j];
+        int64_t frame_end = frame_number < filehandle->num_frames ?
+                            frames_offset + filehandle->offset_table[j + 1] :
+                            0;
+
+        if (end != 0 && frame_start == end) {
+            end = frame_end;
+            continue;
+        }
+
+        if (start != 0) {
+            dcm_io_advise(filehandle->io, start, end == 0 ? 0 : end - start);
+        }
+        start = frame_start;
+        end = frame_end;
+    }
+
+    if (start != 0) {
+        dcm_io_advise(filehandle->io, start, end == 0 ? 0 : end - start);
+    }
+
+    return true;
+}
+
+
+bool dcm_filehandle_get_frame_number(DcmError **error,
+                                     DcmFilehandle *filehandle,
+                                     uint32_t column,
+                                     uint32_t row,
+                                     uint32_t *frame_number)
+{
+    dcm_log_debug("Get frame number at (%u, %u)", column, row);
+
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return false;
+    }
+
+    if (column >= filehandle->tiles_across ||
+        row >= filehandle->tiles_down) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "reading Frame position failed",
+                      "column and Row must be less than %u, %u",
+                      filehandle->tiles_across,
+                      filehandle->tiles_down);
+        return false;
+    }
+
+    int64_t index = column + row * filehandle->tiles_across;
+    if (filehandle->layout == DCM_LAYOUT_SPARSE) {
+        index = filehandle->frame_index[index];
+        if (index == 0xffffffff) {
+            dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
+                          "no frame",
+                          "no frame at position (%u, %u)", column, row);
+            return false;
+        }
+    } else {
+        // subtract the start of this file, for catenation support
+        index -= filehandle->frame_offset;
+        if (index < 0 || index >= (int64_t) filehandle->num_frames) {
+            dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
+                          "no frame",
+                          "no frame at position (%u, %u)", column, row);
+            return false;
+        }
+    }
+
+    // frame numbers are from 1, and are always uint32
+    if (frame_number)
+        *frame_number = (uint32_t) (index + 1);
+
+    return true;
+}
+
+
+bool dcm_filehandle_set_prefetch(DcmError **error,
+                                 DcmFilehandle *filehandle,
+                                 uint32_t budget)
+{
+    uint32_t *prefetch_frames = NULL;
+
+    if (budget > 0 &&
+        !(prefetch_frames = DCM_NEW_ARRAY(error, budget, uint32_t))) {
+        return false;
+    }
+
+    if (filehandle->prefetch_frames) {
+        free(filehandle->prefetch_frames);
+    }
+    filehandle->prefetch_frames = prefetch_frames;
+    filehandle->prefetch_budget = budget;
+    filehandle->have_last_position = false;
+
+    return true;
+}
+
+
+static int sign(int64_t x)
+{
+    return (x > 0) - (x < 0);
+}
+
+
+// add the frame at a tile position to the prefetch list, if there is one
+static void prefetch_add(DcmFilehandle *filehandle,
+                         uint32_t *n_frames,
+                         int64_t column,
+                         int64_t row)
+{
+    uint32_t frame_number;
+
+    if (*n_frames < filehandle->prefetch_budget &&
+        column >= 0 &&
+        row >= 0 &&
+        column < filehandle->tiles_across &&
+        row < filehandle->tiles_down &&
+        dcm_filehandle_get_frame_number(NULL,
+                                        filehandle,
+                                        (uint32_t) column,
+                                        (uint32_t) row,
+                                        &frame_number)) {
+        filehandle->prefetch_frames[(*n_frames)++] = frame_number;
+    }
+}
+
+
+/* Guess which tiles a viewer will want next and hint them.
+ *
+ * If the last two moves were in the same direction, the viewer is probably
+ * panning, so we hint the tiles ahead, nearest first, in a band three tiles
+ * wide. Otherwise we hint the tiles immediately around this one.
+ */
+static void prefetch_around(DcmFilehandle *filehandle,
+                            uint32_t column,
+                            uint32_t row)
+{
+    int pan_columns = 0;
+    int pan_rows = 0;
+    if (filehandle->have_last_position) {
+        pan_columns = sign((int64_t) column - filehandle->last_column);
+        pan_rows = sign((int64_t) row - filehandle->last_row);
+    }
+    bool panning = (pan_columns != 0 || pan_rows != 0) &&
+                   pan_columns == filehandle->pan_columns &&
+                   pan_rows == filehandle->pan_rows;
+
+    filehandle->have_last_position = true;
+    filehandle->last_column = column;
+    filehandle->last_row = row;
+    filehandle->pan_columns = pan_columns;
+    filehandle->pan_rows = pan_rows;
+
+    uint32_t n_frames = 0;
+    if (panning) {
+        uint32_t steps = MAX(filehandle->tiles_across, filehandle->tiles_down);
+
+        for (uint32_t step = 1;
+             step <= steps && n_frames < filehandle->prefetch_budget;
+             step++) {
+            int64_t ahead_column = column + (int64_t) step * pan_columns;
+            int64_t ahead_row = row + (int64_t) step * pan_rows;
+
+            // the tile ahead, then those either side of it
+            prefetch_add(filehandle, &n_frames, ahead_column, ahead_row);
+            prefetch_add(filehandle, &n_frames,
+                         ahead_column + pan_rows, ahead_row - pan_columns);
+            prefetch_add(filehandle, &n_frames,
+                         ahead_column - pan_rows, ahead_row + pan_columns);
+        }
+    } else {
+        for (int i = -1; i <= 1; i++) {
+            for (int j = -1; j <= 1; j++) {
+                if (i != 0 || j != 0) {
+                    prefetch_add(filehandle, &n_frames,
+                                 (int64_t) column + j, (int64_t) row + i);
+                }
+            }
+        }
+    }
+
+    if (n_frames > 0) {
+        (void) dcm_filehandle_prefetch_frames(NULL,
+                                              filehandle,
+                                              filehandle->prefetch_frames,
+                                              n_frames);
+    }
+}
+
+
+DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t column,
+                                             uint32_t row)
+{
+    dcm_log_debug("Read frame position (%u, %u)", column, row);
+
+    uint32_t frame_number;
+    if (!dcm_filehandle_get_frame_number(error,
+            filehandle, column, row, &frame_number)) {
+        return NULL;
+    }
+
+    DcmFrame *frame = dcm_filehandle_read_frame(error,
+                                                filehandle,
+                                                frame_number);
+    if (frame && filehandle->prefetch_budget > 0) {
+        prefetch_around(filehandle, column, row);
+    }
+
+    return frame;
+}
+
+
+struct ExtractClient {
+    uint32_t sequence_tag;
+    const DcmPath *path;
+    uint32_t index;
+
+    // our position in the tree
+    UT_array *levels;
+
+    // set if we found the sequence, and if we found a value in this item
+    bool have_sequence;
+    bool have_value;
+
+    // one of these will be set
+    int64_t *integers;
+    double *decimals;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+
+static UT_icd path_level_icd = {
+    sizeof(struct PathLevel), NULL, NULL, NULL
+};
+
+
+static bool extract_dataset_begin(DcmError **error, void *client)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+
+    USED(error);
+
+    // starting an item in the sequence we are extracting from
+    if (utarray_len(extract->levels) == 1) {
+        extract->have_value = false;
+    }
+
+    return true;
+}
+
+
+static bool extract_dataset_end(DcmError **error, void *client)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+    unsigned int depth = utarray_len(extract->levels);
+
+    if (depth == 0) {
+        return true;
+    }
+
+    struct PathLevel *level = (struct PathLevel *) utarray_back(extract->levels);
+    if (depth == 1 &&
+        level->tag == extract->sequence_tag &&
+        !extract->have_value) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "extracting values failed",
+                      "item %u has no suitable value %u for "
+                      "data element '%08x'",
+                      level->index,
+                      extract->index,
+                      dcm_path_get_tag(extract->path));
+        return false;
+    }
+    level->index += 1;
+
+    return true;
+}
+
+
+static bool extract_sequence_begin(DcmError **error,
+                                   void *client,
+                                   uint32_t tag,
+                                   DcmVR vr,
+                                   uint32_t length)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+    struct PathLevel level = { tag, 0 };
+
+    USED(error);
+    USED(vr);
+    USED(length);
+
+    if (utarray_len(extract->levels) == 0 && tag == extract->sequence_tag) {
+        extract->have_sequence = true;
+    }
+    utarray_push_back(extract->levels, &level);
+
+    return true;
+}
+
+
+static bool extract_sequence_end(DcmError **error,
+                                 void *client,
+                                 uint32_t tag,
+                                 DcmVR vr,
+                                 uint32_t length)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+
+    USED(error);
+    USED(tag);
+    USED(vr);
+    USED(length);
+
+    utarray_pop_back(extract->levels);
+
+    return true;
+}
+
+
+static bool extract_element_create(DcmError **error,
+                                   void *client,
+                                   uint32_t tag,
+                                   DcmVR vr,
+                                   char *value,
+                                   uint32_t length)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+    unsigned int depth = utarray_len(extract->levels);
+
+    if (depth == 0) {
+        return true;
+    }
+
+    struct PathLevel *levels =
+        (struct PathLevel *) utarray_eltptr(extract->levels, 0);
+    if (levels[0].tag != extract->sequence_tag ||
+        !dcm_path_match(extract->path, levels + 1, depth - 1, tag)) {
+        return true;
+    }
+
+    if (extract->count == extract->capacity) {
+        uint32_t capacity = MAX(16, extract->capacity * 2);
+        if (extract->integers) {
+            int64_t *integers = dcm_realloc(error,
+                                            extract->integers,
+                                            capacity * sizeof(int64_t));
+            if (integers == NULL) {
+                return false;
+            }
+            extract->integers = integers;
+        } else {
+            double *decimals = dcm_realloc(error,
+                                           extract->decimals,
+                                           capacity * sizeof(double));
+            if (decimals == NULL) {
+                return false;
+            }
+            extract->decimals = decimals;
+        }
+        extract->capacity = capacity;
+    }
+
+    bool success;
+    if (extract->integers) {
+        success = dcm_value_to_integer(vr, value, length, extract->index,
+                                       &extract->integers[extract->count]);
+    } else {
+        success = dcm_value_to_decimal(vr, value, length, extract->index,
+                                       &extract->decimals[extract->count]);
+    }
+    if (!success) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "extracting values failed",
+                      "item %u has no suitable value %u for "
+                      "data element '%08x'",
+                      levels[0].index, extract->index, tag);
+        return false;
+    }
+
+    extract->count += 1;
+    extract->have_value = true;
+
+    return true;
+}
+
+
+static bool extract_stop(void *client,
+                         uint32_t tag,
+                         DcmVR vr,
+                         uint32_t length)
+{
+    struct ExtractClient *extract = (struct ExtractClient *) client;
+
+    USED(vr);
+    USED(length);
+
+    // top-level tags are in ascending order, so we can stop as soon as we
+    // pass the sequence
+    return tag > extract->sequence_tag ||
+           tag == TAG_PIXEL_DATA ||
+           tag == TAG_FLOAT_PIXEL_DATA ||
+           tag == TAG_DOUBLE_PIXEL_DATA;
+}
+
+
+static bool filehandle_extract(DcmError **error,
+                               DcmFilehandle *filehandle,
+                               struct ExtractClient *extract)
+{
+    static DcmParse parse = {
+        .dataset_begin = extract_dataset_begin,
+        .dataset_end = extract_dataset_end,
+        .sequence_begin = extract_sequence_begin,
+        .sequence_end = extract_sequence_end,
+        .element_create = extract_element_create,
+        .stop = extract_stop,
+    };
+
+    // rewind to the start of the image metadata
+    if (dcm_filehandle_get_file_meta(error, filehandle) == NULL) {
+        return false;
+    }
+
+    utarray_new(extract->levels, &path_level_icd);
+    bool success = dcm_parse_dataset(error,
+                                     filehandle->io,
+                                     filehandle->implicit,
+                                     filehandle->trusted,
+                                     &parse,
+                                     extract);
+    utarray_free(extract->levels);
+    if (!success) {
+        return false;
+    }
+
+    if (!extract->have_sequence) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "extracting values failed",
+                      "no sequence '%08x' in file",
+                      extract->sequence_tag);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool dcm_filehandle_extract_decimal(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t sequence_tag,
+                                    const DcmPath *path,
+                                    uint32_t index,
+                                    double **values,
+                                    uint32_t *count)
+{
+    struct ExtractClient extract = {
+        .sequence_tag = sequence_tag,
+        .path = path,
+        .index = index,
+    };
+
+    // an empty sequence still gives a valid array
+    extract.decimals = DCM_NEW_ARRAY(error, 1, double);
+    if (extract.decimals == NULL) {
+        return false;
+    }
+    extract.capacity = 1;
+
+    if (!filehandle_extract(error, filehandle, &extract)) {
+        free(extract.decimals);
+        return false;
+    }
+
+    *values = extract.decimals;
+    *count = extract.count;
+
+    return true;
+}
+
+
+bool dcm_filehandle_extract_integer(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t sequence_tag,
+                                    const DcmPath *path,
+                                    uint32_t index,
+                                    int64_t **values,
+                                    uint32_t *count)
+{
+    struct ExtractClient extract = {
+        .sequence_tag = sequence_tag,
+        .path = path,
+        .index = index,
+    };
+
+    extract.integers = DCM_NEW_ARRAY(error, 1, int64_t);
+    if (extract.integers == NULL) {
+        return false;
+    }
+    extract.capacity = 1;
+
+    if (!filehandle_extract(error, filehandle, &extract)) {
+        free(extract.integers);
+        return false;
+    }
+
+    *values = extract.integers;
+    *count = extract.count;
+
+    return true;
+}
+
+
+/* Schema paths can't be nested more deeply than this.
+ */
+#define SCHEMA_MAX_DEPTH (16)
+
+
+struct SchemaField {
+    DcmPath *path;
+    DcmVR vr;
+    size_t offset;
+    size_t size;
+    uint32_t vm;
+    bool required;
+
+    // bytes taken by all vm values in the record
+    size_t length;
+};
+
+
+struct _DcmSchema {
+    uint32_t n_fields;
+    struct SchemaField *fields;
+
+    // the number of required fields, and the highest top-level tag we need
+    uint32_t n_required;
+    uint32_t last_tag;
+
+    // the length of the largest field
+    size_t max_length;
+};
+
+
+DcmSchema *dcm_schema_create(DcmError **error,
+                             const DcmBinding *bindings,
+                             uint32_t n_bindings)
+{
+    DcmSchema *schema = DCM_NEW(error, DcmSchema);
+    if (schema == NULL) {
+        return NULL;
+    }
+    schema->fields = DCM_NEW_ARRAY(error,
+                                   MAX(n_bindings, 1),
+                                   struct SchemaField);
+    if (schema->fields == NULL) {
+        dcm_schema_destroy(schema);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < n_bindings; i++) {
+        const DcmBinding *binding = &bindings[i];
+        struct SchemaField *field = &schema->fields[i];
+        DcmVRClass vr_class = dcm_dict_vr_class(binding->vr);
+
+        if (vr_class != DCM_VR_CLASS_NUMERIC_DECIMAL &&
+            vr_class != DCM_VR_CLASS_NUMERIC_INTEGER &&
+            vr_class != DCM_VR_CLASS_STRING_SINGLE &&
+            vr_class != DCM_VR_CLASS_STRING_MULTI) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "creating schema failed",
+                          "field '%s' must have a numeric or string VR",
+                          binding->path);
+            dcm_schema_destroy(schema);
+            return NULL;
+        }
+        if (binding->vm == 0 ||
+            ((vr_class == DCM_VR_CLASS_STRING_SINGLE ||
+              vr_class == DCM_VR_CLASS_STRING_MULTI) &&
+             binding->size == 0)) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "creating schema failed",
+                          "field '%s' has no space for values",
+                          binding->path);
+            dcm_schema_destroy(schema);
+            return NULL;
+        }
+
+        field->path = dcm_path_compile(error, binding->path);
+        if (field->path == NULL) {
+            dcm_schema_destroy(schema);
+            return NULL;
+        }
+        schema->n_fields += 1;
+        if (dcm_path_get_length(field->path) > SCHEMA_MAX_DEPTH) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "creating schema failed",
+                          "field '%s' is nested too deeply",
+                          binding->path);
+            dcm_schema_destroy(schema);
+            return NULL;
+        }
+
+        field->vr = binding->vr;
+        field->offset = binding->offset;
+        field->size = binding->size;
+        field->vm = binding->vm;
+        field->required = binding->required;
+        if (vr_class == DCM_VR_CLASS_STRING_SINGLE ||
+            vr_class == DCM_VR_CLASS_STRING_MULTI) {
+            field->length = field->vm * field->size;
+        } else {
+            field->length = field->vm * dcm_dict_vr_size(field->vr);
+        }
+        schema->max_length = MAX(schema->max_length, field->length);
+
+        if (field->required) {
+            schema->n_required += 1;
+        }
+        schema->last_tag = MAX(schema->last_tag,
+                               dcm_path_get_root_tag(field->path));
+    }
+
+    return schema;
+}
+
+
+void dcm_schema_destroy(DcmSchema *schema)
+{
+    if (schema) {
+        if (schema->fields) {
+            for (uint32_t i = 0; i < schema->n_fields; i++) {
+                dcm_path_destroy(schema->fields[i].path);
+            }
+            free(schema->fields);
+        }
+        free(schema);
+    }
+}
+
+
+struct BindClient {
+    const DcmSchema *schema;
+    char *record;
+
+    // values are converted here, and only copied to the record once they
+    // have all converted, so a failed field leaves the record untouched
+    char *values;
+
+    // our position in the tree ... we don't record levels deeper than any
+    // schema path
+    struct PathLevel levels[SCHEMA_MAX_DEPTH];
+    uint32_t depth;
+
+    uint32_t n_required_found;
+};
+
+
+// copy the index'th value of a string into a fixed-size field
+static bool bind_string(const struct SchemaField *field,
+                        DcmVR vr,
+                        const char *value,
+                        uint32_t length,
+                        uint32_t index,
+                        char *result)
+{
+    DcmVRClass vr_class = dcm_dict_vr_class(vr);
+    if (vr_class != DCM_VR_CLASS_STRING_SINGLE &&
+        vr_class != DCM_VR_CLASS_STRING_MULTI) {
+        return false;
+    }
+
+    // the parser may have replaced trailing padding with a null
+    const char *end = memchr(value, '\0', length);
+    if (end == NULL) {
+        end = value + length;
+    }
+
+    // only multi-valued strings use a separator
+    if (vr_class == DCM_VR_CLASS_STRING_MULTI) {
+        for (uint32_t i = 0; i < index; i++) {
+            const char *separator = memchr(value, '\\', end - value);
+            if (separator == NULL) {
+                return false;
+            }
+            value = separator + 1;
+        }
+        const char *separator = memchr(value, '\\', end - value);
+        if (separator) {
+            end = separator;
+        }
+    } else if (index > 0) {
+        return false;
+    }
+
+    size_t field_length = MIN((size_t) (end - value), field->size - 1);
+    memcpy(result, value, field_length);
+    result[field_length] = '\0';
+
+    return true;
+}
+
+
+static bool bind_field(const struct SchemaField *field,
+                       DcmVR vr,
+                       const char *value,
+                       uint32_t length,
+                       char *values,
+                       char *record)
+{
+    DcmVRClass vr_class = dcm_dict_vr_class(field->vr);
+
+    for (uint32_t i = 0; i < field->vm; i++) {
+        if (vr_class == DCM_VR_CLASS_STRING_SINGLE ||
+            vr_class == DCM_VR_CLASS_STRING_MULTI) {
+            if (!bind_string(field, vr, value, length, i,
+                             values + i * field->size)) {
+                return false;
+            }
+        } else if (vr_class == DCM_VR_CLASS_NUMERIC_DECIMAL) {
+            double decimal;
+            if (!dcm_value_to_decimal(vr, value, length, i, &decimal)) {
+                return false;
+            }
+            char *p = values + i * dcm_dict_vr_size(field->vr);
+#define POKE(TYPE) { TYPE v = (TYPE) decimal; memcpy(p, &v, sizeof(v)); }
+            DCM_SWITCH_NUMERIC(field->vr, POKE);
+#undef POKE
+        } else {
+            int64_t integer;
+            if (!dcm_value_to_integer(vr, value, length, i, &integer)) {
+                return false;
+            }
+            char *p = values + i * dcm_dict_vr_size(field->vr);
+#define POKE(TYPE) { TYPE v = (TYPE) integer; memcpy(p, &v, sizeof(v)); }
+            DCM_SWITCH_NUMERIC(field->vr, POKE);
+#undef POKE
+        }
+    }
+
+    memcpy(record + field->offset, values, field->length);
+
+    return true;
+}
+
+
+static bool bind_dataset_end(DcmError **error, void *client)
+{
+    struct BindClient *bind = (struct BindClient *) client;
+
+    USED(error);
+
+    // end of an item, so step the index of the enclosing sequence
+    if (bind->depth > 0 && bind->depth <= SCHEMA_MAX_DEPTH) {
+        bind->levels[bind->depth - 1].index += 1;
+    }
+
+    return true;
+}
+
+
+static bool bind_sequence_begin(DcmError **error,
+                                void *client,
+                                uint32_t tag,
+                                DcmVR vr,
+                                uint32_t length)
+{
+    struct BindClient *bind = (struct BindClient *) client;
+
+    USED(error);
+    USED(vr);
+    USED(length);
+
+    if (bind->depth < SCHEMA_MAX_DEPTH) {
+        bind->levels[bind->depth].tag = tag;
+        bind->levels[bind->depth].index = 0;
+    }
+    bind->depth += 1;
+
+    return true;
+}
+
+
+static bool bind_sequence_end(DcmError **error,
+                              void *client,
+                              uint32_t tag,
+                              DcmVR vr,
+                              uint32_t length)
+{
+    struct BindClient *bind = (struct BindClient *) client;
+
+    USED(error);
+    USED(tag);
+    USED(vr);
+    USED(length);
+
+    bind->depth -= 1;
+
+    return true;
+}
+
+
+static bool bind_element_create(DcmError **error,
+                                void *client,
+                                uint32_t tag,
+                                DcmVR vr,
+                                char *value,
+                                uint32_t length)
+{
+    struct BindClient *bind = (struct BindClient *) client;
+    const DcmSchema *schema = bind->schema;
+
+    if (bind->depth >= SCHEMA_MAX_DEPTH) {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < schema->n_fields; i++) {
+        const struct SchemaField *field = &schema->fields[i];
+
+        if (dcm_path_match(field->path, bind->levels, bind->depth, tag)) {
+            if (!bind_field(field,
+                            vr,
+                            value,
+                            length,
+                            bind->values,
+                            bind->record)) {
+                if (field->required) {
+                    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                                  "binding values failed",
+                                  "data element '%08x' does not have %u "
+                                  "values of type %s",
+                                  tag,
+                                  field->vm,
+                                  dcm_dict_str_from_vr(field->vr));
+                    return false;
+                }
+            } else if (field->required) {
+                bind->n_required_found += 1;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static bool bind_stop(void *client,
+                      uint32_t tag,
+                      DcmVR vr,
+                      uint32_t length)
+{
+    struct BindClient *bind = (struct BindClient *) client;
+
+    USED(vr);
+    USED(length);
+
+    // top-level tags are in ascending order, so we can stop once we are
+    // past everything in the schema
+    return tag > bind->schema->last_tag ||
+           tag == TAG_PIXEL_DATA ||
+           tag == TAG_FLOAT_PIXEL_DATA ||
+           tag == TAG_DOUBLE_PIXEL_DATA;
+}
+
+
+bool dcm_filehandle_bind(DcmError **error,
+                         DcmFilehandle *filehandle,
+                         const DcmSchema *schema,
+                         void *record)
+{
+    static DcmParse parse = {
+        .dataset_end = bind_dataset_end,
+        .sequence_begin = bind_sequence_begin,
+        .sequence_end = bind_sequence_end,
+        .element_create = bind_element_create,
+        .stop = bind_stop,
+    };
+
+    struct BindClient bind = {
+        .schema = schema,
+        .record = (char *) record,
+    };
+
+    // rewind to the start of the image metadata
+    if (dcm_filehandle_get_file_meta(error, filehandle) == NULL) {
+        return false;
+    }
+
+    bind.values = DCM_MALLOC(error, MAX(schema->max_length, 1));
+    if (bind.values == NULL) {
+        return false;
+    }
+
+    bool success = dcm_parse_dataset(error,
+                                     filehandle->io,
+                                     filehandle->implicit,
+                                     filehandle->trusted,
+                                     &parse,
+                                     &bind);
+    free(bind.values);
+    if (!success) {
+        return false;
+    }
+
+    if (bind.n_required_found < schema->n_required) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "binding values failed",
+                      "%u required data elements missing",
+                      schema->n_required - bind.n_required_found);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool dcm_filehandle_parse(DcmError **error,
+                          DcmFilehandle *filehandle,
+                          const DcmParseCallbacks *callbacks,
+                          void *client)
+{
+    // rewind to the start of the image metadata
+    if (dcm_filehandle_get_file_meta(error, filehandle) == NULL) {
+        return false;
+    }
+
+    return dcm_parse_stream(error,
+                            filehandle->io,
+                            filehandle->implicit,
+                            filehandle->trusted,
+                            callbacks,
+                            client);
+}
+
+
+DcmReader *dcm_filehandle_create_reader(DcmError **error,
+                                        DcmFilehandle *filehandle)
+{
+    // rewind to the start of the image metadata
+    if (dcm_filehandle_get_file_meta(error, filehandle) == NULL) {
         return NULL;
     }
 
-    return dcm_filehandle_read_frame(error, filehandle, frame_number);
+    return dcm_reader_create(error,
+                             filehandle->io,
+                             filehandle->implicit,
+                             filehandle->trusted);
 }
 
 
@@ -1734,6 +3640,7 @@ bool dcm_filehandle_print(DcmError **error,
     if (!dcm_parse_dataset(error,
                            filehandle->io,
                            filehandle->implicit,
+                           filehandle->trusted,
                            &parse,
                            filehandle)) {
         return false;
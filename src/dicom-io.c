@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,6 +30,9 @@
 #include <io.h>
 #endif /*HAVE_IO_H*/
 #include <time.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include <dicom/dicom.h>
 #include "pdicom.h"
@@ -37,6 +41,10 @@
  */
 #define BUFFER_SIZE (4096)
 
+/* The most reads we have in flight with io_uring.
+ */
+#define URING_DEPTH (64)
+
 typedef struct _DcmIOFile {
     DcmIOMethods *methods;
 
@@ -47,6 +55,13 @@ typedef struct _DcmIOFile {
     int64_t bytes_in_buffer;
     int64_t read_point;
     int64_t offset;
+
+#ifdef HAVE_LIBURING
+    // made on the first batch read, see dcm_io_read_batch()
+    struct io_uring ring;
+    bool have_ring;
+    bool ring_failed;
+#endif
 } DcmIOFile;
 
 
@@ -54,6 +69,12 @@ static void dcm_io_close_file(DcmIO *io)
 {
     DcmIOFile *file = (DcmIOFile *) io;
 
+#ifdef HAVE_LIBURING
+    if (file->have_ring) {
+        io_uring_queue_exit(&file->ring);
+    }
+#endif
+
     if (file->fd != -1) {
         (void) close(file->fd);
     }
@@ -399,6 +420,286 @@ DcmIO *dcm_io_create_from_memory(DcmError **error,
 }
 
 
+const char *dcm_io_borrow(DcmIO *io, int64_t length)
+{
+    if (io->methods->read != dcm_io_read_memory) {
+        return NULL;
+    }
+
+    DcmIOMemory *memory = (DcmIOMemory *) io;
+    if (length < 0 || memory->length - memory->read_point < length) {
+        return NULL;
+    }
+
+    const char *data = memory->buffer + memory->read_point;
+    memory->read_point += length;
+
+    return data;
+}
+
+
+bool dcm_io_contains(const DcmIO *io, const char *data, int64_t length)
+{
+    if (io->methods->read != dcm_io_read_memory) {
+        return false;
+    }
+
+    const DcmIOMemory *memory = (const DcmIOMemory *) io;
+    uintptr_t start = (uintptr_t) memory->buffer;
+    uintptr_t address = (uintptr_t) data;
+
+    return address >= start &&
+           address - start <= (uintptr_t) memory->length &&
+           (uintptr_t) length <= (uintptr_t) memory->length - (address - start);
+}
+
+
+void dcm_io_advise(DcmIO *io, int64_t offset, int64_t length)
+{
+    if (io->methods->read != dcm_io_read_file) {
+        return;
+    }
+
+    DcmIOFile *file = (DcmIOFile *) io;
+
+    // this is only a hint, so we ignore errors
+#if defined(HAVE_POSIX_FADVISE)
+    (void) posix_fadvise(file->fd,
+                         (off_t) offset,
+                         (off_t) length,
+                         POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice;
+    advice.ra_offset = (off_t) offset;
+    advice.ra_count = length > INT_MAX || length == 0 ?
+                      INT_MAX : (int) length;
+    (void) fcntl(file->fd, F_RDADVISE, &advice);
+#else
+    USED(file);
+    USED(offset);
+    USED(length);
+#endif
+}
+
+
+// read each range with a seek and a read
+static bool read_batch_serial(DcmError **error,
+                              DcmIO *io,
+                              DcmIORead *reads,
+                              uint32_t n_reads)
+{
+    for (uint32_t i = 0; i < n_reads; i++) {
+        if (dcm_io_seek(error, io, reads[i].offset, SEEK_SET) < 0) {
+            return false;
+        }
+
+        int64_t done = 0;
+        while (done < reads[i].length) {
+            int64_t bytes_read = dcm_io_read(error,
+                                             io,
+                                             reads[i].buffer + done,
+                                             reads[i].length - done);
+            if (bytes_read < 0) {
+                return false;
+            } else if (bytes_read == 0) {
+                dcm_error_set(error, DCM_ERROR_CODE_IO,
+                              "reading batch failed",
+                              "end of file");
+                return false;
+            }
+            done += bytes_read;
+        }
+    }
+
+    return true;
+}
+
+
+#ifdef HAVE_LIBURING
+// wait for n_reads reads in flight on a ring to complete, discarding the
+// results
+static void read_batch_uring_drain(struct io_uring *ring, uint32_t n_reads)
+{
+    while (n_reads > 0) {
+        struct io_uring_cqe *cqe;
+        int result = io_uring_wait_cqe(ring, &cqe);
+        if (result == -EINTR || result == -EAGAIN) {
+            continue;
+        } else if (result < 0) {
+            // the ring can't report completions, so there's no way to
+            // know when the remaining reads finish
+            dcm_log_critical("unable to wait for %u reads - %s",
+                             n_reads, strerror(-result));
+            return;
+        }
+        io_uring_cqe_seen(ring, cqe);
+        n_reads -= 1;
+    }
+}
+
+
+/* Keep up to URING_DEPTH reads in flight, and resubmit the rest of any
+ * short read. Once a read fails we submit nothing more, but must still
+ * wait for the reads in flight, since they write to the caller's buffers.
+ */
+static bool read_batch_uring(DcmError **error,
+                             DcmIOFile *file,
+                             DcmIORead *reads,
+                             uint32_t n_reads)
+{
+    struct io_uring *ring = &file->ring;
+
+    // bytes read so far, and a FIFO of reads waiting to be submitted
+    int64_t *done = DCM_NEW_ARRAY(error, n_reads, int64_t);
+    if (done == NULL) {
+        return false;
+    }
+    uint32_t *todo = DCM_NEW_ARRAY(error, n_reads, uint32_t);
+    if (todo == NULL) {
+        free(done);
+        return false;
+    }
+    for (uint32_t i = 0; i < n_reads; i++) {
+        todo[i] = i;
+    }
+    uint32_t todo_head = 0;
+    uint32_t todo_count = n_reads;
+
+    // reads prepared but not yet taken by the kernel, and reads the kernel
+    // has taken which have not completed
+    uint32_t queued = 0;
+    uint32_t in_flight = 0;
+    uint32_t completed = 0;
+    bool failed = false;
+    while (failed ? queued + in_flight > 0 : completed < n_reads) {
+        while (!failed &&
+               todo_count > 0 &&
+               queued + in_flight < URING_DEPTH) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (sqe == NULL) {
+                break;
+            }
+
+            uint32_t i = todo[todo_head];
+            todo_head = (todo_head + 1) % n_reads;
+            todo_count -= 1;
+
+            io_uring_prep_read(sqe,
+                               file->fd,
+                               reads[i].buffer + done[i],
+                               (unsigned) MIN(reads[i].length - done[i],
+                                              0x7fffffff),
+                               (uint64_t) (reads[i].offset + done[i]));
+            io_uring_sqe_set_data(sqe, (void *) (uintptr_t) i);
+            queued += 1;
+        }
+
+        // the kernel may be busy, in which case we reap what we can and
+        // try again
+        int result = io_uring_submit_and_wait(ring, 1);
+        if (result >= 0) {
+            uint32_t submitted = MIN((uint32_t) result, queued);
+            queued -= submitted;
+            in_flight += submitted;
+        } else if (result != -EINTR &&
+                   result != -EAGAIN &&
+                   result != -EBUSY) {
+            // the ring is broken, so stop using it ... but reads already
+            // in flight write to the caller's buffers, so we must wait for
+            // them before we return
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                          "reading batch failed",
+                          "unable to read %s - %s",
+                          file->filename, strerror(-result));
+            read_batch_uring_drain(ring, in_flight);
+            io_uring_queue_exit(ring);
+            file->have_ring = false;
+            file->ring_failed = true;
+            failed = true;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(ring, &cqe) == 0) {
+            uint32_t i = (uint32_t) (uintptr_t) io_uring_cqe_get_data(cqe);
+            int bytes_read = cqe->res;
+            io_uring_cqe_seen(ring, cqe);
+            in_flight -= 1;
+
+            if (failed) {
+                continue;
+            }
+
+            if (bytes_read == -EINTR || bytes_read == -EAGAIN) {
+                bytes_read = 0;
+            } else if (bytes_read < 0) {
+                dcm_error_set(error, DCM_ERROR_CODE_IO,
+                              "reading batch failed",
+                              "unable to read %s - %s",
+                              file->filename, strerror(-bytes_read));
+                failed = true;
+                continue;
+            } else if (bytes_read == 0) {
+                dcm_error_set(error, DCM_ERROR_CODE_IO,
+                              "reading batch failed",
+                              "unable to read %s - end of file",
+                              file->filename);
+                failed = true;
+                continue;
+            }
+
+            done[i] += bytes_read;
+            if (done[i] < reads[i].length) {
+                todo[(todo_head + todo_count) % n_reads] = i;
+                todo_count += 1;
+            } else {
+                completed += 1;
+            }
+        }
+    }
+
+    free(done);
+    free(todo);
+
+    return !failed;
+}
+#endif
+
+
+bool dcm_io_read_batch(DcmError **error,
+                       DcmIO *io,
+                       DcmIORead *reads,
+                       uint32_t n_reads)
+{
+    if (n_reads == 0) {
+        return true;
+    }
+
+#ifdef HAVE_LIBURING
+    if (io->methods->read == dcm_io_read_file) {
+        DcmIOFile *file = (DcmIOFile *) io;
+
+        // io_uring can be missing or blocked at runtime, so we fall back
+        // to plain reads if we can't make a ring
+        if (!file->have_ring && !file->ring_failed) {
+            if (io_uring_queue_init(URING_DEPTH, &file->ring, 0) == 0) {
+                file->have_ring = true;
+            } else {
+                dcm_log_debug("io_uring unavailable, using read()");
+                file->ring_failed = true;
+            }
+        }
+
+        if (file->have_ring) {
+            return read_batch_uring(error, file, reads, n_reads);
+        }
+    }
+#endif
+
+    return read_batch_serial(error, io, reads, n_reads);
+}
+
+
 void dcm_io_close(DcmIO *io)
 {
     io->methods->close(io);
@@ -17,6 +17,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "utarray.h"
 
@@ -24,45 +25,89 @@
 #include "pdicom.h"
 
 
-/* The size of the buffer we use for reading smaller element values. This is
- * large enough for most VRs.
+/* The maximum number of nested sequences we allow. Real files rarely go
+ * beyond ten or so, and this stops hostile input from running us out of
+ * memory.
  */
-#define INPUT_BUFFER_SIZE (256)
+#define MAX_NESTING (64)
+
+
+/* The most blocks of private tags we track. A Data Set can reserve 240,
+ * but real files use a handful.
+ */
+#define MAX_PRIVATE_BLOCKS (64)
+
+
+/* A block of private tags reserved by a Private Creator Data Element. In
+ * implicit mode, we need the creator to find the VR of the tags.
+ */
+struct PrivateBlock {
+    // the depth of the Data Set the block belongs to
+    uint32_t depth;
+    uint32_t group;
+    uint32_t block;
+    int creator;
+};
+
+
+struct PrivateBlocks {
+    struct PrivateBlock blocks[MAX_PRIVATE_BLOCKS];
+    uint32_t n_blocks;
+};
+
+
+struct _DcmParseState;
+
+/* Decode the VR and length of an element header from the four bytes after
+ * the tag, reading any more header bytes the VR needs.
+ */
+typedef bool (*DcmDecodeHeader)(struct _DcmParseState *state,
+                                uint32_t tag,
+                                const char *raw,
+                                DcmVR *vr,
+                                uint32_t *length);
 
 
 typedef struct _DcmParseState {
     DcmError **error;
     DcmIO *io;
     bool implicit;
-    bool big_endian;
-    const DcmParse *parse;
-    void *client;
 
-    DcmDataSet *meta;
+    // the input is from a trusted source, so skip checks against the
+    // dictionary
+    bool trusted;
+
+    // picked once for the transfer syntax, see parse_state()
+    DcmDecodeHeader decode_header;
+
+    // offset of the read point in the IO object
     int64_t offset;
-    int64_t pixel_data_offset;
+
+    // the number of sequences enclosing the current element
+    uint32_t depth;
+
+    // the private blocks in scope, if we are tracking them
+    struct PrivateBlocks *private_blocks;
 } DcmParseState;
 
 
-static int64_t dcm_read(DcmParseState *state,
-    char *buffer, int64_t length, int64_t *position)
+static int64_t dcm_read(DcmParseState *state, char *buffer, int64_t length)
 {
     int64_t bytes_read = dcm_io_read(state->error, state->io, buffer, length);
     if (bytes_read < 0) {
         return bytes_read;
     }
 
-    *position += bytes_read;
+    state->offset += bytes_read;
 
     return bytes_read;
 }
 
 
-static bool dcm_require(DcmParseState *state,
-    char *buffer, int64_t length, int64_t *position)
+static bool dcm_require(DcmParseState *state, char *buffer, int64_t length)
 {
     while (length > 0) {
-        int64_t bytes_read = dcm_read(state, buffer, length, position);
+        int64_t bytes_read = dcm_read(state, buffer, length);
 
         if (bytes_read < 0) {
             return false;
@@ -81,14 +126,14 @@ static bool dcm_require(DcmParseState *state,
 }
 
 
-static bool dcm_seekcur(DcmParseState *state, int64_t offset, int64_t *position)
+static bool dcm_seekcur(DcmParseState *state, int64_t offset)
 {
     int64_t new_offset = dcm_io_seek(state->error, state->io, offset, SEEK_CUR);
     if (new_offset < 0) {
         return false;
     }
 
-    *position += offset;
+    state->offset += offset;
 
     return true;
 }
@@ -102,27 +147,22 @@ static bool dcm_is_eof(DcmParseState *state)
     int64_t bytes_read = dcm_io_read(NULL, state->io, buffer, 1);
     if (bytes_read > 0) {
         eof = false;
-        int64_t position = 0;
-        (void) dcm_seekcur(state, -1, &position);
+        (void) dcm_io_seek(NULL, state->io, -1, SEEK_CUR);
     }
 
     return eof;
 }
 
 
-/* TRUE for big-endian machines, like PPC. We need to byteswap DICOM
- * numeric types in this case. Run time tests for this are much
- * simpler to manage when cross-compiling.
+/* TRUE for big-endian hosts, like PPC. We need to byteswap DICOM numeric
+ * types in this case. Meson sets this from the host machine, so it's right
+ * for cross-compiles too, and the swaps compile away on little-endian hosts.
  */
-static bool is_big_endian(void)
-{
-    union {
-        uint32_t i;
-        char c[4];
-    } bint = {0x01020304};
-
-    return bint.c[0] == 1;
-}
+#ifdef WORDS_BIGENDIAN
+#define HOST_BIG_ENDIAN (true)
+#else
+#define HOST_BIG_ENDIAN (false)
+#endif
 
 
 #define SWAP16(V) \
@@ -188,240 +228,1313 @@ static void byteswap(char *data, size_t length, size_t size)
 }
 
 
-static bool read_uint16(DcmParseState *state,
-    uint16_t *value, int64_t *position)
+/* Decode little-endian values from the input. memcpy() avoids unaligned
+ * access, and compiles to a single load.
+ */
+static uint16_t load_uint16(const char *raw)
 {
-    union {
-        uint16_t i;
-        char c[2];
-    } buffer;
+    uint16_t value;
+
+    memcpy(&value, raw, 2);
+
+    return HOST_BIG_ENDIAN ? SWAP16(value) : value;
+}
+
+
+static uint32_t load_uint32(const char *raw)
+{
+    uint32_t value;
+
+    memcpy(&value, raw, 4);
 
-    if (!dcm_require(state, buffer.c, 2, position)) {
+    return HOST_BIG_ENDIAN ? SWAP32(value) : value;
+}
+
+
+static uint32_t load_tag(const char *raw)
+{
+    return ((uint32_t) load_uint16(raw) << 16) | load_uint16(raw + 2);
+}
+
+
+static bool read_uint32(DcmParseState *state, uint32_t *value)
+{
+    char raw[4];
+
+    if (!dcm_require(state, raw, 4)) {
         return false;
     }
+    *value = load_uint32(raw);
 
-    if (state->big_endian) {
-        byteswap(buffer.c, 2, 2);
-    }
+    return true;
+}
+
+
+static bool read_tag(DcmParseState *state, uint32_t *tag)
+{
+    char raw[4];
 
-    *value = buffer.i;
+    if (!dcm_require(state, raw, 4)) {
+        return false;
+    }
+    *tag = load_tag(raw);
 
     return true;
 }
 
 
-static bool read_uint32(DcmParseState *state,
-    uint32_t *value, int64_t *position)
+static bool is_pixeldata(uint32_t tag)
 {
-    union {
-        uint32_t i;
-        char c[4];
-    } buffer;
+    return tag == TAG_PIXEL_DATA ||
+           tag == TAG_FLOAT_PIXEL_DATA ||
+           tag == TAG_DOUBLE_PIXEL_DATA;
+}
 
-    if (!dcm_require(state, buffer.c, 4, position)) {
-        return false;
+
+static bool is_private_creator(uint32_t tag)
+{
+    uint32_t element = tag & 0xffff;
+
+    return dcm_is_private_tag(tag) && element >= 0x10 && element <= 0xff;
+}
+
+
+/* Private Creators are LO, and private tags we don't know are UN.
+ */
+static DcmVR private_vr(const DcmParseState *state, uint32_t tag)
+{
+    const struct PrivateBlocks *blocks = state->private_blocks;
+
+    if (is_private_creator(tag)) {
+        return DCM_VR_LO;
+    }
+
+    // blocks for the current Data Set are at the top
+    for (uint32_t i = blocks ? blocks->n_blocks : 0; i > 0; i--) {
+        const struct PrivateBlock *block = &blocks->blocks[i - 1];
+
+        if (block->depth != state->depth) {
+            break;
+        }
+
+        if (block->group == tag >> 16 &&
+            block->block == ((tag >> 8) & 0xff)) {
+            DcmVR vr = dcm_dict_private_vr(block->creator, tag);
+            return vr == DCM_VR_ERROR ? DCM_VR_UN : vr;
+        }
     }
 
-    if (state->big_endian) {
-        byteswap(buffer.c, 4, 4);
+    return DCM_VR_UN;
+}
+
+
+static bool decode_header_implicit(DcmParseState *state,
+                                   uint32_t tag,
+                                   const char *raw,
+                                   DcmVR *vr,
+                                   uint32_t *length)
+{
+    // this can be an ambiguous VR, eg. pixeldata is allowed in implicit
+    // mode and has to be disambiguated later from other tags
+    *vr = dcm_vr_from_tag(tag);
+    if (*vr == DCM_VR_ERROR && dcm_is_private_tag(tag)) {
+        *vr = private_vr(state, tag);
+    }
+    if (*vr == DCM_VR_ERROR) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "reading of data element header failed",
+                      "tag %08x not allowed in implicit mode", tag);
+        return false;
     }
 
-    *value = buffer.i;
+    *length = load_uint32(raw);
+
+    // an unknown tag with undefined length is a sequence
+    if (*vr == DCM_VR_UN && *length == 0xffffffff) {
+        *vr = DCM_VR_SQ;
+    }
 
     return true;
 }
 
 
-static bool read_tag(DcmParseState *state, uint32_t *tag, int64_t *position)
+static bool decode_header_explicit(DcmParseState *state,
+                                   uint32_t tag,
+                                   const char *raw,
+                                   DcmVR *vr,
+                                   uint32_t *length)
 {
-    uint16_t group, elem;
-
-    if (!read_uint16(state, &group, position) ||
-        !read_uint16(state, &elem, position)) {
+    // Value Representation
+    *vr = dcm_dict_vr_from_chars(raw);
+
+    // even trusted input must have a real VR, since it sets the header size
+    if (state->trusted ?
+        *vr == DCM_VR_ERROR : !dcm_is_valid_vr_for_tag(*vr, tag)) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "reading of data element header failed",
+                      "tag %08x cannot have VR '%c%c'", tag, raw[0], raw[1]);
         return false;
     }
 
-    *tag = ((uint32_t)group << 16) | elem;
+    if (dcm_dict_vr_header_length(*vr) == 2) {
+        // These VRs have a short length of only two bytes
+        *length = load_uint16(raw + 2);
+    } else {
+        // Other VRs have two reserved bytes before length of four bytes
+        if (load_uint16(raw + 2) != 0x0000) {
+            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                          "reading of data element header failed",
+                          "unexpected value for reserved bytes "
+                          "of data element %08x with VR '%c%c'",
+                          tag, raw[0], raw[1]);
+            return false;
+        }
+
+        if (!read_uint32(state, length)) {
+           return false;
+        }
+    }
 
     return true;
 }
 
 
-/* This is used recursively.
+/* All the supported transfer syntaxes are little-endian, so there are just
+ * two header decoders.
  */
-static bool parse_element(DcmParseState *state,
-                          int64_t *position);
+static DcmParseState parse_state(DcmError **error, DcmIO *io, bool implicit)
+{
+    return (DcmParseState) {
+        .error = error,
+        .io = io,
+        .implicit = implicit,
+        .decode_header = implicit ?
+            decode_header_implicit : decode_header_explicit,
+    };
+}
 
 
+/* Read the rest of an element header, the tag has already been read.
+ */
 static bool parse_element_header(DcmParseState *state,
-                                 uint32_t *tag,
+                                 uint32_t tag,
                                  DcmVR *vr,
-                                 uint32_t *length,
-                                 int64_t *position)
+                                 uint32_t *length)
 {
-    if (!read_tag(state, tag, position)) {
+    char raw[4];
+
+    return dcm_require(state, raw, 4) &&
+           state->decode_header(state, tag, raw, vr, length);
+}
+
+
+/* Decode an element header from the first eight bytes, the tag and four
+ * more.
+ */
+static bool parse_element_info(DcmParseState *state,
+                               const char *raw,
+                               DcmParseInfo *info)
+{
+    info->tag = load_tag(raw);
+    info->offset = state->offset - 8;
+    info->depth = state->depth;
+    info->index = 0;
+    if (!state->decode_header(state,
+                              info->tag,
+                              raw + 4,
+                              &info->vr,
+                              &info->length)) {
         return false;
     }
+    info->value_offset = state->offset;
+
+    return true;
+}
+
+
+/* Decode the header of a sequence or pixeldata item.
+ */
+static void parse_item_info(DcmParseState *state,
+                            const char *raw,
+                            const DcmParseInfo *parent,
+                            uint32_t index,
+                            DcmParseInfo *info)
+{
+    info->tag = load_tag(raw);
+    info->length = load_uint32(raw + 4);
+    info->offset = state->offset - 8;
+    info->vr = parent->vr;
+    info->value_offset = state->offset;
+    info->depth = state->depth;
+    info->index = index;
+}
+
+
+/* Check that an element has a value we can read, and get the class of the
+ * VR.
+ */
+static bool check_value(DcmParseState *state,
+                        const DcmParseInfo *info,
+                        DcmVRClass *vr_class)
+{
+    size_t size = dcm_dict_vr_size(info->vr);
 
-    if (state->implicit) {
-        // this can be an ambiguous VR, eg. pixeldata is allowed in implicit
-        // mode and has to be disambiguated later from other tags
-        *vr = dcm_vr_from_tag(*tag);
-        if (*vr == DCM_VR_ERROR) {
+    // native pixeldata is a single binary value, though in implicit mode the
+    // VR can be ambiguous
+    *vr_class = is_pixeldata(info->tag) ?
+        DCM_VR_CLASS_BINARY : dcm_dict_vr_class(info->vr);
+
+    switch (*vr_class) {
+        case DCM_VR_CLASS_NUMERIC_DECIMAL:
+        case DCM_VR_CLASS_NUMERIC_INTEGER:
+            // all numeric classes have a size
+            if (size > 0 &&
+                info->length % size != 0) {
+                dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                              "reading of data element failed",
+                              "bad length for tag '%08x'",
+                              info->tag);
+                return false;
+            }
+            return true;
+
+        case DCM_VR_CLASS_STRING_SINGLE:
+        case DCM_VR_CLASS_STRING_MULTI:
+        case DCM_VR_CLASS_BINARY:
+            return true;
+
+        default:
             dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                          "reading of data element header failed",
-                          "tag %08x not allowed in implicit mode", *tag);
+                          "reading of data element failed",
+                          "data element '%08x' has unexpected VR",
+                          info->tag);
+            return false;
+    }
+}
+
+
+/* Values are passed on in host byte order, and with any trailing whitespace
+ * character removed from strings.
+ */
+static void fix_value(const DcmParseInfo *info,
+                      DcmVRClass vr_class,
+                      char *value)
+{
+    size_t size = dcm_dict_vr_size(info->vr);
+
+    if (info->length > 0 &&
+        (vr_class == DCM_VR_CLASS_STRING_SINGLE ||
+         vr_class == DCM_VR_CLASS_STRING_MULTI) &&
+        info->vr != DCM_VR_UI &&
+        isspace(value[info->length - 1])) {
+        value[info->length - 1] = '\0';
+    }
+
+    if (HOST_BIG_ENDIAN && size > 0) {
+        byteswap(value, info->length, size);
+    }
+}
+
+
+/* In push mode, input is appended to a buffer as it arrives, and we read
+ * from that. Seeks past the end of the buffer discard input as it arrives,
+ * so they never have to wait.
+ */
+typedef struct _DcmIOFeed {
+    DcmIOMethods *methods;
+
+    // private fields
+    char *buffer;
+    int64_t size;
+    int64_t length;
+    int64_t read_point;
+
+    // the stream offset of the start of the buffer
+    int64_t offset;
+
+    // the number of bytes to discard from the next input
+    int64_t skip;
+
+    // there will be no more input
+    bool finished;
+} DcmIOFeed;
+
+
+static void dcm_io_close_feed(DcmIO *io)
+{
+    DcmIOFeed *feed = (DcmIOFeed *) io;
+
+    free(feed->buffer);
+    free(feed);
+}
+
+
+static DcmIO *dcm_io_open_feed(DcmError **error, void *client)
+{
+    USED(client);
+
+    return (DcmIO *) DCM_NEW(error, DcmIOFeed);
+}
+
+
+static int64_t dcm_io_read_feed(DcmError **error, DcmIO *io,
+    char *buffer, int64_t length)
+{
+    DcmIOFeed *feed = (DcmIOFeed *) io;
+
+    USED(error);
+
+    int64_t bytes_available = feed->length - feed->read_point;
+    int64_t bytes_to_copy = MIN(bytes_available, length);
+    memcpy(buffer,
+           feed->buffer + feed->read_point,
+           bytes_to_copy);
+    feed->read_point += bytes_to_copy;
+
+    return bytes_to_copy;
+}
+
+
+static int64_t dcm_io_seek_feed(DcmError **error, DcmIO *io,
+    int64_t offset, int whence)
+{
+    DcmIOFeed *feed = (DcmIOFeed *) io;
+
+    int64_t new_offset;
+
+    switch (whence)
+    {
+        case SEEK_SET:
+            new_offset = offset;
+            break;
+
+        case SEEK_CUR:
+            new_offset = feed->offset + feed->read_point + feed->skip + offset;
+            break;
+
+        default:
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                "unsupported whence",
+                "whence %d not implemented", whence);
+            return -1;
+    }
+
+    if (new_offset < feed->offset) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+            "seek failed",
+            "offset %lld has already been discarded",
+            (long long) new_offset);
+        return -1;
+    }
+
+    if (new_offset > feed->offset + feed->length) {
+        feed->read_point = feed->length;
+        feed->skip = new_offset - (feed->offset + feed->length);
+    } else {
+        feed->read_point = new_offset - feed->offset;
+        feed->skip = 0;
+    }
+
+    return new_offset;
+}
+
+
+static DcmIO *dcm_io_create_feed(DcmError **error)
+{
+    static DcmIOMethods methods = {
+        dcm_io_open_feed,
+        dcm_io_close_feed,
+        dcm_io_read_feed,
+        dcm_io_seek_feed,
+    };
+
+    return dcm_io_create(error, &methods, NULL);
+}
+
+
+static bool dcm_io_feed_append(DcmError **error,
+                               DcmIO *io,
+                               const char *data,
+                               int64_t length)
+{
+    DcmIOFeed *feed = (DcmIOFeed *) io;
+
+    // discard anything we have read, and anything we are seeking over
+    if (feed->read_point > 0) {
+        feed->offset += feed->read_point;
+        feed->length -= feed->read_point;
+        memmove(feed->buffer, feed->buffer + feed->read_point, feed->length);
+        feed->read_point = 0;
+    }
+
+    int64_t skip = MIN(feed->skip, length);
+    feed->offset += skip;
+    feed->skip -= skip;
+    data += skip;
+    length -= skip;
+
+    if (feed->length + length > feed->size) {
+        int64_t new_size = MAX(feed->length + length, 2 * feed->size);
+        char *buffer = dcm_realloc(error, feed->buffer, new_size);
+        if (buffer == NULL) {
+            return false;
+        }
+        feed->buffer = buffer;
+        feed->size = new_size;
+    }
+
+    if (length > 0) {
+        memcpy(feed->buffer + feed->length, data, length);
+        feed->length += length;
+    }
+
+    return true;
+}
+
+
+/* The parser is a state machine with an explicit stack of the sequences and
+ * items it is inside, so there's no recursion, and all the state is in the
+ * DcmReader. This means it can suspend when it runs out of input, and resume
+ * when more arrives.
+ */
+struct ReaderFrame {
+    DcmParseInfo info;
+
+    // offset of the end of the sequence or item, or -1 for undefined length
+    int64_t end;
+
+    // index of the next item, for sequences
+    uint32_t index;
+
+    bool is_item;
+    bool is_pixeldata;
+
+    // we've reached the end of this frame
+    bool done;
+
+    // skip the rest of this frame when it's at the top of the stack, and
+    // don't send an end event if silent
+    bool skip;
+    bool silent;
+};
+
+
+struct _DcmReader {
+    DcmParseState state;
+
+    // each sequence has a frame, plus one for the current item
+    struct ReaderFrame frames[2 * MAX_NESTING];
+    uint32_t n_frames;
+
+    // when reading a group, the group number and the offset of the end of
+    // the group, otherwise -1
+    int group;
+    int64_t group_end;
+
+    // in push mode, the input buffer
+    DcmIOFeed *feed;
+
+    // the most recent event
+    DcmReaderEvent event;
+
+    // the value of the current element or fragment has not been read yet
+    bool value_pending;
+
+    // the value has been read to the value buffer
+    bool value_read;
+
+    // the value of the current event is to be passed to a callback
+    bool value_wanted;
+
+    // we are waiting for more input
+    bool suspended;
+
+    // no more events
+    bool at_end;
+
+    // values are read to here, it grows as needed
+    char *value;
+    uint32_t value_size;
+
+    // or if the input is in memory, the value can be used in place
+    const char *borrowed;
+
+    // in implicit mode, the private blocks in scope
+    struct PrivateBlocks private_blocks;
+};
+
+
+static bool reader_init(DcmReader *reader,
+                        DcmError **error,
+                        DcmIO *io,
+                        bool implicit,
+                        bool trusted)
+{
+    *reader = (DcmReader) {
+        .state = parse_state(error, io, implicit),
+        .group = -1,
+        .group_end = -1,
+    };
+    reader->state.trusted = trusted;
+
+    if (implicit) {
+        reader->state.private_blocks = &reader->private_blocks;
+    }
+
+    // the offsets we report are from the start of the IO object
+    reader->state.offset = dcm_io_seek(error, io, 0, SEEK_CUR);
+
+    return reader->state.offset >= 0;
+}
+
+
+static void reader_clear(DcmReader *reader)
+{
+    if (reader->value) {
+        free(reader->value);
+        reader->value = NULL;
+    }
+}
+
+
+DcmReader *dcm_reader_create(DcmError **error,
+                             DcmIO *io,
+                             bool implicit,
+                             bool trusted)
+{
+    DcmReader *reader = DCM_NEW(error, DcmReader);
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    if (!reader_init(reader, error, io, implicit, trusted)) {
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+
+void dcm_reader_destroy(DcmReader *reader)
+{
+    if (reader) {
+        reader_clear(reader);
+        free(reader);
+    }
+}
+
+
+static struct ReaderFrame *reader_top(DcmReader *reader)
+{
+    return reader->n_frames > 0 ?
+        &reader->frames[reader->n_frames - 1] : NULL;
+}
+
+
+static bool reader_push(DcmReader *reader, const struct ReaderFrame *frame)
+{
+    if (reader->n_frames >= 2 * MAX_NESTING) {
+        dcm_error_set(reader->state.error, DCM_ERROR_CODE_PARSE,
+                      "reading of data element failed",
+                      "data element '%08x' is nested too deeply",
+                      frame->info.tag);
+        return false;
+    }
+
+    reader->frames[reader->n_frames++] = *frame;
+    if (!frame->is_item) {
+        reader->state.depth += 1;
+    }
+
+    return true;
+}
+
+
+static void reader_pop(DcmReader *reader)
+{
+    struct ReaderFrame *frame = reader_top(reader);
+
+    if (!frame->is_item) {
+        reader->state.depth -= 1;
+    } else {
+        // private blocks end with the Data Set that reserved them
+        struct PrivateBlocks *blocks = &reader->private_blocks;
+
+        while (blocks->n_blocks > 0 &&
+               blocks->blocks[blocks->n_blocks - 1].depth >=
+                   reader->state.depth) {
+            blocks->n_blocks -= 1;
+        }
+    }
+    reader->n_frames -= 1;
+}
+
+
+/* In push mode, true if we must wait for more input before we can read
+ * length bytes. Once input has finished, reads past the end are errors.
+ */
+static bool reader_starved(DcmReader *reader, int64_t length)
+{
+    const DcmIOFeed *feed = reader->feed;
+
+    if (feed == NULL ||
+        feed->finished ||
+        feed->length - feed->read_point >= length) {
+        return false;
+    }
+
+    reader->suspended = true;
+
+    return true;
+}
+
+
+static bool reader_skip_value(DcmReader *reader)
+{
+    if (reader->value_pending) {
+        if (!dcm_seekcur(&reader->state, reader->event.info.length)) {
+            return false;
+        }
+        reader->value_pending = false;
+    }
+
+    return true;
+}
+
+
+static bool reader_element(DcmReader *reader, const DcmParseInfo *info)
+{
+    bool is_encapsulated = is_pixeldata(info->tag) &&
+                           info->length == 0xffffffff;
+
+    reader->event.info = *info;
+
+    if (is_encapsulated ||
+        dcm_dict_vr_class(info->vr) == DCM_VR_CLASS_SEQUENCE) {
+        struct ReaderFrame frame = {
+            .info = *info,
+            .end = info->length == 0xffffffff ?
+                -1 : info->value_offset + info->length,
+            .is_pixeldata = is_encapsulated,
+        };
+
+        if (!reader_push(reader, &frame)) {
+            return false;
+        }
+        reader->event.type = DCM_READER_EVENT_SEQUENCE_BEGIN;
+    } else {
+        // only sequences can have undefined length
+        if (info->length == 0xffffffff) {
+            dcm_error_set(reader->state.error, DCM_ERROR_CODE_PARSE,
+                          "reading of data element failed",
+                          "data element '%08x' has undefined length",
+                          info->tag);
+            return false;
+        }
+
+        reader->event.type = DCM_READER_EVENT_ELEMENT;
+        reader->value_pending = true;
+    }
+
+    return true;
+}
+
+
+/* In implicit mode, note the Private Creator of a block of private tags.
+ * We peek at the value and leave it for the caller to read as usual.
+ */
+static bool reader_private_creator(DcmReader *reader,
+                                   const DcmParseInfo *info)
+{
+    DcmParseState *state = &reader->state;
+    struct PrivateBlocks *blocks = state->private_blocks;
+    char creator[DCM_CAPACITY_LO + 1];
+
+    if (blocks == NULL ||
+        !is_private_creator(info->tag) ||
+        info->length > DCM_CAPACITY_LO ||
+        blocks->n_blocks >= MAX_PRIVATE_BLOCKS ||
+        !dcm_dict_has_private()) {
+        return true;
+    }
+
+    // in push mode, wait for the whole value, then read the header again
+    if (reader_starved(reader, info->length)) {
+        return dcm_seekcur(state, -8);
+    }
+
+    if (!dcm_require(state, creator, info->length) ||
+        !dcm_seekcur(state, -(int64_t) info->length)) {
+        return false;
+    }
+
+    // LO is padded with a space, some writers pad with null
+    uint32_t length = info->length;
+    while (length > 0 &&
+           (creator[length - 1] == ' ' || creator[length - 1] == '\0')) {
+        length -= 1;
+    }
+    creator[length] = '\0';
+
+    int index = dcm_dict_private_creator(creator);
+    if (index >= 0) {
+        blocks->blocks[blocks->n_blocks++] = (struct PrivateBlock) {
+            .depth = state->depth,
+            .group = info->tag >> 16,
+            .block = info->tag & 0xff,
+            .creator = index,
+        };
+    }
+
+    return true;
+}
+
+
+/* Read the next header, and either set an event, or mark the top frame as
+ * done.
+ */
+static bool reader_advance(DcmReader *reader, bool *have_event)
+{
+    DcmParseState *state = &reader->state;
+    struct ReaderFrame *frame = reader_top(reader);
+    DcmParseInfo info;
+
+    *have_event = false;
+
+    if (frame == NULL) {
+        // the top-level dataset ends at end of file, or at trailing padding
+        if ((reader->group_end >= 0 && state->offset >= reader->group_end) ||
+            dcm_is_eof(state)) {
+            dcm_log_info("stop reading Data Set -- reached end of filehandle");
+            reader->at_end = true;
+            return true;
+        }
+    } else if (frame->end >= 0 && state->offset >= frame->end) {
+        frame->done = true;
+        return true;
+    }
+
+    // every header starts with a tag and four more bytes, so we read them
+    // in one go
+    char raw[8];
+    if (!dcm_require(state, raw, 8)) {
+        return false;
+    }
+    uint32_t tag = load_tag(raw);
+
+    if (frame == NULL) {
+        // stop if we read the first tag of the group beyond
+        if (reader->group >= 0 && (int) (tag >> 16) != reader->group) {
+            // seek back to the start of this element
+            if (!dcm_seekcur(state, -8)) {
+                return false;
+            }
+            reader->at_end = true;
+            return true;
+        }
+
+        if (tag == TAG_TRAILING_PADDING) {
+            dcm_log_info("Stop reading Data Set",
+                         "Encountered Data Set Trailing Tag");
+            reader->at_end = true;
+            return true;
+        }
+
+        if (!parse_element_info(state, raw, &info) ||
+            !reader_private_creator(reader, &info)) {
+            return false;
+        }
+        if (reader->suspended) {
+            return true;
+        }
+        *have_event = true;
+
+        return reader_element(reader, &info);
+    }
+
+    if (frame->is_item) {
+        if (tag == TAG_ITEM_DELIM) {
+            dcm_log_debug("stop reading Item #%d -- "
+                          "encountered Item Delimination Tag",
+                          frame->info.index);
+            frame->done = true;
+            return true;
+        }
+
+        if (!parse_element_info(state, raw, &info) ||
+            !reader_private_creator(reader, &info)) {
+            return false;
+        }
+        if (reader->suspended) {
+            return true;
+        }
+        *have_event = true;
+
+        return reader_element(reader, &info);
+    }
+
+    // we are in a sequence, or in encapsulated pixeldata
+    dcm_log_debug("read Item #%d", frame->index);
+    parse_item_info(state, raw, &frame->info, frame->index, &info);
+
+    if (info.tag == TAG_SQ_DELIM) {
+        dcm_log_debug("stop reading data element -- "
+                      "encountered SequenceDelimination Tag");
+        frame->done = true;
+        return true;
+    }
+
+    if (info.tag != TAG_ITEM) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "reading of data element failed",
+                      "expected tag '%08x' instead of '%08x' "
+                      "for item #%d",
+                      TAG_ITEM,
+                      info.tag,
+                      frame->index);
+        return false;
+    }
+    frame->index += 1;
+
+    *have_event = true;
+    reader->event.info = info;
+    if (frame->is_pixeldata) {
+        reader->event.type = DCM_READER_EVENT_FRAGMENT;
+        reader->value_pending = true;
+    } else {
+        struct ReaderFrame item = {
+            .info = info,
+            .end = info.length == 0xffffffff ?
+                -1 : info.value_offset + info.length,
+            .is_item = true,
+        };
+
+        if (!reader_push(reader, &item)) {
             return false;
         }
+        reader->event.type = DCM_READER_EVENT_ITEM_BEGIN;
+    }
+
+    return true;
+}
+
+
+/* Get the next event. In push mode, this can suspend, see reader_starved().
+ */
+static bool reader_step(DcmReader *reader)
+{
+    reader->value_read = false;
+    reader->borrowed = NULL;
+    reader->suspended = false;
+
+    for (;;) {
+        struct ReaderFrame *frame;
+        bool have_event;
+
+        // step over any value that was not read
+        if (!reader_skip_value(reader)) {
+            return false;
+        }
+
+        if (reader->at_end) {
+            reader->event.type = DCM_READER_EVENT_END;
+            return true;
+        }
+
+        frame = reader_top(reader);
+        if (frame != NULL && frame->done) {
+            bool silent = frame->silent;
+
+            reader->event.type = frame->is_item ?
+                DCM_READER_EVENT_ITEM_END : DCM_READER_EVENT_SEQUENCE_END;
+            reader->event.info = frame->info;
+            reader_pop(reader);
+            if (silent) {
+                continue;
+            }
+
+            return true;
+        }
+
+        // a frame we are skipping with a defined length is a single seek
+        if (frame != NULL && frame->skip && frame->end >= 0) {
+            if (!dcm_seekcur(&reader->state,
+                             frame->end - reader->state.offset)) {
+                return false;
+            }
+            frame->done = true;
+            continue;
+        }
+
+        // wait until we have the largest header we might need
+        if (reader_starved(reader, 12)) {
+            return true;
+        }
+
+        if (!reader_advance(reader, &have_event)) {
+            return false;
+        }
+        if (reader->suspended) {
+            return true;
+        }
+
+        if (have_event && frame != NULL && frame->skip) {
+            // anything inside a frame we are skipping is skipped too
+            struct ReaderFrame *top = reader_top(reader);
+            if (top != frame) {
+                top->skip = true;
+                top->silent = true;
+            }
+        } else if (have_event) {
+            return true;
+        }
+    }
+}
+
+
+/* If the input is in memory, and the value needs no fixing, use it in
+ * place. Numeric values must be aligned for their type.
+ */
+static bool reader_borrow_value(DcmReader *reader, DcmVRClass vr_class)
+{
+    DcmParseState *state = &reader->state;
+    const DcmParseInfo *info = &reader->event.info;
+    size_t size = dcm_dict_vr_size(info->vr);
+    bool is_numeric = vr_class == DCM_VR_CLASS_NUMERIC_DECIMAL ||
+                      vr_class == DCM_VR_CLASS_NUMERIC_INTEGER;
+
+    if ((vr_class != DCM_VR_CLASS_BINARY && !is_numeric) ||
+        (HOST_BIG_ENDIAN && size > 1)) {
+        return false;
+    }
+
+    const char *value = dcm_io_borrow(state->io, info->length);
+    if (value == NULL) {
+        return false;
+    }
+
+    if (is_numeric && size > 0 && (uintptr_t) value % size != 0) {
+        // give it back and read a copy instead ... seeks in memory can't
+        // fail
+        (void) dcm_io_seek(NULL, state->io, -(int64_t) info->length, SEEK_CUR);
+        return false;
+    }
+
+    state->offset += info->length;
+    reader->borrowed = value;
+
+    return true;
+}
+
+
+/* Read the value for the current event to the value buffer.
+ */
+static const char *reader_get_value(DcmReader *reader)
+{
+    DcmParseState *state = &reader->state;
+    const DcmParseInfo *info = &reader->event.info;
+    DcmVRClass vr_class = DCM_VR_CLASS_BINARY;
+
+    if (reader->value_read) {
+        return reader->borrowed ? reader->borrowed : reader->value;
+    }
+
+    if (!reader->value_pending) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_INVALID,
+                      "reading value failed",
+                      "the current event has no value");
+        return NULL;
+    }
+
+    if (reader->event.type == DCM_READER_EVENT_ELEMENT &&
+        !check_value(state, info, &vr_class)) {
+        return NULL;
+    }
+
+    if (reader_borrow_value(reader, vr_class)) {
+        reader->value_pending = false;
+        reader->value_read = true;
+
+        return reader->borrowed;
+    }
+
+    if (reader->value == NULL ||
+        reader->value_size < (uint64_t) info->length + 1) {
+        char *value = dcm_realloc(state->error,
+                                  reader->value,
+                                  (uint64_t) info->length + 1);
+        if (value == NULL) {
+            return NULL;
+        }
+        reader->value = value;
+        reader->value_size = info->length + 1;
+    }
+
+    if (!dcm_require(state, reader->value, info->length)) {
+        return NULL;
+    }
+    reader->value[info->length] = '\0';
+    reader->value_pending = false;
+    reader->value_read = true;
+
+    // encapsulated pixeldata is passed on untouched
+    if (reader->event.type == DCM_READER_EVENT_ELEMENT) {
+        fix_value(info, vr_class, reader->value);
+    }
+
+    return reader->value;
+}
+
+
+/* Skips are recorded in the frame stack and done by the next step, so they
+ * never read input themselves.
+ */
+static void reader_skip_body(DcmReader *reader)
+{
+    if (reader->event.type == DCM_READER_EVENT_SEQUENCE_BEGIN) {
+        struct ReaderFrame *frame = reader_top(reader);
+
+        frame->skip = true;
+        frame->silent = true;
+    }
+
+    // unread values are skipped by the next step
+}
+
+
+static void reader_skip_item(DcmReader *reader)
+{
+    // skip everything inside the innermost item with no events
+    uint32_t n = reader->n_frames;
+    while (n > 0 && !reader->frames[n - 1].is_item) {
+        reader->frames[n - 1].skip = true;
+        reader->frames[n - 1].silent = true;
+        n -= 1;
+    }
+
+    if (n == 0) {
+        // the top-level dataset, so skip to the end
+        reader->at_end = true;
+    } else {
+        reader->frames[n - 1].skip = true;
+    }
+}
+
+
+/* Skip the rest of the sequence enclosing the current event. If we are in an
+ * item, we finish that first, so it gets an end event.
+ */
+static void reader_skip_sequence(DcmReader *reader)
+{
+    uint32_t n = reader->n_frames;
+
+    // a sequence we've just started is skipped with its parent
+    if (reader->event.type == DCM_READER_EVENT_SEQUENCE_BEGIN) {
+        reader_skip_body(reader);
+        n -= 1;
+    }
+
+    if (n == 0) {
+        // no enclosing sequence, so that's the end of the parse
+        reader->at_end = true;
+        return;
+    }
+
+    if (reader->frames[n - 1].is_item) {
+        reader->frames[n - 1].skip = true;
+        n -= 1;
+    }
+    reader->frames[n - 1].skip = true;
+}
+
+
+bool dcm_reader_next(DcmError **error,
+                     DcmReader *reader,
+                     DcmReaderEvent *event)
+{
+    reader->state.error = error;
+
+    if (!reader_step(reader)) {
+        return false;
+    }
+
+    *event = reader->event;
+
+    return true;
+}
+
+
+const char *dcm_reader_get_value(DcmError **error, DcmReader *reader)
+{
+    reader->state.error = error;
 
-        if (!read_uint32(state, length, position)) {
-            return false;
-        }
-    } else {
-        // Value Representation
-        char vr_str[3];
-        if (!dcm_require(state, vr_str, 2, position)) {
-            return false;
-        }
-        vr_str[2] = '\0';
-        *vr = dcm_dict_vr_from_str(vr_str);
+    return reader_get_value(reader);
+}
 
-        if (!dcm_is_valid_vr_for_tag(*vr, *tag)) {
-            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                          "reading of data element header failed",
-                          "tag %08x cannot have VR '%s'", *tag, vr_str);
-            return false;
-        }
 
-        if (dcm_dict_vr_header_length(*vr) == 2) {
-            // These VRs have a short length of only two bytes
-            uint16_t short_length;
-            if (!read_uint16(state, &short_length, position)) {
-                return false;
-            }
-            *length = (uint32_t) short_length;
-        } else {
-            // Other VRs have two reserved bytes before length of four bytes
-            uint16_t reserved;
-            if (!read_uint16(state, &reserved, position) ||
-                !read_uint32(state, length, position)) {
-               return false;
-            }
+bool dcm_reader_skip_body(DcmError **error, DcmReader *reader)
+{
+    USED(error);
 
-            if (reserved != 0x0000) {
-                dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                              "reading of data element header failed",
-                              "unexpected value for reserved bytes "
-                              "of data element %08x with VR '%s'",
-                              tag, vr);
-                return false;
-            }
-        }
+    if (reader->event.type == DCM_READER_EVENT_ITEM_BEGIN) {
+        reader_skip_item(reader);
+    } else {
+        reader_skip_body(reader);
     }
 
     return true;
 }
 
 
-static bool parse_element_sequence(DcmParseState *state,
-                                   uint32_t seq_tag,
-                                   DcmVR seq_vr,
-                                   uint32_t seq_length,
-                                   int64_t *position)
+bool dcm_reader_skip_item(DcmError **error, DcmReader *reader)
 {
-    if (state->parse->sequence_begin &&
-        !state->parse->sequence_begin(state->error,
-                                      state->client,
-                                      seq_tag,
-                                      seq_vr,
-                                      seq_length)) {
-        return false;
-    }
+    USED(error);
 
-    int index = 0;
-    while (*position < seq_length) {
-        dcm_log_debug("read Item #%d", index);
-        uint32_t item_tag;
-        uint32_t item_length;
-        if (!read_tag(state, &item_tag, position) ||
-            !read_uint32(state, &item_length, position)) {
-            return false;
-        }
+    reader_skip_item(reader);
 
-        if (item_tag == TAG_SQ_DELIM) {
-            dcm_log_debug("stop reading data element -- "
-                          "encountered SequenceDelimination tag");
-            break;
-        }
+    return true;
+}
 
-        if (item_tag != TAG_ITEM) {
-            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                          "reading of data element failed",
-                          "expected tag '%08x' instead of '%08x' "
-                          "for item #%d",
-                          TAG_ITEM,
-                          item_tag,
-                          index);
-            return false;
-        }
 
-        if (item_length == 0xFFFFFFFF) {
-            dcm_log_debug("item #%d has undefined length", index);
-        } else {
-            dcm_log_debug("item #%d has defined length %d",
-                          index, item_length);
-        }
+/* Run the state machine, calling callbacks for each event. In push mode,
+ * this returns early with reader->suspended set when it needs more input,
+ * and picks up where it left off on the next call.
+ */
+static bool parse_events(DcmReader *reader,
+                         const DcmParseCallbacks *callbacks,
+                         void *client)
+{
+    DcmParseState *state = &reader->state;
 
-        if (state->parse->dataset_begin &&
-            !state->parse->dataset_begin(state->error, state->client)) {
-            return false;
-        }
+    for (;;) {
+        const DcmReaderEvent *event = &reader->event;
+        const DcmParseInfo *info = &event->info;
+        DcmParseControl control = DCM_PARSE_CONTINUE;
+        const char *value;
 
-        int64_t item_position = 0;
-        while (item_position < item_length) {
-            // peek the next tag
-            if (!read_tag(state, &item_tag, &item_position)) {
+        if (!reader->value_wanted) {
+            if (!reader_step(reader)) {
                 return false;
             }
+            if (reader->suspended) {
+                return true;
+            }
 
-            if (item_tag == TAG_ITEM_DELIM) {
-                dcm_log_debug("stop reading Item #%d -- "
-                              "encountered Item Delimination Tag",
-                              index);
-                // step over the tag length
-                if (!dcm_seekcur(state, 4, &item_position)) {
-                    return false;
-                }
+            switch (event->type) {
+                case DCM_READER_EVENT_END:
+                    return true;
+
+                case DCM_READER_EVENT_ELEMENT:
+                case DCM_READER_EVENT_SEQUENCE_BEGIN:
+                    if (callbacks->element_begin) {
+                        control = callbacks->element_begin(state->error,
+                                                           client,
+                                                           info);
+                    }
+
+                    if (control == DCM_PARSE_STOP) {
+                        reader->at_end = true;
+                        // seek back to the start of this element, there's
+                        // no read point to leave in push mode
+                        return reader->feed != NULL ||
+                            dcm_seekcur(state, info->offset - state->offset);
+                    } else if (control == DCM_PARSE_SKIP_BODY ||
+                               control == DCM_PARSE_SKIP_SEQUENCE) {
+                        reader_skip_body(reader);
+                    } else if (control == DCM_PARSE_CONTINUE &&
+                               event->type == DCM_READER_EVENT_ELEMENT &&
+                               callbacks->element_value) {
+                        reader->value_wanted = true;
+                    }
+                    break;
+
+                case DCM_READER_EVENT_FRAGMENT:
+                    reader->value_wanted = callbacks->item_value != NULL;
+                    break;
+
+                case DCM_READER_EVENT_ITEM_BEGIN:
+                    if (callbacks->item_begin) {
+                        control = callbacks->item_begin(state->error,
+                                                        client,
+                                                        info);
+                    }
+                    if (control == DCM_PARSE_SKIP_BODY) {
+                        reader_skip_item(reader);
+                    }
+                    break;
+
+                case DCM_READER_EVENT_ITEM_END:
+                    if (callbacks->item_end) {
+                        control = callbacks->item_end(state->error,
+                                                      client,
+                                                      info);
+                    }
+                    break;
+
+                case DCM_READER_EVENT_SEQUENCE_END:
+                    if (callbacks->element_end) {
+                        control = callbacks->element_end(state->error,
+                                                         client,
+                                                         info);
+                    }
+                    break;
+            }
+        }
 
-                break;
+        if (reader->value_wanted) {
+            if (reader_starved(reader, info->length)) {
+                return true;
             }
 
-            // back to start of element
-            if (!dcm_seekcur(state, -4, &item_position)) {
+            dcm_log_debug("Read Data Element body '%08x'", info->tag);
+            if (!(value = reader_get_value(reader))) {
                 return false;
             }
+            reader->value_wanted = false;
 
-            if (!parse_element(state, &item_position)) {
-                return false;
+            if (event->type == DCM_READER_EVENT_ELEMENT) {
+                control = callbacks->element_value(state->error,
+                                                   client,
+                                                   info,
+                                                   value);
+            } else {
+                control = callbacks->item_value(state->error,
+                                                client,
+                                                info,
+                                                value);
             }
         }
 
-        *position += item_position;
+        switch (control) {
+            case DCM_PARSE_CONTINUE:
+            case DCM_PARSE_SKIP_BODY:
+                break;
 
-        if (state->parse->dataset_end &&
-            !state->parse->dataset_end(state->error, state->client)) {
-            return false;
-        }
+            case DCM_PARSE_SKIP_SEQUENCE:
+                reader_skip_sequence(reader);
+                break;
+
+            case DCM_PARSE_STOP:
+                reader->at_end = true;
+                return true;
 
-        index += 1;
+            default:
+                return false;
+        }
     }
+}
 
-    if (state->parse->sequence_end &&
-        !state->parse->sequence_end(state->error,
-                                    state->client,
-                                    seq_tag,
-                                    seq_vr,
-                                    seq_length)) {
+
+static bool check_callbacks(DcmError **error,
+                            const DcmParseCallbacks *callbacks)
+{
+    if (callbacks->version != DCM_PARSE_VERSION) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "parsing failed",
+                      "callbacks are version %u, but this is version %u",
+                      callbacks->version,
+                      DCM_PARSE_VERSION);
         return false;
     }
 
@@ -429,355 +1542,422 @@ static bool parse_element_sequence(DcmParseState *state,
 }
 
 
-static bool parse_pixeldata_item(DcmParseState *state,
-                                 uint32_t tag,
-                                 DcmVR vr,
-                                 uint32_t length,
-                                 uint32_t item_length,
-                                 int64_t *position)
+bool dcm_parse_stream(DcmError **error,
+                      DcmIO *io,
+                      bool implicit,
+                      bool trusted,
+                      const DcmParseCallbacks *callbacks,
+                      void *client)
 {
-    // a read buffer on the stack for small objects
-    char input_buffer[INPUT_BUFFER_SIZE];
-    char *value;
-    char *value_free = NULL;
+    DcmReader reader;
 
-    USED(tag);
+    if (!check_callbacks(error, callbacks) ||
+        !reader_init(&reader, error, io, implicit, trusted)) {
+        return false;
+    }
 
-    // read to our stack buffer, if possible
-    if (item_length > INPUT_BUFFER_SIZE) {
-        value = value_free = DCM_MALLOC(state->error, item_length);
-        if (value_free == NULL) {
-            return false;
-        }
-    } else {
-        value = input_buffer;
+    bool success = parse_events(&reader, callbacks, client);
+
+    reader_clear(&reader);
+
+    return success;
+}
+
+
+struct _DcmParser {
+    DcmReader reader;
+    DcmIO *io;
+    const DcmParseCallbacks *callbacks;
+    void *client;
+};
+
+
+DcmParser *dcm_parser_create(DcmError **error,
+                             const char *transfer_syntax_uid,
+                             const DcmParseCallbacks *callbacks,
+                             void *client)
+{
+    if (!check_callbacks(error, callbacks)) {
+        return NULL;
     }
 
-    if (!dcm_require(state, value, item_length, position)) {
-        if (value_free != NULL) {
-            free(value_free);
-        }
-        return false;
+    // we can only parse the little endian encodings ... the encapsulated
+    // syntaxes are all Explicit VR Little Endian
+    bool implicit = transfer_syntax_uid != NULL &&
+        strcmp(transfer_syntax_uid, "1.2.840.10008.1.2") == 0;
+    if (transfer_syntax_uid != NULL &&
+        !implicit &&
+        strcmp(transfer_syntax_uid, "1.2.840.10008.1.2.1") != 0 &&
+        !dcm_is_encapsulated_transfer_syntax(transfer_syntax_uid)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "creating parser failed",
+                      "transfer syntax '%s' is not supported",
+                      transfer_syntax_uid);
+        return NULL;
     }
 
-    // native (not encapsulated) pixeldata is always little-endian and needs
-    // byteswapping on big-endian machines
-    if (length != 0xffffffff &&
-        state->big_endian) {
-        byteswap(value, item_length, dcm_dict_vr_size(vr));
+    DcmParser *parser = DCM_NEW(error, DcmParser);
+    if (parser == NULL) {
+        return NULL;
     }
 
-    if (state->parse->pixeldata_create &&
-        !state->parse->pixeldata_create(state->error,
-                                        state->client,
-                                        tag,
-                                        vr,
-                                        value,
-                                        item_length)) {
-        if (value_free != NULL) {
-            free(value_free);
-        }
-        return false;
+    parser->io = dcm_io_create_feed(error);
+    if (parser->io == NULL) {
+        free(parser);
+        return NULL;
     }
 
-    if (value_free != NULL) {
-        free(value_free);
+    if (!reader_init(&parser->reader, error, parser->io, implicit, false)) {
+        dcm_parser_destroy(parser);
+        return NULL;
     }
+    parser->reader.feed = (DcmIOFeed *) parser->io;
+    parser->callbacks = callbacks;
+    parser->client = client;
 
-    return true;
+    return parser;
+}
+
+
+void dcm_parser_set_trusted(DcmParser *parser, bool trusted)
+{
+    parser->reader.state.trusted = trusted;
 }
 
 
-static bool parse_pixeldata(DcmParseState *state,
-                            uint32_t tag,
-                            DcmVR vr,
-                            uint32_t length,
-                            int64_t *position)
+bool dcm_parser_feed(DcmError **error,
+                     DcmParser *parser,
+                     const char *chunk,
+                     size_t length)
 {
-    if (state->parse->pixeldata_begin &&
-        !state->parse->pixeldata_begin(state->error,
-                                       state->client,
-                                       tag,
-                                       vr,
-                                       length)) {
+    DcmReader *reader = &parser->reader;
+
+    if (reader->feed->finished) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "feeding parser failed",
+                      "input has already finished");
         return false;
     }
 
-    if (length == 0xffffffff) {
-        // a sequence of encapsulated pixeldata items
-        for (int index = 0; true; index++) {
-            uint32_t item_tag;
-            uint32_t item_length;
+    // once a callback has stopped the parse, or the Data Set has ended,
+    // there's nothing left to do with input, so don't keep it
+    if (reader->at_end) {
+        return true;
+    }
 
-            dcm_log_debug("read Item #%d", index);
-            if (!read_tag(state, &item_tag, position) ||
-                !read_uint32(state, &item_length, position)) {
-                return false;
-            }
+    reader->state.error = error;
 
-            if (item_tag == TAG_SQ_DELIM) {
-                dcm_log_debug("stop reading data element -- "
-                              "encountered SequenceDelimination Tag");
-                break;
-            }
+    return dcm_io_feed_append(error, parser->io, chunk, length) &&
+           parse_events(reader, parser->callbacks, parser->client);
+}
 
-            if (item_tag != TAG_ITEM) {
-                dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                              "reading of data element failed",
-                              "expected tag '%08x' instead of '%08x' "
-                              "for Item #%d",
-                              TAG_ITEM,
-                              item_tag,
-                              index);
-                return false;
-            }
 
-            if (!parse_pixeldata_item(state,
-                                      tag,
-                                      vr,
-                                      length,
-                                      item_length,
-                                      position)) {
-                return false;
-            }
-        }
-    } else {
-        // a single native pixeldata item
-        if (!parse_pixeldata_item(state, tag, vr, length, length, position)) {
-            return false;
-        }
-    }
+bool dcm_parser_finish(DcmError **error, DcmParser *parser)
+{
+    DcmReader *reader = &parser->reader;
 
-    if (state->parse->pixeldata_end &&
-        !state->parse->pixeldata_end(state->error,
-                                     state->client)) {
-        return false;
-    }
+    reader->feed->finished = true;
+    reader->state.error = error;
 
-    return true;
+    // with no more input to come, we run to the end of the dataset, or fail
+    return parse_events(reader, parser->callbacks, parser->client);
 }
 
 
-static bool parse_element_body(DcmParseState *state,
-                               uint32_t tag,
-                               DcmVR vr,
-                               uint32_t length,
-                               int64_t *position)
+void dcm_parser_destroy(DcmParser *parser)
 {
-    DcmVRClass vr_class = dcm_dict_vr_class(vr);
-    size_t size = dcm_dict_vr_size(vr);
-    char *value;
+    if (parser) {
+        reader_clear(&parser->reader);
+        if (parser->io) {
+            dcm_io_close(parser->io);
+        }
+        free(parser);
+    }
+}
 
-    char *value_free = NULL;
-    char input_buffer[INPUT_BUFFER_SIZE];
 
-    /* We treat pixeldata as a special case so we can handle encapsulated
-     * image sequences.
-     */
-    if (tag == TAG_PIXEL_DATA ||
-        tag == TAG_FLOAT_PIXEL_DATA ||
-        tag == TAG_DOUBLE_PIXEL_DATA) {
-        return parse_pixeldata(state, tag, vr, length, position);
-    }
+/* The internal DcmParse interface is implemented on top of the streaming
+ * parser. We map sequence items to datasets, and pixeldata to the
+ * pixeldata callbacks.
+ */
+struct ParseAdapter {
+    const DcmParse *parse;
+    void *client;
 
-    dcm_log_debug("Read Data Element body '%08x'", tag);
+    // the pixeldata callbacks get the tag of the enclosing element
+    uint32_t pixeldata_tag;
+};
 
-    switch (vr_class) {
-        case DCM_VR_CLASS_STRING_SINGLE:
-        case DCM_VR_CLASS_STRING_MULTI:
-        case DCM_VR_CLASS_NUMERIC_DECIMAL:
-        case DCM_VR_CLASS_NUMERIC_INTEGER:
-        case DCM_VR_CLASS_BINARY:
-            if (vr_class == DCM_VR_CLASS_NUMERIC_DECIMAL ||
-                vr_class == DCM_VR_CLASS_NUMERIC_INTEGER) {
-                // all numeric classes have a size
-                if (size > 0 &&
-                    length % size != 0) {
-                    dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                                  "reading of data element failed",
-                                  "bad length for tag '%08x'",
-                                  tag);
-                    return false;
-                }
-            }
 
-            // read to a static char buffer, if possible
-            if ((int64_t) length + 1 >= INPUT_BUFFER_SIZE) {
-                value = value_free = DCM_MALLOC(state->error,
-                                                (size_t) length + 1);
-                if (value == NULL) {
-                    return false;
-                }
-            } else {
-                value = input_buffer;
-            }
+// true if any callback can see the contents of a sequence
+static bool adapter_wants_sequence(const DcmParse *parse)
+{
+    return parse->dataset_begin ||
+           parse->dataset_end ||
+           parse->sequence_begin ||
+           parse->sequence_end ||
+           parse->pixeldata_begin ||
+           parse->pixeldata_end ||
+           parse->element_create ||
+           parse->pixeldata_create;
+}
 
-            if (!dcm_require(state, value, length, position)) {
-                if (value_free != NULL) {
-                    free(value_free);
-                }
-                return false;
-            }
-            value[length] = '\0';
-
-            if (length > 0 &&
-                (vr_class == DCM_VR_CLASS_STRING_SINGLE ||
-                 vr_class == DCM_VR_CLASS_STRING_MULTI) &&
-                vr != DCM_VR_UI &&
-                isspace(value[length - 1])) {
-                value[length - 1] = '\0';
-            }
 
-            if (size > 0 && state->big_endian) {
-                byteswap(value, length, size);
-            }
+static bool adapter_wants_pixeldata(const DcmParse *parse)
+{
+    return parse->pixeldata_begin ||
+           parse->pixeldata_end ||
+           parse->pixeldata_create;
+}
 
-            if (state->parse->element_create &&
-                !state->parse->element_create(state->error,
-                                              state->client,
-                                              tag,
-                                              vr,
-                                              value,
-                                              length)) {
-                if (value_free != NULL) {
-                    free(value_free);
-                }
-                return false;
-            }
 
-            if (value_free != NULL) {
-                free(value_free);
-            }
+/* Binary values can be left in the input if they need no byte swapping to
+ * be used.
+ */
+static bool adapter_can_defer(const DcmParseInfo *info)
+{
+    return dcm_dict_vr_class(info->vr) == DCM_VR_CLASS_BINARY &&
+           info->length != 0xffffffff &&
+           !(HOST_BIG_ENDIAN && dcm_dict_vr_size(info->vr) > 1);
+}
 
-            break;
 
-        case DCM_VR_CLASS_SEQUENCE:
-            if (length == 0xFFFFFFFF) {
-                dcm_log_debug("Sequence of Data Element '%08x' "
-                              "has undefined length",
-                              tag);
-            } else {
-                dcm_log_debug("Sequence of Data Element '%08x' "
-                              "has defined length %d",
-                              tag, length);
-            }
+static DcmParseControl adapter_element_begin(DcmError **error,
+                                             void *client,
+                                             const DcmParseInfo *info)
+{
+    struct ParseAdapter *adapter = (struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
 
-            int64_t seq_position = 0;
-            if (!parse_element_sequence(state,
-                                        tag,
-                                        vr,
-                                        length,
-                                        &seq_position)) {
-                return false;
+    if (info->depth == 0 &&
+        parse->stop &&
+        parse->stop(adapter->client, info->tag, info->vr, info->length)) {
+        return DCM_PARSE_STOP;
+    }
+
+    if (is_pixeldata(info->tag)) {
+        if (!adapter_wants_pixeldata(parse)) {
+            return DCM_PARSE_SKIP_BODY;
+        }
+        adapter->pixeldata_tag = info->tag;
+        if (parse->pixeldata_begin &&
+            !parse->pixeldata_begin(error,
+                                    adapter->client,
+                                    info->tag,
+                                    info->vr,
+                                    info->length)) {
+            return DCM_PARSE_ERROR;
+        }
+    } else if (dcm_dict_vr_class(info->vr) == DCM_VR_CLASS_SEQUENCE) {
+        if (!adapter_wants_sequence(parse)) {
+            return DCM_PARSE_SKIP_BODY;
+        }
+        if (info->depth == 0 &&
+            parse->defer &&
+            parse->sequence_defer &&
+            parse->defer(adapter->client,
+                         info->tag,
+                         info->vr,
+                         info->length)) {
+            if (!parse->sequence_defer(error,
+                                       adapter->client,
+                                       info->tag,
+                                       info->vr,
+                                       info->offset,
+                                       info->length)) {
+                return DCM_PARSE_ERROR;
             }
-            *position += seq_position;
+            return DCM_PARSE_SKIP_BODY;
+        }
+        if (parse->sequence_begin &&
+            !parse->sequence_begin(error,
+                                   adapter->client,
+                                   info->tag,
+                                   info->vr,
+                                   info->length)) {
+            return DCM_PARSE_ERROR;
+        }
+    } else if (!parse->element_create) {
+        return DCM_PARSE_SKIP_BODY;
+    } else if (adapter_can_defer(info) &&
+               parse->defer &&
+               parse->element_defer &&
+               parse->defer(adapter->client,
+                            info->tag,
+                            info->vr,
+                            info->length)) {
+        if (!parse->element_defer(error,
+                                  adapter->client,
+                                  info->tag,
+                                  info->vr,
+                                  info->value_offset,
+                                  info->length)) {
+            return DCM_PARSE_ERROR;
+        }
+        return DCM_PARSE_SKIP_BODY;
+    }
 
-            break;
+    return DCM_PARSE_CONTINUE;
+}
 
-        default:
-            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
-                          "reading of data element failed",
-                          "data element '%08x' has unexpected VR", tag);
-            return false;
+
+static DcmParseControl adapter_element_value(DcmError **error,
+                                             void *client,
+                                             const DcmParseInfo *info,
+                                             const char *value)
+{
+    const struct ParseAdapter *adapter = (const struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
+
+    if (is_pixeldata(info->tag)) {
+        // native pixeldata is a single item
+        if ((parse->pixeldata_create &&
+             !parse->pixeldata_create(error,
+                                      adapter->client,
+                                      info->tag,
+                                      info->vr,
+                                      (char *) value,
+                                      info->length)) ||
+            (parse->pixeldata_end &&
+             !parse->pixeldata_end(error, adapter->client))) {
+            return DCM_PARSE_ERROR;
+        }
+    } else if (parse->element_create &&
+               !parse->element_create(error,
+                                      adapter->client,
+                                      info->tag,
+                                      info->vr,
+                                      (char *) value,
+                                      info->length)) {
+        return DCM_PARSE_ERROR;
     }
 
-    return true;
+    return DCM_PARSE_CONTINUE;
 }
 
 
-static bool parse_element(DcmParseState *state,
-                          int64_t *position)
+static DcmParseControl adapter_element_end(DcmError **error,
+                                           void *client,
+                                           const DcmParseInfo *info)
 {
-    uint32_t tag;
-    DcmVR vr;
-    uint32_t length;
-    if (!parse_element_header(state, &tag, &vr, &length, position) ||
-        !parse_element_body(state, tag, vr, length, position)) {
-        return false;
+    const struct ParseAdapter *adapter = (const struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
+
+    if (is_pixeldata(info->tag)) {
+        if (parse->pixeldata_end &&
+            !parse->pixeldata_end(error, adapter->client)) {
+            return DCM_PARSE_ERROR;
+        }
+    } else if (parse->sequence_end &&
+               !parse->sequence_end(error,
+                                    adapter->client,
+                                    info->tag,
+                                    info->vr,
+                                    info->length)) {
+        return DCM_PARSE_ERROR;
     }
 
-    return true;
+    return DCM_PARSE_CONTINUE;
 }
 
-/* Top-level datasets don't have an enclosing length, and can broken by a
- * stop function.
- */
-static bool parse_toplevel_dataset(DcmParseState *state,
-                                   int64_t *position)
+
+static DcmParseControl adapter_item_begin(DcmError **error,
+                                          void *client,
+                                          const DcmParseInfo *info)
 {
-    if (state->parse->dataset_begin &&
-        !state->parse->dataset_begin(state->error, state->client)) {
-        return false;
+    const struct ParseAdapter *adapter = (const struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
+
+    USED(info);
+
+    if (parse->dataset_begin &&
+        !parse->dataset_begin(error, adapter->client)) {
+        return DCM_PARSE_ERROR;
     }
 
-    for (;;) {
-        if (dcm_is_eof(state)) {
-            dcm_log_info("stop reading Data Set -- reached end of filehandle");
-            break;
-        }
+    return DCM_PARSE_CONTINUE;
+}
 
-        uint32_t tag;
-        DcmVR vr;
-        uint32_t length;
-        int64_t element_start = 0;
-        if (!parse_element_header(state, &tag, &vr, &length, &element_start)) {
-            return false;
-        }
 
-        if (tag == TAG_TRAILING_PADDING) {
-            dcm_log_info("Stop reading Data Set",
-                         "Encountered Data Set Trailing Tag");
-            break;
-        }
+static DcmParseControl adapter_item_value(DcmError **error,
+                                          void *client,
+                                          const DcmParseInfo *info,
+                                          const char *value)
+{
+    const struct ParseAdapter *adapter = (const struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
+
+    if (parse->pixeldata_create &&
+        !parse->pixeldata_create(error,
+                                 adapter->client,
+                                 adapter->pixeldata_tag,
+                                 info->vr,
+                                 (char *) value,
+                                 info->length)) {
+        return DCM_PARSE_ERROR;
+    }
 
-        if (state->parse->stop &&
-            state->parse->stop(state->client, tag, vr, length)) {
-            // seek back to the start of this element
-            if (!dcm_seekcur(state, -element_start, &element_start)) {
-                return false;
-            }
-            break;
-        }
+    return DCM_PARSE_CONTINUE;
+}
 
-        *position += element_start;
 
-        if (!parse_element_body(state, tag, vr, length, position)) {
-            return false;
-        }
-    }
+static DcmParseControl adapter_item_end(DcmError **error,
+                                        void *client,
+                                        const DcmParseInfo *info)
+{
+    const struct ParseAdapter *adapter = (const struct ParseAdapter *) client;
+    const DcmParse *parse = adapter->parse;
 
-    if (state->parse->dataset_end &&
-        !state->parse->dataset_end(state->error, state->client)) {
-        return false;
+    USED(info);
+
+    if (parse->dataset_end &&
+        !parse->dataset_end(error, adapter->client)) {
+        return DCM_PARSE_ERROR;
     }
 
-    return true;
+    return DCM_PARSE_CONTINUE;
 }
 
 
+static const DcmParseCallbacks adapter_callbacks = {
+    .version = DCM_PARSE_VERSION,
+    .element_begin = adapter_element_begin,
+    .element_value = adapter_element_value,
+    .element_end = adapter_element_end,
+    .item_begin = adapter_item_begin,
+    .item_value = adapter_item_value,
+    .item_end = adapter_item_end,
+};
+
+
 /* Parse a dataset from a filehandle.
  */
 bool dcm_parse_dataset(DcmError **error,
                        DcmIO *io,
                        bool implicit,
+                       bool trusted,
                        const DcmParse *parse,
                        void *client)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
+    struct ParseAdapter adapter = {
         .parse = parse,
-        .client = client
+        .client = client,
     };
+    DcmReader reader;
 
-    int64_t position = 0;
-    if (!parse_toplevel_dataset(&state, &position)) {
+    if (!reader_init(&reader, error, io, implicit, trusted)) {
         return false;
     }
 
-    return true;
+    bool success = (!parse->dataset_begin ||
+                    parse->dataset_begin(error, client)) &&
+                   parse_events(&reader, &adapter_callbacks, &adapter) &&
+                   (!parse->dataset_end ||
+                    parse->dataset_end(error, client));
+
+    reader_clear(&reader);
+
+    return success;
 }
 
 
@@ -789,76 +1969,51 @@ bool dcm_parse_group(DcmError **error,
                      const DcmParse *parse,
                      void *client)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
+    struct ParseAdapter adapter = {
         .parse = parse,
-        .client = client
+        .client = client,
     };
+    DcmReader reader;
 
-    int64_t position = 0;
+    if (!reader_init(&reader, error, io, implicit, false)) {
+        return false;
+    }
+    DcmParseState *state = &reader.state;
 
     /* Groups start with (xxxx0000, UL, 4), meaning a 32-bit length value.
      */
     uint32_t tag;
     DcmVR vr;
     uint32_t length;
-    if (!parse_element_header(&state, &tag, &vr, &length, &position)) {
+    if (!read_tag(state, &tag) ||
+        !parse_element_header(state, tag, &vr, &length)) {
         return false;
     }
     uint16_t element_number = tag & 0xffff;
     uint16_t group_number = tag >> 16;
     if (element_number != 0x0000 || vr != DCM_VR_UL || length != 4) {
-        dcm_error_set(state.error, DCM_ERROR_CODE_PARSE,
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
                       "reading of group failed",
                       "bad group length element");
         return false;
     }
     uint32_t group_length;
-    if (!read_uint32(&state, &group_length, &position)) {
+    if (!read_uint32(state, &group_length)) {
         return false;
     }
+    reader.group = group_number;
+    reader.group_end = state->offset + group_length;
 
     // parse the elements in the group to a dataset
-    if (state.parse->dataset_begin &&
-        !state.parse->dataset_begin(state.error, state.client)) {
-        return false;
-    }
-
-    while (position < group_length) {
-        int64_t element_start = 0;
-        if (!parse_element_header(&state, &tag, &vr, &length, &element_start)) {
-            return false;
-        }
-
-        // stop if we read the first tag of the group beyond,
-        // or if the stop function triggers
-        if ((tag >> 16) != group_number ||
-            (state.parse->stop &&
-             state.parse->stop(state.client, tag, vr, length))) {
-            // seek back to the start of this element
-            if (!dcm_seekcur(&state, -element_start, &element_start)) {
-                return false;
-            }
-
-            break;
-        }
-
-        position += element_start;
-
-        if (!parse_element_body(&state, tag, vr, length, &position)) {
-            return false;
-        }
-    }
+    bool success = (!parse->dataset_begin ||
+                    parse->dataset_begin(error, client)) &&
+                   parse_events(&reader, &adapter_callbacks, &adapter) &&
+                   (!parse->dataset_end ||
+                    parse->dataset_end(error, client));
 
-    if (state.parse->dataset_end &&
-        !state.parse->dataset_end(state.error, state.client)) {
-        return false;
-    }
+    reader_clear(&reader);
 
-    return true;
+    return success;
 }
 
 
@@ -875,14 +2030,7 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
                                  int64_t *offsets,
                                  int num_frames)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian()
-    };
-
-    int64_t position = 0;
+    DcmParseState state = parse_state(error, io, implicit);
 
     dcm_log_debug("parsing PixelData");
 
@@ -890,7 +2038,8 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
     DcmVR vr;
     uint32_t length;
     uint32_t value;
-    if (!parse_element_header(&state, &tag, &vr, &length, &position)) {
+    if (!read_tag(&state, &tag) ||
+        !parse_element_header(&state, tag, &vr, &length)) {
         return false;
     }
 
@@ -904,8 +2053,8 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
     }
 
     // The header of the 0th item (the BOT)
-    if (!read_tag(&state, &tag, &position) ||
-        !read_uint32(&state, &length, &position)) {
+    if (!read_tag(&state, &tag) ||
+        !read_uint32(&state, &length)) {
         return false;
     }
     if (tag != TAG_ITEM) {
@@ -923,7 +2072,7 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
         // FIXME .. could do this with a single require to a uint32_t array,
         // see numeric array read above
         for (int i = 0; i < num_frames; i++) {
-            if (!read_uint32(&state, &value, &position)) {
+            if (!read_uint32(&state, &value)) {
                 return false;
             }
             if (value == TAG_ITEM) {
@@ -938,10 +2087,10 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
         }
 
         // and that's the offset to the item header on the first frame
-        *first_frame_offset = position;
+        *first_frame_offset = state.offset;
 
         // the next thing should be the tag for frame 1
-        if (!read_tag(&state, &tag, &position)) {
+        if (!read_tag(&state, &tag)) {
             return false;
         }
         if (tag != TAG_ITEM) {
@@ -960,10 +2109,10 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
         dcm_log_info("building Offset Table from Pixel Data");
 
         // 0 in the BOT is the offset to the start of frame 1, ie. here
-        *first_frame_offset = position;
+        *first_frame_offset = state.offset;
         for (int i = 0; i < num_frames; i++) {
-            if (!read_tag(&state, &tag, &position) ||
-                !read_uint32(&state, &length, &position)) {
+            if (!read_tag(&state, &tag) ||
+                !read_uint32(&state, &length)) {
                 return false;
             }
 
@@ -984,17 +2133,17 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
             }
 
             // step back to the start of the item for this frame
-            offsets[i] = position - *first_frame_offset - 8;
+            offsets[i] = state.offset - *first_frame_offset - 8;
 
             // and seek forward over the value
-            if (!dcm_seekcur(&state, length, &position)) {
+            if (!dcm_seekcur(&state, length)) {
                 return false;
             }
         }
 
         // in case multiple frames 1:1 frame to fragment mapping is assumed,
         // therefore the next thing should be the end of sequence tag
-        if (!read_tag(&state, &tag, &position)) {
+        if (!read_tag(&state, &tag)) {
             return false;
         }
         if (num_frames != 1 && tag != TAG_SQ_DELIM) {
@@ -1015,12 +2164,7 @@ char *dcm_parse_frame(DcmError **error,
                       struct PixelDescription *desc,
                       uint32_t *length)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
-    };
+    DcmParseState state = parse_state(error, io, implicit);
 
     *length =   desc->rows *
                 desc->columns *
@@ -1031,8 +2175,7 @@ char *dcm_parse_frame(DcmError **error,
     if (value == NULL) {
         return NULL;
     }
-    int64_t position = 0;
-    if (!dcm_require(&state, value, *length, &position)) {
+    if (!dcm_require(&state, value, *length)) {
         free(value);
         return NULL;
     }
@@ -1048,22 +2191,16 @@ char *dcm_parse_encapsulated_frame(DcmError **error,
                                    int64_t frame_end_offset,
                                    uint32_t* length)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
-    };
+    DcmParseState state = parse_state(error, io, implicit);
 
-    int64_t position = 0;
     *length = 0;
     uint32_t tag;
     uint32_t fragment_length = 0;
     uint64_t frame_length = 0;
     char *value = NULL;
 
-    while (position < frame_end_offset) {
-        if (!read_tag(&state, &tag, &position)) {
+    while (state.offset < frame_end_offset) {
+        if (!read_tag(&state, &tag)) {
             free(value);
             return NULL;
         }
@@ -1077,7 +2214,7 @@ char *dcm_parse_encapsulated_frame(DcmError **error,
             free(value);
             return NULL;
         }
-        if (!read_uint32(&state, &fragment_length, &position)) {
+        if (!read_uint32(&state, &fragment_length)) {
             free(value);
             return NULL;
         }
@@ -1097,8 +2234,7 @@ char *dcm_parse_encapsulated_frame(DcmError **error,
         }
         value = new_value;
 
-        if (!dcm_require(&state, value + frame_length, fragment_length,
-                         &position)) {
+        if (!dcm_require(&state, value + frame_length, fragment_length)) {
             free(value);
             return NULL;
         }
@@ -0,0 +1,485 @@
+/*
+ * Implementation of compiled attribute paths.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+/* Keywords in the dictionary are never longer than this.
+ */
+#define MAX_KEYWORD_LENGTH (64)
+
+/* Longer than any valid DS or IS value.
+ */
+#define MAX_NUMBER_LENGTH (64)
+
+
+struct PathComponent {
+    uint32_t tag;
+
+    // index of the sequence item to descend into, unused for the last
+    // component
+    uint32_t index;
+};
+
+
+struct _DcmPath {
+    uint32_t length;
+    struct PathComponent *components;
+};
+
+
+static bool parse_tag(const char *str, size_t length, uint32_t *tag)
+{
+    if (length != 8) {
+        return false;
+    }
+
+    uint32_t result = 0;
+    for (size_t i = 0; i < length; i++) {
+        int c = str[i];
+
+        if (!isxdigit(c)) {
+            return false;
+        }
+        result = (result << 4) |
+            (uint32_t) (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    *tag = result;
+
+    return true;
+}
+
+
+static bool parse_attribute(DcmError **error,
+                            const char *path,
+                            const char *str,
+                            size_t length,
+                            uint32_t *tag)
+{
+    char keyword[MAX_KEYWORD_LENGTH + 1];
+
+    if (length == 0 || length > MAX_KEYWORD_LENGTH) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "invalid attribute path",
+                      "bad attribute name in path '%s'", path);
+        return false;
+    }
+
+    memcpy(keyword, str, length);
+    keyword[length] = '\0';
+
+    *tag = dcm_dict_tag_from_keyword(keyword);
+    if (*tag == 0xffffffff &&
+        !parse_tag(keyword, length, tag)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "invalid attribute path",
+                      "unknown attribute '%s' in path '%s'", keyword, path);
+        return false;
+    }
+
+    if (!dcm_is_valid_tag(*tag)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "invalid attribute path",
+                      "bad tag '%s' in path '%s'", keyword, path);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool parse_index(DcmError **error,
+                        const char *path,
+                        const char **p,
+                        uint32_t *index)
+{
+    const char *q = *p;
+    uint64_t result = 0;
+
+    // skip the '['
+    q += 1;
+    if (!isdigit((int) *q)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "invalid attribute path",
+                      "bad item index in path '%s'", path);
+        return false;
+    }
+    while (isdigit((int) *q)) {
+        result = result * 10 + (uint64_t) (*q - '0');
+        if (result > UINT32_MAX) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "invalid attribute path",
+                          "item index too large in path '%s'", path);
+            return false;
+        }
+        q += 1;
+    }
+    if (*q != ']') {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "invalid attribute path",
+                      "missing ']' in path '%s'", path);
+        return false;
+    }
+
+    *index = (uint32_t) result;
+    *p = q + 1;
+
+    return true;
+}
+
+
+DcmPath *dcm_path_compile(DcmError **error, const char *path)
+{
+    // one component per '.', plus one
+    uint32_t length = 1;
+    for (const char *p = path; *p; p++) {
+        if (*p == '.') {
+            length += 1;
+        }
+    }
+
+    DcmPath *result = DCM_NEW(error, DcmPath);
+    if (result == NULL) {
+        return NULL;
+    }
+    result->components = DCM_NEW_ARRAY(error, length, struct PathComponent);
+    if (result->components == NULL) {
+        dcm_path_destroy(result);
+        return NULL;
+    }
+    result->length = length;
+
+    const char *p = path;
+    for (uint32_t i = 0; i < length; i++) {
+        struct PathComponent *component = &result->components[i];
+        bool is_last = i == length - 1;
+
+        size_t attribute_length = strcspn(p, ".[");
+        if (!parse_attribute(error, path, p, attribute_length,
+                             &component->tag)) {
+            dcm_path_destroy(result);
+            return NULL;
+        }
+        p += attribute_length;
+
+        if (!is_last) {
+            if (*p != '[') {
+                dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                              "invalid attribute path",
+                              "missing item index in path '%s'", path);
+                dcm_path_destroy(result);
+                return NULL;
+            }
+            if (!parse_index(error, path, &p, &component->index)) {
+                dcm_path_destroy(result);
+                return NULL;
+            }
+            if (*p != '.') {
+                dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                              "invalid attribute path",
+                              "missing '.' in path '%s'", path);
+                dcm_path_destroy(result);
+                return NULL;
+            }
+            p += 1;
+        } else if (*p != '\0') {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "invalid attribute path",
+                          "path '%s' must end with an attribute", path);
+            dcm_path_destroy(result);
+            return NULL;
+        }
+    }
+
+    return result;
+}
+
+
+DcmElement *dcm_path_eval(const DcmDataSet *dataset, const DcmPath *path)
+{
+    for (uint32_t i = 0; i < path->length - 1; i++) {
+        const struct PathComponent *component = &path->components[i];
+
+        DcmElement *element = dcm_dataset_contains(dataset, component->tag);
+        if (element == NULL) {
+            return NULL;
+        }
+        DcmSequence *seq = dcm_element_peek_sequence(element);
+        if (seq == NULL) {
+            return NULL;
+        }
+        dataset = dcm_sequence_peek(seq, component->index);
+        if (dataset == NULL) {
+            return NULL;
+        }
+    }
+
+    return dcm_dataset_contains(dataset,
+                                path->components[path->length - 1].tag);
+}
+
+
+uint32_t dcm_path_get_tag(const DcmPath *path)
+{
+    return path->components[path->length - 1].tag;
+}
+
+
+uint32_t dcm_path_get_length(const DcmPath *path)
+{
+    return path->length;
+}
+
+
+uint32_t dcm_path_get_root_tag(const DcmPath *path)
+{
+    return path->components[0].tag;
+}
+
+
+void dcm_path_destroy(DcmPath *path)
+{
+    if (path) {
+        if (path->components) {
+            free(path->components);
+        }
+        free(path);
+    }
+}
+
+
+bool dcm_path_match(const DcmPath *path,
+                    const struct PathLevel *levels,
+                    uint32_t n_levels,
+                    uint32_t tag)
+{
+    if (n_levels != path->length - 1 ||
+        path->components[n_levels].tag != tag) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_levels; i++) {
+        if (levels[i].tag != path->components[i].tag ||
+            levels[i].index != path->components[i].index) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// copy the index'th backslash-separated field of a string value to a
+// null-terminated buffer
+static bool get_string_field(const char *value,
+                             uint32_t length,
+                             uint32_t index,
+                             char *field)
+{
+    const char *end = value + length;
+
+    for (uint32_t i = 0; i < index; i++) {
+        const char *separator = memchr(value, '\\', end - value);
+        if (separator == NULL) {
+            return false;
+        }
+        value = separator + 1;
+    }
+
+    const char *separator = memchr(value, '\\', end - value);
+    size_t field_length = (separator ? separator : end) - value;
+    if (field_length >= MAX_NUMBER_LENGTH) {
+        return false;
+    }
+    memcpy(field, value, field_length);
+    field[field_length] = '\0';
+
+    return true;
+}
+
+
+// allow leading and trailing spaces, but nothing else
+static bool is_blank(const char *str)
+{
+    while (isspace((int) *str)) {
+        str += 1;
+    }
+
+    return *str == '\0';
+}
+
+
+bool dcm_value_to_decimal(DcmVR vr,
+                          const char *value,
+                          uint32_t length,
+                          uint32_t index,
+                          double *result)
+{
+    DcmVRClass vr_class = dcm_dict_vr_class(vr);
+
+    if (vr_class == DCM_VR_CLASS_NUMERIC_DECIMAL ||
+        vr_class == DCM_VR_CLASS_NUMERIC_INTEGER) {
+        size_t size = dcm_dict_vr_size(vr);
+        if (((uint64_t) index + 1) * size > length) {
+            return false;
+        }
+        const char *p = value + (size_t) index * size;
+
+#define PEEK(TYPE) { TYPE v; memcpy(&v, p, sizeof(v)); *result = (double) v; }
+        DCM_SWITCH_NUMERIC(vr, PEEK);
+#undef PEEK
+
+        return true;
+    } else if (vr == DCM_VR_DS || vr == DCM_VR_IS) {
+        char field[MAX_NUMBER_LENGTH];
+        char *end;
+
+        if (!get_string_field(value, length, index, field) ||
+            is_blank(field)) {
+            return false;
+        }
+        errno = 0;
+        *result = strtod(field, &end);
+
+        return errno == 0 && is_blank(end);
+    }
+
+    return false;
+}
+
+
+bool dcm_value_to_integer(DcmVR vr,
+                          const char *value,
+                          uint32_t length,
+                          uint32_t index,
+                          int64_t *result)
+{
+    DcmVRClass vr_class = dcm_dict_vr_class(vr);
+
+    if (vr_class == DCM_VR_CLASS_NUMERIC_INTEGER) {
+        size_t size = dcm_dict_vr_size(vr);
+        if (((uint64_t) index + 1) * size > length) {
+            return false;
+        }
+        const char *p = value + (size_t) index * size;
+
+#define PEEK(TYPE) { TYPE v; memcpy(&v, p, sizeof(v)); *result = (int64_t) v; }
+        DCM_SWITCH_NUMERIC(vr, PEEK);
+#undef PEEK
+
+        return true;
+    } else if (vr == DCM_VR_IS) {
+        char field[MAX_NUMBER_LENGTH];
+        char *end;
+
+        if (!get_string_field(value, length, index, field) ||
+            is_blank(field)) {
+            return false;
+        }
+        errno = 0;
+        *result = strtoll(field, &end, 10);
+
+        return errno == 0 && is_blank(end);
+    }
+
+    return false;
+}
+
+
+// find the value of a path in each sequence item, as either integer or
+// double
+static bool sequence_extract(DcmError **error,
+                             const DcmSequence *seq,
+                             const DcmPath *path,
+                             uint32_t index,
+                             int64_t *integers,
+                             double *decimals)
+{
+    uint32_t count = dcm_sequence_count(seq);
+
+    for (uint32_t i = 0; i < count; i++) {
+        DcmDataSet *item = dcm_sequence_peek(seq, i);
+        DcmElement *element = item ? dcm_path_eval(item, path) : NULL;
+        if (element == NULL) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "extracting values failed",
+                          "item %u has no data element '%08x'",
+                          i, dcm_path_get_tag(path));
+            return false;
+        }
+
+        // numeric values are read straight from the element's array, string
+        // values one field at a time
+        DcmVR vr = dcm_element_get_vr(element);
+        const char *value;
+        uint32_t length;
+        uint32_t value_index;
+        const void *array;
+        uint32_t vm;
+        if (dcm_element_get_value_numeric_array(NULL, element,
+                                                &vr, &array, &vm)) {
+            value = array;
+            length = vm * (uint32_t) dcm_dict_vr_size(vr);
+            value_index = index;
+        } else if (dcm_element_get_value_string(NULL, element,
+                                                index, &value)) {
+            length = (uint32_t) strlen(value);
+            value_index = 0;
+        } else {
+            value = NULL;
+            length = 0;
+            value_index = 0;
+        }
+
+        bool success;
+        if (value == NULL) {
+            success = false;
+        } else if (integers) {
+            success = dcm_value_to_integer(vr, value, length,
+                                           value_index, &integers[i]);
+        } else {
+            success = dcm_value_to_decimal(vr, value, length,
+                                           value_index, &decimals[i]);
+        }
+        if (!success) {
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "extracting values failed",
+                          "item %u has no suitable value %u for "
+                          "data element '%08x'",
+                          i, index, dcm_path_get_tag(path));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool dcm_sequence_extract_decimal(DcmError **error,
+                                  const DcmSequence *seq,
+                                  const DcmPath *path,
+                                  uint32_t index,
+                                  double *values)
+{
+    return sequence_extract(error, seq, path, index, NULL, values);
+}
+
+
+bool dcm_sequence_extract_integer(DcmError **error,
+                                  const DcmSequence *seq,
+                                  const DcmPath *path,
+                                  uint32_t index,
+                                  int64_t *values)
+{
+    return sequence_extract(error, seq, path, index, values, NULL);
+}
@@ -43,21 +43,26 @@ typedef SSIZE_T ssize_t;
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 #define USED(x) (void)(x)
 
-#define TAG_TRANSFER_SYNTAX_UID                     0x00020010
-#define TAG_DIMENSION_INDEX_VALUES                  0x00209157
-#define TAG_REFERENCED_IMAGE_NAVIGATION_SEQUENCE    0x00480200
-#define TAG_PLANE_POSITION_SLIDE_SEQUENCE           0x0048021a
-#define TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX 0x0048021e
-#define TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX 0x0048021f
-#define TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE     0x52009230
-#define TAG_EXTENDED_OFFSET_TABLE                   0x7FE00001
-#define TAG_FLOAT_PIXEL_DATA                        0x7FE00008
-#define TAG_DOUBLE_PIXEL_DATA                       0x7FE00009
-#define TAG_PIXEL_DATA                              0x7FE00010
-#define TAG_TRAILING_PADDING                        0xFFFCFFFC
-#define TAG_ITEM                                    0xFFFEE000
-#define TAG_ITEM_DELIM                              0xFFFEE00D
-#define TAG_SQ_DELIM                                0xFFFEE0DD
+#define TAG_TRANSFER_SYNTAX_UID     DCM_TAG_TransferSyntaxUID
+#define TAG_DIMENSION_INDEX_VALUES  DCM_TAG_DimensionIndexValues
+#define TAG_REFERENCED_IMAGE_NAVIGATION_SEQUENCE \
+    DCM_TAG_ReferencedImageNavigationSequence
+#define TAG_PLANE_POSITION_SLIDE_SEQUENCE \
+    DCM_TAG_PlanePositionSlideSequence
+#define TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX \
+    DCM_TAG_ColumnPositionInTotalImagePixelMatrix
+#define TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX \
+    DCM_TAG_RowPositionInTotalImagePixelMatrix
+#define TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE \
+    DCM_TAG_PerFrameFunctionalGroupsSequence
+#define TAG_EXTENDED_OFFSET_TABLE   DCM_TAG_ExtendedOffsetTable
+#define TAG_FLOAT_PIXEL_DATA        DCM_TAG_FloatPixelData
+#define TAG_DOUBLE_PIXEL_DATA       DCM_TAG_DoubleFloatPixelData
+#define TAG_PIXEL_DATA              DCM_TAG_PixelData
+#define TAG_TRAILING_PADDING        DCM_TAG_DataSetTrailingPadding
+#define TAG_ITEM                    DCM_TAG_Item
+#define TAG_ITEM_DELIM              DCM_TAG_ItemDelimitationItem
+#define TAG_SQ_DELIM                DCM_TAG_SequenceDelimitationItem
 
 void *dcm_realloc(DcmError **error, void *ptr, uint64_t size);
 char *dcm_strdup(DcmError **error, const char *str);
@@ -65,6 +70,51 @@ char *dcm_printf_append(char *str, const char *format, ...);
 
 void dcm_free_string_array(char **strings, int n);
 
+/* For IO objects that hold all their input in memory, return a pointer to
+ * the next length bytes and move the read point past them. Returns NULL for
+ * other IO objects, or if there are not enough bytes.
+ */
+const char *dcm_io_borrow(DcmIO *io, int64_t length);
+
+/* True if data is inside the memory an IO object reads from, so it lives as
+ * long as the IO object.
+ */
+bool dcm_io_contains(const DcmIO *io, const char *data, int64_t length);
+
+/* Hint that we will soon read length bytes from offset, or to the end if
+ * length is 0. Only file IO on platforms with posix_fadvise() or
+ * F_RDADVISE does anything with this.
+ */
+void dcm_io_advise(DcmIO *io, int64_t offset, int64_t length);
+
+/* A range of bytes to read into a buffer.
+ */
+typedef struct _DcmIORead {
+    int64_t offset;
+    int64_t length;
+    char *buffer;
+} DcmIORead;
+
+/* Read a set of ranges, all or nothing. File IO built with liburing
+ * submits the reads together and lets them complete in any order, others
+ * seek and read each in turn, which moves the read point.
+ */
+bool dcm_io_read_batch(DcmError **error,
+                       DcmIO *io,
+                       DcmIORead *reads,
+                       uint32_t n_reads);
+
+/* Map the two characters of a VR, with no terminating null, to a DcmVR.
+ */
+DcmVR dcm_dict_vr_from_chars(const char *chars);
+
+/* Private tags added with dcm_dict_add_private_tag(). Creators are
+ * numbered once the dictionary is frozen, -1 means an unknown creator.
+ */
+bool dcm_dict_has_private(void);
+int dcm_dict_private_creator(const char *creator);
+DcmVR dcm_dict_private_vr(int creator, uint32_t tag);
+
 size_t dcm_dict_vr_size(DcmVR vr);
 uint32_t dcm_dict_vr_capacity(DcmVR vr);
 int dcm_dict_vr_header_length(DcmVR vr);
@@ -83,9 +133,93 @@ int dcm_dict_vr_header_length(DcmVR vr);
         default: break; \
     }
 
+/* An element for a value read from trusted input. Values set on it are not
+ * checked against the dictionary.
+ */
+DcmElement *dcm_element_create_trusted(DcmError **error,
+                                       uint32_t tag,
+                                       DcmVR vr);
+
 DcmDataSet *dcm_sequence_steal(DcmError **error,
                                const DcmSequence *seq, uint32_t index);
 
+/* Set a value the element does not own, for example bytes in the memory a
+ * filehandle is reading from. Only binary values and aligned numeric arrays
+ * are used in place, anything else is copied.
+ */
+bool dcm_element_set_value_borrowed(DcmError **error,
+                                    DcmElement *element,
+                                    const char *value,
+                                    uint32_t length);
+
+/* Read length bytes at offset in the input into buffer.
+ */
+typedef bool (*DcmBulkRead)(DcmError **error,
+                            void *client,
+                            int64_t offset,
+                            char *buffer,
+                            uint32_t length);
+
+/* Set a binary value which is left in the input at offset, to be read with
+ * read when it is first needed. client must outlive the element.
+ */
+bool dcm_element_set_value_bulk(DcmError **error,
+                                DcmElement *element,
+                                DcmBulkRead read,
+                                void *client,
+                                int64_t offset,
+                                uint32_t length);
+
+/* Read a sequence whose header is at offset in the input.
+ */
+typedef DcmSequence *(*DcmSequenceRead)(DcmError **error,
+                                        void *client,
+                                        int64_t offset);
+
+/* Set a sequence which is left in the input with its header at offset, to
+ * be read with read when it is first needed. client must outlive the
+ * element.
+ */
+bool dcm_element_set_value_sequence_lazy(DcmError **error,
+                                         DcmElement *element,
+                                         DcmSequenceRead read,
+                                         void *client,
+                                         int64_t offset,
+                                         uint32_t length);
+
+/* Lookups that do not log or set an error on a miss.
+ */
+DcmSequence *dcm_element_peek_sequence(const DcmElement *element);
+DcmDataSet *dcm_sequence_peek(const DcmSequence *seq, uint32_t index);
+
+/* Our position in a nested parse: the sequence we are inside and the index
+ * of the current item.
+ */
+struct PathLevel {
+    uint32_t tag;
+    uint32_t index;
+};
+
+uint32_t dcm_path_get_length(const DcmPath *path);
+uint32_t dcm_path_get_root_tag(const DcmPath *path);
+bool dcm_path_match(const DcmPath *path,
+                    const struct PathLevel *levels,
+                    uint32_t n_levels,
+                    uint32_t tag);
+
+/* Convert a numeric or DS/IS value, as delivered by the parser, to a number.
+ */
+bool dcm_value_to_decimal(DcmVR vr,
+                          const char *value,
+                          uint32_t length,
+                          uint32_t index,
+                          double *result);
+bool dcm_value_to_integer(DcmVR vr,
+                          const char *value,
+                          uint32_t length,
+                          uint32_t index,
+                          int64_t *result);
+
 typedef struct _DcmParse {
     bool (*dataset_begin)(DcmError **, void *client);
     bool (*dataset_end)(DcmError **, void *client);
@@ -126,15 +260,55 @@ typedef struct _DcmParse {
                  uint32_t tag,
                  DcmVR vr,
                  uint32_t length);
+
+    // binary values for which defer returns true are not read, instead
+    // element_defer gets their offset in the input
+    bool (*defer)(void *client,
+                  uint32_t tag,
+                  DcmVR vr,
+                  uint32_t length);
+    bool (*element_defer)(DcmError **,
+                          void *client,
+                          uint32_t tag,
+                          DcmVR vr,
+                          int64_t offset,
+                          uint32_t length);
+
+    // top-level sequences for which defer returns true are not read,
+    // instead sequence_defer gets the offset of their header
+    bool (*sequence_defer)(DcmError **,
+                           void *client,
+                           uint32_t tag,
+                           DcmVR vr,
+                           int64_t offset,
+                           uint32_t length);
 } DcmParse;
 
 DCM_EXTERN
 bool dcm_parse_dataset(DcmError **error,
                        DcmIO *io,
                        bool implicit,
+                       bool trusted,
                        const DcmParse *parse,
                        void *client);
 
+/* The streaming parser behind dcm_filehandle_parse(), starting from the
+ * current read point. Trusted input is not checked against the dictionary.
+ */
+bool dcm_parse_stream(DcmError **error,
+                      DcmIO *io,
+                      bool implicit,
+                      bool trusted,
+                      const DcmParseCallbacks *callbacks,
+                      void *client);
+
+/* A pull reader starting from the current read point.
+ */
+DcmReader *dcm_reader_create(DcmError **error,
+                             DcmIO *io,
+                             bool implicit,
+                             bool trusted);
+
 DCM_EXTERN
 bool dcm_parse_group(DcmError **error,
                      DcmIO *io,
@@ -149,6 +323,77 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
                                  int64_t *offsets,
                                  int num_frames);
 
+/* Add a reference to a frame. dcm_frame_destroy() drops one.
+ */
+DcmFrame *dcm_frame_ref(DcmFrame *frame);
+
+/* A cache of frames, keyed by the identity of the file and the frame
+ * number, which holds up to budget bytes of frame data and evicts the
+ * least recently used frames. Identities are strings of up to
+ * DCM_MAX_CACHE_IDENTITY characters.
+ */
+#define DCM_MAX_CACHE_IDENTITY (256)
+
+typedef struct _DcmFrameCache DcmFrameCache;
+
+DcmFrameCache *dcm_frame_cache_create(DcmError **error, uint64_t budget);
+void dcm_frame_cache_destroy(DcmFrameCache *cache);
+
+/* Returns a new reference, or NULL on a miss.
+ */
+DcmFrame *dcm_frame_cache_get(DcmFrameCache *cache,
+                              const char *identity,
+                              uint32_t number);
+
+/* The cache takes a reference of its own.
+ */
+bool dcm_frame_cache_put(DcmError **error,
+                         DcmFrameCache *cache,
+                         const char *identity,
+                         DcmFrame *frame);
+void dcm_frame_cache_get_stats(const DcmFrameCache *cache,
+                               uint64_t *hits,
+                               uint64_t *misses);
+
+/* The same, for the process-wide cache, which is thread-safe.
+ */
+DcmFrame *dcm_shared_frame_cache_get(const char *identity, uint32_t number);
+bool dcm_shared_frame_cache_put(DcmError **error,
+                                const char *identity,
+                                DcmFrame *frame);
+
+/* The shared memory cache holds copies of frame data. get returns a copy
+ * you must free, or NULL on a miss. put silently drops frames which do not
+ * fit in a slot, or which would replace a slot another process is writing.
+ */
+char *dcm_shm_frame_cache_get(DcmShmFrameCache *cache,
+                              const char *identity,
+                              uint32_t number,
+                              uint32_t *length);
+void dcm_shm_frame_cache_put(DcmShmFrameCache *cache,
+                             const char *identity,
+                             uint32_t number,
+                             const char *data,
+                             uint32_t length);
+
+/* Pending asynchronous reads for a filehandle. Destroy waits for them all
+ * to be delivered.
+ */
+typedef struct _DcmAsyncState DcmAsyncState;
+
+DcmAsyncState *dcm_async_state_create(DcmError **error);
+void dcm_async_state_destroy(DcmAsyncState *state);
+
+/* Queue a read of a frame, delivered to one of callback or queue.
+ */
+bool dcm_async_read_frame(DcmError **error,
+                          DcmAsyncState *state,
+                          DcmFilehandle *filehandle,
+                          uint32_t frame_number,
+                          DcmFrameCallback callback,
+                          DcmCompletionQueue *queue,
+                          void *user);
+
 struct PixelDescription {
     uint16_t rows;
     uint16_t columns;
@@ -5,10 +5,19 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
+#ifdef HAVE_SHM_OPEN
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #include <dicom/dicom.h>
 
 
@@ -191,6 +200,12 @@ START_TEST(test_dict_tag_lookups)
 
     ck_assert_int_eq(dcm_dict_tag_from_keyword("SpecimenUID"), 0x00400554);
     ck_assert_int_eq(dcm_dict_tag_from_keyword("Banana"), 0xffffffff);
+
+    ck_assert_int_eq(DCM_TAG_SpecimenUID, 0x00400554);
+    ck_assert_int_eq(DCM_TAG_NumberOfFrames,
+                     dcm_dict_tag_from_keyword("NumberOfFrames"));
+    ck_assert_int_eq(DCM_TAG_Rows_VR, DCM_VR_US);
+    ck_assert_int_eq(DCM_TAG_PixelData, 0x7FE00010);
 }
 END_TEST
 
@@ -214,6 +229,120 @@ START_TEST(test_dict_vr_lookups)
 END_TEST
 
 
+struct PrivateVRs {
+    uint32_t n_elements;
+    uint32_t tags[16];
+    DcmVR vrs[16];
+};
+
+
+static DcmParseControl record_vr(DcmError **error,
+                                 void *client,
+                                 const DcmParseInfo *info)
+{
+    struct PrivateVRs *vrs = (struct PrivateVRs *) client;
+
+    (void) error;
+
+    if (vrs->n_elements < 16) {
+        vrs->tags[vrs->n_elements] = info->tag;
+        vrs->vrs[vrs->n_elements] = info->vr;
+        vrs->n_elements += 1;
+    }
+
+    return DCM_PARSE_CONTINUE;
+}
+
+
+START_TEST(test_dict_private_tags)
+{
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        "ACME 1.0", 0x00291001, DCM_VR_US, "AcmeWidth"), true);
+    // the same tag in another block
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        "ACME 1.0", 0x00291101, DCM_VR_UL, NULL), false);
+    // a private creator, not a private data element
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        "ACME 1.0", 0x00290010, DCM_VR_LO, NULL), false);
+    // already a public tag
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        NULL, 0x00280008, DCM_VR_IS, NULL), false);
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        NULL, 0x00091001, DCM_VR_DS, "ExtraThickness"), true);
+
+    // nothing is visible until the dictionary is frozen
+    ck_assert_int_eq(dcm_vr_from_private_tag("ACME 1.0", 0x00291001),
+                     DCM_VR_ERROR);
+    ck_assert_int_eq(dcm_dict_freeze(NULL), true);
+    ck_assert_int_eq(dcm_dict_freeze(NULL), false);
+    ck_assert_int_eq(dcm_dict_add_private_tag(NULL,
+        "ACME 1.0", 0x00291002, DCM_VR_US, NULL), false);
+
+    ck_assert_int_eq(dcm_vr_from_private_tag("ACME 1.0", 0x00291201),
+                     DCM_VR_US);
+    ck_assert_str_eq(dcm_dict_keyword_from_private_tag("ACME 1.0",
+                                                       0x00291001),
+                     "AcmeWidth");
+    ck_assert_int_eq(dcm_vr_from_private_tag("OTHER", 0x00291001),
+                     DCM_VR_ERROR);
+    ck_assert_int_eq(dcm_vr_from_tag(0x00091001), DCM_VR_DS);
+    ck_assert_str_eq(dcm_dict_keyword_from_tag(0x00091001), "ExtraThickness");
+    ck_assert_int_eq(dcm_dict_tag_from_keyword("ExtraThickness"), 0x00091001);
+
+    // implicit VR little endian, with a private sequence of undefined
+    // length whose item reserves block 0x11 for the same creator
+    static const unsigned char data[] = {
+        0x29, 0x00, 0x10, 0x00, 8, 0, 0, 0,
+        'A', 'C', 'M', 'E', ' ', '1', '.', '0',
+        0x29, 0x00, 0x01, 0x10, 2, 0, 0, 0, 0x34, 0x12,
+        0x29, 0x00, 0x02, 0x10, 4, 0, 0, 0, 1, 2, 3, 4,
+        0x29, 0x00, 0x03, 0x10, 0xff, 0xff, 0xff, 0xff,
+        0xfe, 0xff, 0x00, 0xe0, 0xff, 0xff, 0xff, 0xff,
+        0x29, 0x00, 0x11, 0x00, 8, 0, 0, 0,
+        'A', 'C', 'M', 'E', ' ', '1', '.', '0',
+        0x29, 0x00, 0x01, 0x11, 2, 0, 0, 0, 0x34, 0x12,
+        0x29, 0x00, 0x01, 0x10, 2, 0, 0, 0, 0x34, 0x12,
+        0xfe, 0xff, 0x0d, 0xe0, 0, 0, 0, 0,
+        0xfe, 0xff, 0xdd, 0xe0, 0, 0, 0, 0,
+    };
+    static const DcmVR expected[] = {
+        DCM_VR_LO, DCM_VR_US, DCM_VR_UN, DCM_VR_SQ,
+        DCM_VR_LO, DCM_VR_US, DCM_VR_UN,
+    };
+    DcmParseCallbacks callbacks = {
+        .version = DCM_PARSE_VERSION,
+        .element_begin = record_vr,
+    };
+
+    // all at once, and a byte at a time
+    size_t chunk_sizes[] = {sizeof(data), 1};
+    for (size_t j = 0; j < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); j++) {
+        size_t chunk_size = chunk_sizes[j];
+        struct PrivateVRs vrs = { 0 };
+        DcmParser *parser = dcm_parser_create(NULL,
+                                              "1.2.840.10008.1.2",
+                                              &callbacks,
+                                              &vrs);
+        ck_assert_ptr_nonnull(parser);
+        for (size_t i = 0; i < sizeof(data); i += chunk_size) {
+            size_t n = sizeof(data) - i < chunk_size ?
+                sizeof(data) - i : chunk_size;
+            ck_assert_int_eq(dcm_parser_feed(NULL, parser,
+                                             (const char *) data + i, n),
+                             true);
+        }
+        ck_assert_int_eq(dcm_parser_finish(NULL, parser), true);
+        dcm_parser_destroy(parser);
+
+        ck_assert_uint_eq(vrs.n_elements, 7);
+        for (uint32_t i = 0; i < vrs.n_elements; i++) {
+            ck_assert_int_eq(vrs.vrs[i], expected[i]);
+        }
+    }
+}
+END_TEST
+
+
 START_TEST(test_element_AE)
 {
     uint32_t tag = 0x00020016;
@@ -547,6 +676,54 @@ START_TEST(test_element_US_multivalue_empty)
 END_TEST
 
 
+START_TEST(test_element_FD_array)
+{
+    uint32_t tag = 0x00209301;
+    double value[] = {1.5, -2.25, 1000.0};
+    uint32_t vm = sizeof(value) / sizeof(value[0]);
+
+    DcmElement *element = dcm_element_create(NULL, tag, DCM_VR_FD);
+    (void) dcm_element_set_value_numeric_multi(NULL, element, value, vm, false);
+
+    DcmVR vr;
+    const void *values;
+    uint32_t array_vm;
+    ck_assert_int_eq(dcm_element_get_value_numeric_array(NULL, element,
+                                                         &vr, &values,
+                                                         &array_vm), true);
+    ck_assert_int_eq(vr, DCM_VR_FD);
+    ck_assert_uint_eq(array_vm, vm);
+    ck_assert_mem_eq(values, value, sizeof(value));
+
+    dcm_element_destroy(element);
+
+    // single values are held inside the element
+    uint16_t columns = 512;
+    element = dcm_element_create(NULL, 0x00280011, DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, element, columns);
+
+    ck_assert_int_eq(dcm_element_get_value_numeric_array(NULL, element,
+                                                         &vr, &values,
+                                                         &array_vm), true);
+    ck_assert_int_eq(vr, DCM_VR_US);
+    ck_assert_uint_eq(array_vm, 1);
+    ck_assert_uint_eq(((const uint16_t *) values)[0], columns);
+
+    dcm_element_destroy(element);
+
+    // strings are not numeric
+    element = dcm_element_create(NULL, 0x00080016, DCM_VR_UI);
+    (void) dcm_element_set_value_string(NULL, element, "1.2.3", false);
+
+    ck_assert_int_eq(dcm_element_get_value_numeric_array(NULL, element,
+                                                         &vr, &values,
+                                                         &array_vm), false);
+
+    dcm_element_destroy(element);
+}
+END_TEST
+
+
 START_TEST(test_sequence)
 {
     DcmElement *element;
@@ -697,6 +874,836 @@ START_TEST(test_file_sm_image_metadata)
 END_TEST
 
 
+START_TEST(test_file_sm_image_path)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(NULL, filehandle);
+    ck_assert_ptr_nonnull(metadata);
+
+    DcmPath *path = dcm_path_compile(NULL,
+        "SharedFunctionalGroupsSequence[0]."
+        "PixelMeasuresSequence[0].PixelSpacing");
+    ck_assert_ptr_nonnull(path);
+    ck_assert_uint_eq(dcm_path_get_tag(path), 0x00280030);
+
+    DcmElement *element = dcm_path_eval(metadata, path);
+    ck_assert_ptr_nonnull(element);
+    const char *value;
+    (void) dcm_element_get_value_string(NULL, element, 1, &value);
+    ck_assert_str_eq(value, "0.000499");
+    dcm_path_destroy(path);
+
+    // misses are not errors
+    path = dcm_path_compile(NULL,
+        "SharedFunctionalGroupsSequence[1].PixelMeasuresSequence[0].Rows");
+    ck_assert_ptr_nonnull(path);
+    ck_assert_ptr_null(dcm_path_eval(metadata, path));
+    dcm_path_destroy(path);
+
+    // tags can be given in hex
+    path = dcm_path_compile(NULL, "00280010");
+    ck_assert_ptr_nonnull(path);
+    ck_assert_ptr_nonnull(dcm_path_eval(metadata, path));
+    dcm_path_destroy(path);
+
+    DcmError *error = NULL;
+    ck_assert_ptr_null(dcm_path_compile(&error, "Banana[0].Rows"));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    ck_assert_ptr_null(dcm_path_compile(NULL,
+                                        "SharedFunctionalGroupsSequence.Rows"));
+    ck_assert_ptr_null(dcm_path_compile(NULL, "Rows[0]"));
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_extract)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(NULL, filehandle);
+    ck_assert_ptr_nonnull(metadata);
+
+    // DimensionIndexPointer for each dimension, from the dataset
+    DcmElement *element = dcm_dataset_get(NULL, metadata, 0x00209222);
+    DcmSequence *seq;
+    ck_assert_int_eq(dcm_element_get_value_sequence(NULL, element, &seq),
+                     true);
+    ck_assert_uint_eq(dcm_sequence_count(seq), 2);
+
+    DcmPath *pointer_path = dcm_path_compile(NULL, "DimensionIndexPointer");
+    int64_t pointers[2];
+    ck_assert_int_eq(dcm_sequence_extract_integer(NULL, seq, pointer_path,
+                                                  1, pointers), true);
+    ck_assert_int_eq(pointers[0], 0x021f);
+    ck_assert_int_eq(pointers[1], 0x021e);
+
+    // and again, streaming from the file
+    int64_t *file_pointers;
+    uint32_t count;
+    ck_assert_int_eq(dcm_filehandle_extract_integer(NULL, filehandle,
+                                                    0x00209222,
+                                                    pointer_path, 1,
+                                                    &file_pointers, &count),
+                     true);
+    ck_assert_uint_eq(count, 2);
+    ck_assert_int_eq(file_pointers[0], 0x021f);
+    ck_assert_int_eq(file_pointers[1], 0x021e);
+    dcm_free(file_pointers);
+
+    // DS values are converted
+    DcmPath *spacing_path = dcm_path_compile(NULL,
+        "PixelMeasuresSequence[0].PixelSpacing");
+    double *spacing;
+    ck_assert_int_eq(dcm_filehandle_extract_decimal(NULL, filehandle,
+                                                    0x52009229,
+                                                    spacing_path, 1,
+                                                    &spacing, &count),
+                     true);
+    ck_assert_uint_eq(count, 1);
+    ck_assert_double_eq_tol(spacing[0], 0.000499, 1e-9);
+    dcm_free(spacing);
+
+    // out of range values are errors
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_extract_decimal(&error, filehandle,
+                                                    0x52009229,
+                                                    spacing_path, 2,
+                                                    &spacing, &count),
+                     false);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+
+    // the filehandle is still usable
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+
+    dcm_path_destroy(spacing_path);
+    dcm_path_destroy(pointer_path);
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+struct ParseCounts {
+    DcmParseControl on_sequence;
+    DcmParseControl on_item;
+    uint32_t stop_tag;
+    uint32_t n_elements;
+    uint32_t n_toplevel;
+    uint32_t n_sequences;
+    uint32_t n_items;
+    uint32_t n_fragments;
+    uint32_t max_depth;
+    int64_t last_offset;
+};
+
+
+static DcmParseControl count_element_begin(DcmError **error,
+                                           void *client,
+                                           const DcmParseInfo *info)
+{
+    struct ParseCounts *counts = (struct ParseCounts *) client;
+
+    (void) error;
+
+    if (info->tag == counts->stop_tag) {
+        return DCM_PARSE_STOP;
+    }
+
+    // offsets only ever increase
+    ck_assert_int_gt(info->offset, counts->last_offset);
+    ck_assert_int_gt(info->value_offset, info->offset);
+    counts->last_offset = info->offset;
+
+    counts->n_elements += 1;
+    if (info->depth == 0) {
+        counts->n_toplevel += 1;
+    }
+    counts->max_depth = info->depth > counts->max_depth ?
+        info->depth : counts->max_depth;
+    if (info->vr == DCM_VR_SQ) {
+        counts->n_sequences += 1;
+        return counts->on_sequence;
+    }
+
+    return DCM_PARSE_CONTINUE;
+}
+
+
+static DcmParseControl count_item_begin(DcmError **error,
+                                        void *client,
+                                        const DcmParseInfo *info)
+{
+    struct ParseCounts *counts = (struct ParseCounts *) client;
+
+    (void) error;
+
+    ck_assert_uint_eq(info->tag, 0xFFFEE000);
+    ck_assert_uint_gt(info->depth, 0);
+    counts->n_items += 1;
+
+    return counts->on_item;
+}
+
+
+static DcmParseControl count_item_value(DcmError **error,
+                                        void *client,
+                                        const DcmParseInfo *info,
+                                        const char *value)
+{
+    struct ParseCounts *counts = (struct ParseCounts *) client;
+
+    (void) error;
+    (void) value;
+
+    ck_assert_uint_eq(info->index, counts->n_fragments);
+    counts->n_fragments += 1;
+
+    return DCM_PARSE_CONTINUE;
+}
+
+
+START_TEST(test_file_sm_image_parse)
+{
+    DcmParseCallbacks callbacks = {
+        .version = DCM_PARSE_VERSION,
+        .element_begin = count_element_begin,
+        .item_begin = count_item_begin,
+        .item_value = count_item_value,
+    };
+
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    struct ParseCounts all = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_CONTINUE,
+    };
+    ck_assert_int_eq(dcm_filehandle_parse(NULL, filehandle,
+                                          &callbacks, &all), true);
+    ck_assert_uint_gt(all.n_items, 0);
+    ck_assert_uint_gt(all.max_depth, 0);
+    // pixel data is native, so there are no fragments
+    ck_assert_uint_eq(all.n_fragments, 0);
+
+    // skipping sequence bodies should hide everything below the top level
+    struct ParseCounts skip = {
+        .on_sequence = DCM_PARSE_SKIP_BODY,
+        .on_item = DCM_PARSE_CONTINUE,
+    };
+    ck_assert_int_eq(dcm_filehandle_parse(NULL, filehandle,
+                                          &callbacks, &skip), true);
+    ck_assert_uint_eq(skip.n_toplevel, all.n_toplevel);
+    ck_assert_uint_eq(skip.n_elements, all.n_toplevel);
+    ck_assert_uint_eq(skip.n_items, 0);
+    ck_assert_uint_eq(skip.max_depth, 0);
+
+    // skipping the sequence from the first item should see at most one item
+    // per top-level sequence
+    struct ParseCounts first = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_SKIP_SEQUENCE,
+    };
+    ck_assert_int_eq(dcm_filehandle_parse(NULL, filehandle,
+                                          &callbacks, &first), true);
+    ck_assert_uint_eq(first.n_toplevel, all.n_toplevel);
+    ck_assert_uint_le(first.n_items, first.n_sequences);
+    ck_assert_uint_lt(first.n_items, all.n_items);
+    ck_assert_uint_eq(first.max_depth, 0);
+
+    // stop before pixel data
+    struct ParseCounts stop = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_CONTINUE,
+        .stop_tag = 0x7FE00010,
+    };
+    ck_assert_int_eq(dcm_filehandle_parse(NULL, filehandle,
+                                          &callbacks, &stop), true);
+    ck_assert_uint_eq(stop.n_elements, all.n_elements - 1);
+
+    // bad version
+    DcmError *error = NULL;
+    callbacks.version = DCM_PARSE_VERSION + 1;
+    ck_assert_int_eq(dcm_filehandle_parse(&error, filehandle,
+                                          &callbacks, &all), false);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+static bool feed_parser(DcmParser *parser,
+                        const char *data,
+                        int64_t length,
+                        int64_t chunk_size)
+{
+    for (int64_t i = 0; i < length; i += chunk_size) {
+        int64_t n = length - i < chunk_size ? length - i : chunk_size;
+        if (!dcm_parser_feed(NULL, parser, data + i, n)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+START_TEST(test_file_sm_image_borrowed)
+{
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image.dcm", &length);
+    ck_assert_ptr_nonnull(memory);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmPath *path = dcm_path_compile(NULL, "OpticalPathSequence[0].ICCProfile");
+    ck_assert_ptr_nonnull(path);
+
+    // binary values in the metadata the filehandle keeps are used in place
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(NULL, filehandle);
+    ck_assert_ptr_nonnull(metadata);
+    DcmElement *element = dcm_path_eval(metadata, path);
+    ck_assert_ptr_nonnull(element);
+    const void *value;
+    ck_assert_int_eq(dcm_element_get_value_binary(NULL, element, &value),
+                     true);
+    ck_assert((const char *) value >= memory &&
+              (const char *) value < memory + length);
+
+    dcm_filehandle_destroy(filehandle);
+
+    // but metadata we own has a copy
+    filehandle = dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *copy = dcm_filehandle_read_metadata(NULL, filehandle, NULL);
+    ck_assert_ptr_nonnull(copy);
+    element = dcm_path_eval(copy, path);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_int_eq(dcm_element_get_value_binary(NULL, element, &value),
+                     true);
+    ck_assert((const char *) value < memory ||
+              (const char *) value >= memory + length);
+
+    dcm_dataset_destroy(copy);
+    dcm_path_destroy(path);
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_bulk)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *full = dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(full);
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmDataSet *expected = dcm_filehandle_read_metadata(NULL, full, NULL);
+    ck_assert_ptr_nonnull(expected);
+
+    // large binary values are left in the file until we ask for them
+    dcm_filehandle_set_bulk_threshold(filehandle, 1024);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+
+    DcmPath *path = dcm_path_compile(NULL, "OpticalPathSequence[0].ICCProfile");
+    ck_assert_ptr_nonnull(path);
+    DcmElement *want = dcm_path_eval(expected, path);
+    ck_assert_ptr_nonnull(want);
+    DcmElement *element = dcm_path_eval(metadata, path);
+    ck_assert_ptr_nonnull(element);
+    uint32_t length = dcm_element_get_length(element);
+    ck_assert_uint_eq(length, dcm_element_get_length(want));
+    ck_assert_uint_ge(length, 1024);
+
+    const void *want_value;
+    ck_assert_int_eq(dcm_element_get_value_binary(NULL, want, &want_value),
+                     true);
+
+    // stream part of the value
+    char buffer[100];
+    ck_assert_int_eq(dcm_element_read_value_binary(NULL, element,
+                                                   length - 100,
+                                                   buffer, 100), true);
+    ck_assert_mem_eq(buffer, (const char *) want_value + length - 100, 100);
+    ck_assert_int_eq(dcm_element_read_value_binary(NULL, element,
+                                                   length - 99,
+                                                   buffer, 100), false);
+
+    // a clone can fetch the value too
+    DcmElement *clone = dcm_element_clone(NULL, element);
+    ck_assert_ptr_nonnull(clone);
+
+    const void *value;
+    ck_assert_int_eq(dcm_element_get_value_binary(NULL, element, &value),
+                     true);
+    ck_assert_mem_eq(value, want_value, length);
+    ck_assert_int_eq(dcm_element_get_value_binary(NULL, clone, &value),
+                     true);
+    ck_assert_mem_eq(value, want_value, length);
+
+    // reading values doesn't disturb the read point
+    ck_assert_ptr_nonnull(dcm_filehandle_get_metadata_subset(NULL,
+                                                             filehandle));
+
+    dcm_element_destroy(clone);
+    dcm_path_destroy(path);
+    dcm_dataset_destroy(metadata);
+    dcm_dataset_destroy(expected);
+    dcm_filehandle_destroy(filehandle);
+    dcm_filehandle_destroy(full);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_lazy_sequences)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *full = dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(full);
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmDataSet *expected = dcm_filehandle_read_metadata(NULL, full, NULL);
+    ck_assert_ptr_nonnull(expected);
+
+    // sequences are skipped, and read when we first ask for them
+    dcm_filehandle_set_lazy_sequences(filehandle, true);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+
+    DcmElement *want = dcm_dataset_get(NULL,
+                                       expected,
+                                       DCM_TAG_SpecimenDescriptionSequence);
+    ck_assert_ptr_nonnull(want);
+    DcmElement *element =
+        dcm_dataset_get(NULL, metadata, DCM_TAG_SpecimenDescriptionSequence);
+    ck_assert_ptr_nonnull(element);
+
+    DcmSequence *want_seq;
+    ck_assert_int_eq(dcm_element_get_value_sequence(NULL, want, &want_seq),
+                     true);
+    DcmSequence *seq;
+    ck_assert_int_eq(dcm_element_get_value_sequence(NULL, element, &seq),
+                     true);
+    ck_assert_uint_eq(dcm_sequence_count(seq), dcm_sequence_count(want_seq));
+
+    // the same sequence the second time
+    DcmSequence *again;
+    ck_assert_int_eq(dcm_element_get_value_sequence(NULL, element, &again),
+                     true);
+    ck_assert_ptr_eq(seq, again);
+
+    // paths load sequences too
+    DcmPath *path = dcm_path_compile(NULL, "OpticalPathSequence[0].ICCProfile");
+    ck_assert_ptr_nonnull(path);
+    DcmElement *profile = dcm_path_eval(metadata, path);
+    ck_assert_ptr_nonnull(profile);
+    ck_assert_uint_eq(dcm_element_get_length(profile),
+                      dcm_element_get_length(dcm_path_eval(expected, path)));
+
+    // reading sequences doesn't disturb the read point
+    ck_assert_ptr_nonnull(dcm_filehandle_get_metadata_subset(NULL,
+                                                             filehandle));
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    ck_assert_ptr_nonnull(frame);
+    dcm_frame_destroy(frame);
+
+    dcm_path_destroy(path);
+    dcm_dataset_destroy(metadata);
+    dcm_dataset_destroy(expected);
+    dcm_filehandle_destroy(filehandle);
+    dcm_filehandle_destroy(full);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_toc)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    ck_assert_ptr_null(dcm_filehandle_find_toc_entry(filehandle,
+                                                     DCM_TAG_Modality));
+
+    uint32_t length;
+    const DcmParseInfo *toc = dcm_filehandle_build_toc(NULL,
+                                                       filehandle,
+                                                       &length);
+    ck_assert_ptr_nonnull(toc);
+    ck_assert_uint_gt(length, 1);
+    for (uint32_t i = 1; i < length; i++) {
+        ck_assert_uint_lt(toc[i - 1].tag, toc[i].tag);
+        ck_assert_uint_eq(toc[i].depth, 0);
+    }
+
+    const DcmParseInfo *entry =
+        dcm_filehandle_find_toc_entry(filehandle, DCM_TAG_PixelData);
+    ck_assert_ptr_nonnull(entry);
+    ck_assert_ptr_eq(entry, &toc[length - 1]);
+    ck_assert_ptr_null(dcm_filehandle_find_toc_entry(filehandle, 0x00090010));
+
+    // read elements directly, and get the same values as a full read
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(NULL, filehandle);
+    ck_assert_ptr_nonnull(metadata);
+
+    DcmElement *element = dcm_filehandle_read_element(NULL,
+                                                      filehandle,
+                                                      DCM_TAG_Modality);
+    ck_assert_ptr_nonnull(element);
+    const char *value;
+    ck_assert_int_eq(dcm_element_get_value_string(NULL, element, 0, &value),
+                     true);
+    ck_assert_str_eq(value, "SM");
+    dcm_element_destroy(element);
+
+    element = dcm_filehandle_read_element(NULL,
+                                          filehandle,
+                                          DCM_TAG_OpticalPathSequence);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *seq;
+    ck_assert_int_eq(dcm_element_get_value_sequence(NULL, element, &seq),
+                     true);
+    ck_assert_uint_eq(dcm_sequence_count(seq), 1);
+    dcm_element_destroy(element);
+
+    ck_assert_ptr_null(dcm_filehandle_read_element(NULL,
+                                                   filehandle,
+                                                   0x00090010));
+
+    // and the read point is where the subset left it
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    ck_assert_ptr_nonnull(frame);
+    dcm_frame_destroy(frame);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_parser)
+{
+    DcmParseCallbacks callbacks = {
+        .version = DCM_PARSE_VERSION,
+        .element_begin = count_element_begin,
+        .item_begin = count_item_begin,
+        .item_value = count_item_value,
+    };
+
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    struct ParseCounts all = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_CONTINUE,
+    };
+    ck_assert_int_eq(dcm_filehandle_parse(NULL, filehandle,
+                                          &callbacks, &all), true);
+    dcm_filehandle_destroy(filehandle);
+
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image.dcm", &length);
+    ck_assert_ptr_nonnull(memory);
+
+    // the Data Set follows the preamble, the prefix and the File Meta group
+    uint32_t group_length;
+    memcpy(&group_length, memory + 140, 4);
+    int64_t start = 144 + group_length;
+
+    // the same events, whatever the chunk size
+    int64_t chunk_sizes[] = {1, 7, 4096};
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+        struct ParseCounts push = {
+            .on_sequence = DCM_PARSE_CONTINUE,
+            .on_item = DCM_PARSE_CONTINUE,
+            .last_offset = -1,
+        };
+        DcmParser *parser = dcm_parser_create(NULL, NULL, &callbacks, &push);
+        ck_assert_ptr_nonnull(parser);
+        ck_assert_int_eq(feed_parser(parser, memory + start, length - start,
+                                     chunk_sizes[i]), true);
+        ck_assert_int_eq(dcm_parser_finish(NULL, parser), true);
+        ck_assert_uint_eq(push.n_elements, all.n_elements);
+        ck_assert_uint_eq(push.n_toplevel, all.n_toplevel);
+        ck_assert_uint_eq(push.n_items, all.n_items);
+        ck_assert_uint_eq(push.max_depth, all.max_depth);
+        dcm_parser_destroy(parser);
+    }
+
+    // skipped sequences are discarded as they arrive
+    struct ParseCounts skip = {
+        .on_sequence = DCM_PARSE_SKIP_BODY,
+        .on_item = DCM_PARSE_CONTINUE,
+        .last_offset = -1,
+    };
+    DcmParser *parser = dcm_parser_create(NULL, NULL, &callbacks, &skip);
+    ck_assert_int_eq(feed_parser(parser, memory + start, length - start, 3),
+                     true);
+    ck_assert_int_eq(dcm_parser_finish(NULL, parser), true);
+    ck_assert_uint_eq(skip.n_elements, all.n_toplevel);
+    ck_assert_uint_eq(skip.n_items, 0);
+    dcm_parser_destroy(parser);
+
+    // stop before pixel data, then keep feeding ... the rest of the input
+    // is ignored
+    struct ParseCounts stop = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_CONTINUE,
+        .stop_tag = 0x7FE00010,
+        .last_offset = -1,
+    };
+    parser = dcm_parser_create(NULL, NULL, &callbacks, &stop);
+    ck_assert_int_eq(feed_parser(parser, memory + start, length - start, 5),
+                     true);
+    ck_assert_uint_eq(stop.n_elements, all.n_elements - 1);
+    ck_assert_int_eq(feed_parser(parser, memory, length, 5), true);
+    ck_assert_int_eq(dcm_parser_finish(NULL, parser), true);
+    ck_assert_uint_eq(stop.n_elements, all.n_elements - 1);
+    dcm_parser_destroy(parser);
+
+    // input truncated in the middle of the Pixel Data header fails at the
+    // end
+    DcmError *error = NULL;
+    struct ParseCounts truncated = {
+        .on_sequence = DCM_PARSE_CONTINUE,
+        .on_item = DCM_PARSE_CONTINUE,
+        .last_offset = -1,
+    };
+    parser = dcm_parser_create(NULL, NULL, &callbacks, &truncated);
+    ck_assert_int_eq(feed_parser(parser, memory + start,
+                                 length - start - 7500 - 6, 100), true);
+    ck_assert_int_eq(dcm_parser_finish(&error, parser), false);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_IO);
+    dcm_error_clear(&error);
+    dcm_parser_destroy(parser);
+
+    // only little endian, uncompressed or encapsulated
+    parser = dcm_parser_create(NULL, "1.2.840.10008.1.2.4.50",
+                               &callbacks, &all);
+    ck_assert_ptr_nonnull(parser);
+    dcm_parser_destroy(parser);
+    const char *unsupported[] = {
+        "1.2.840.10008.1.2.2",
+        "1.2.840.10008.1.2.1.99",
+    };
+    for (size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++) {
+        parser = dcm_parser_create(&error, unsupported[i], &callbacks, &all);
+        ck_assert_ptr_null(parser);
+        ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+        dcm_error_clear(&error);
+    }
+
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_reader)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // walk the whole file, checking that events nest correctly
+    DcmReader *reader = dcm_filehandle_create_reader(NULL, filehandle);
+    ck_assert_ptr_nonnull(reader);
+    DcmReaderEvent event;
+    uint32_t depth = 0;
+    uint32_t n_elements = 0;
+    uint16_t rows = 0;
+    do {
+        ck_assert_int_eq(dcm_reader_next(NULL, reader, &event), true);
+        switch (event.type) {
+            case DCM_READER_EVENT_ELEMENT:
+                ck_assert_uint_eq(event.info.depth, depth / 2);
+                n_elements += 1;
+                if (event.info.tag == 0x00280010) {
+                    const char *value = dcm_reader_get_value(NULL, reader);
+                    ck_assert_ptr_nonnull(value);
+                    memcpy(&rows, value, sizeof(rows));
+                }
+                break;
+
+            case DCM_READER_EVENT_SEQUENCE_BEGIN:
+            case DCM_READER_EVENT_ITEM_BEGIN:
+                depth += 1;
+                break;
+
+            case DCM_READER_EVENT_SEQUENCE_END:
+            case DCM_READER_EVENT_ITEM_END:
+                ck_assert_uint_gt(depth, 0);
+                depth -= 1;
+                break;
+
+            default:
+                break;
+        }
+    } while (event.type != DCM_READER_EVENT_END);
+    ck_assert_uint_eq(depth, 0);
+    ck_assert_uint_gt(n_elements, 0);
+    ck_assert_uint_eq(rows, 10);
+    dcm_reader_destroy(reader);
+
+    // skip every sequence body, and we should only see the top level
+    reader = dcm_filehandle_create_reader(NULL, filehandle);
+    ck_assert_ptr_nonnull(reader);
+    do {
+        ck_assert_int_eq(dcm_reader_next(NULL, reader, &event), true);
+        ck_assert_uint_eq(event.info.depth, 0);
+        ck_assert_int_ne(event.type, DCM_READER_EVENT_SEQUENCE_END);
+        if (event.type == DCM_READER_EVENT_SEQUENCE_BEGIN) {
+            ck_assert_int_eq(dcm_reader_skip_body(NULL, reader), true);
+        }
+    } while (event.type != DCM_READER_EVENT_END);
+    dcm_reader_destroy(reader);
+
+    // skip the rest of the first item we enter
+    reader = dcm_filehandle_create_reader(NULL, filehandle);
+    ck_assert_ptr_nonnull(reader);
+    do {
+        ck_assert_int_eq(dcm_reader_next(NULL, reader, &event), true);
+    } while (event.type != DCM_READER_EVENT_ITEM_BEGIN);
+    ck_assert_int_eq(dcm_reader_next(NULL, reader, &event), true);
+    ck_assert_int_eq(dcm_reader_skip_item(NULL, reader), true);
+    ck_assert_int_eq(dcm_reader_next(NULL, reader, &event), true);
+    ck_assert_int_eq(event.type, DCM_READER_EVENT_ITEM_END);
+    dcm_reader_destroy(reader);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_bind)
+{
+    struct Record {
+        uint16_t rows;
+        uint32_t number_of_frames;
+        double pixel_spacing[2];
+        char image_type[4][17];
+        char photometric_interpretation[17];
+        int32_t patient_size;
+    } record = {
+        .patient_size = -1,
+    };
+    DcmBinding bindings[] = {
+        { "Rows", DCM_VR_US, offsetof(struct Record, rows), 0, 1, true },
+        { "NumberOfFrames", DCM_VR_UL,
+          offsetof(struct Record, number_of_frames), 0, 1, true },
+        { "SharedFunctionalGroupsSequence[0]."
+          "PixelMeasuresSequence[0].PixelSpacing", DCM_VR_FD,
+          offsetof(struct Record, pixel_spacing), 0, 2, true },
+        { "ImageType", DCM_VR_CS,
+          offsetof(struct Record, image_type), 17, 4, true },
+        { "PhotometricInterpretation", DCM_VR_CS,
+          offsetof(struct Record, photometric_interpretation), 17, 1, true },
+        // not in the file, so left unchanged
+        { "PatientSize", DCM_VR_SL,
+          offsetof(struct Record, patient_size), 0, 1, false },
+    };
+    uint32_t n_bindings = sizeof(bindings) / sizeof(bindings[0]);
+
+    DcmSchema *schema = dcm_schema_create(NULL, bindings, n_bindings);
+    ck_assert_ptr_nonnull(schema);
+
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    ck_assert_int_eq(dcm_filehandle_bind(NULL, filehandle, schema, &record),
+                     true);
+    ck_assert_uint_eq(record.rows, 10);
+    ck_assert_uint_eq(record.number_of_frames, 25);
+    ck_assert_double_eq_tol(record.pixel_spacing[0], 0.000499, 1e-9);
+    ck_assert_double_eq_tol(record.pixel_spacing[1], 0.000499, 1e-9);
+    ck_assert_str_eq(record.image_type[0], "ORIGINAL");
+    ck_assert_str_eq(record.image_type[3], "NONE");
+    ck_assert_str_eq(record.photometric_interpretation, "RGB");
+    ck_assert_int_eq(record.patient_size, -1);
+    dcm_schema_destroy(schema);
+
+    // an optional field with more values than the element has is left
+    // unchanged
+    double spacing[3] = {-1.0, -1.0, -1.0};
+    DcmBinding short_vm[] = {
+        { "SharedFunctionalGroupsSequence[0]."
+          "PixelMeasuresSequence[0].PixelSpacing", DCM_VR_FD,
+          0, 0, 3, false },
+    };
+    schema = dcm_schema_create(NULL, short_vm, 1);
+    ck_assert_ptr_nonnull(schema);
+    ck_assert_int_eq(dcm_filehandle_bind(NULL, filehandle, schema, spacing),
+                     true);
+    ck_assert_double_eq(spacing[0], -1.0);
+    ck_assert_double_eq(spacing[1], -1.0);
+    ck_assert_double_eq(spacing[2], -1.0);
+    dcm_schema_destroy(schema);
+
+    // a missing required element is an error
+    DcmBinding required[] = {
+        { "PatientSize", DCM_VR_SL, 0, 0, 1, true },
+    };
+    schema = dcm_schema_create(NULL, required, 1);
+    ck_assert_ptr_nonnull(schema);
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_bind(&error, filehandle, schema, &record),
+                     false);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    dcm_schema_destroy(schema);
+
+    // strings need a size
+    DcmBinding bad[] = {
+        { "PhotometricInterpretation", DCM_VR_CS, 0, 0, 1, true },
+    };
+    ck_assert_ptr_null(dcm_schema_create(NULL, bad, 1));
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
 START_TEST(test_file_sm_image_frame)
 {
     const uint32_t frame_number = 1;
@@ -735,6 +1742,507 @@ START_TEST(test_file_sm_image_frame)
 END_TEST
 
 
+START_TEST(test_file_sm_image_frame_cache)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // room for two 300 byte frames
+    ck_assert_int_eq(dcm_filehandle_set_frame_cache(NULL, filehandle, 600),
+                     true);
+
+    DcmFrame *frame1 = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    ck_assert_ptr_nonnull(frame1);
+    ck_assert_uint_eq(dcm_frame_get_length(frame1), 300);
+    DcmFrame *frame2 = dcm_filehandle_read_frame(NULL, filehandle, 2);
+    ck_assert_ptr_nonnull(frame2);
+    dcm_frame_destroy(frame2);
+
+    // a hit returns the same frame, and it outlives our references
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    ck_assert_ptr_eq(frame, frame1);
+    dcm_frame_destroy(frame1);
+    ck_assert_uint_eq(dcm_frame_get_number(frame), 1);
+    dcm_frame_destroy(frame);
+
+    // frame 2 is now the least recently used, so 3 replaces it
+    frame = dcm_filehandle_read_frame(NULL, filehandle, 3);
+    ck_assert_ptr_nonnull(frame);
+    dcm_frame_destroy(frame);
+    frame = dcm_filehandle_read_frame(NULL, filehandle, 2);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_uint_eq(dcm_frame_get_number(frame), 2);
+    dcm_frame_destroy(frame);
+
+    uint64_t hits;
+    uint64_t misses;
+    dcm_filehandle_get_frame_cache_stats(filehandle, &hits, &misses);
+    ck_assert_uint_eq(hits, 1);
+    ck_assert_uint_eq(misses, 4);
+
+    // errors are not cached
+    ck_assert_ptr_null(dcm_filehandle_read_frame(NULL, filehandle, 26));
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_shared_frame_cache)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle1 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    DcmFilehandle *filehandle2 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle2);
+    free(file_path);
+
+    ck_assert_int_eq(dcm_shared_frame_cache_set_budget(NULL, 1024 * 1024),
+                     true);
+    ck_assert_int_eq(dcm_filehandle_set_shared_frame_cache(NULL,
+                                                           filehandle1,
+                                                           true), true);
+    ck_assert_int_eq(dcm_filehandle_set_shared_frame_cache(NULL,
+                                                           filehandle2,
+                                                           true), true);
+
+    uint64_t hits_before;
+    uint64_t misses_before;
+    dcm_shared_frame_cache_get_stats(&hits_before, &misses_before);
+
+    // the second filehandle gets the frame the first one read
+    DcmFrame *frame1 = dcm_filehandle_read_frame(NULL, filehandle1, 5);
+    ck_assert_ptr_nonnull(frame1);
+    DcmFrame *frame2 = dcm_filehandle_read_frame(NULL, filehandle2, 5);
+    ck_assert_ptr_eq(frame1, frame2);
+    dcm_frame_destroy(frame2);
+
+    uint64_t hits;
+    uint64_t misses;
+    dcm_shared_frame_cache_get_stats(&hits, &misses);
+    ck_assert_uint_eq(hits - hits_before, 1);
+    ck_assert_uint_eq(misses - misses_before, 1);
+
+    // emptying the cache leaves our frame valid
+    ck_assert_int_eq(dcm_shared_frame_cache_set_budget(NULL, 0), true);
+    ck_assert_uint_eq(dcm_frame_get_number(frame1), 5);
+    ck_assert_uint_eq(dcm_frame_get_length(frame1), 300);
+    dcm_frame_destroy(frame1);
+
+    frame2 = dcm_filehandle_read_frame(NULL, filehandle2, 5);
+    ck_assert_ptr_nonnull(frame2);
+    dcm_frame_destroy(frame2);
+
+    // the budget is for the whole cache, so two 300 byte frames fit, but no
+    // more
+    ck_assert_int_eq(dcm_shared_frame_cache_set_budget(NULL, 600), true);
+    for (uint32_t i = 1; i <= 6; i++) {
+        frame1 = dcm_filehandle_read_frame(NULL, filehandle1, i);
+        ck_assert_ptr_nonnull(frame1);
+        dcm_frame_destroy(frame1);
+    }
+    dcm_shared_frame_cache_get_stats(&hits_before, &misses_before);
+    frame2 = dcm_filehandle_read_frame(NULL, filehandle2, 6);
+    ck_assert_ptr_nonnull(frame2);
+    dcm_frame_destroy(frame2);
+    for (uint32_t i = 1; i <= 5; i++) {
+        frame2 = dcm_filehandle_read_frame(NULL, filehandle2, i);
+        ck_assert_ptr_nonnull(frame2);
+        dcm_frame_destroy(frame2);
+    }
+    dcm_shared_frame_cache_get_stats(&hits, &misses);
+    ck_assert_uint_ge(hits - hits_before, 1);
+    ck_assert_uint_le(hits - hits_before, 2);
+    ck_assert_int_eq(dcm_shared_frame_cache_set_budget(NULL, 0), true);
+
+    dcm_filehandle_destroy(filehandle1);
+    dcm_filehandle_destroy(filehandle2);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_prefetch_frames)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    free(file_path);
+
+    // a run, a gap, and the last frame
+    uint32_t frame_numbers[] = {3, 4, 5, 9, 25};
+    ck_assert_int_eq(dcm_filehandle_prefetch_frames(NULL,
+                                                    filehandle,
+                                                    frame_numbers,
+                                                    5), true);
+
+    // prefetching leaves the read point alone
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, 4);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_uint_eq(dcm_frame_get_number(frame), 4);
+    dcm_frame_destroy(frame);
+
+    uint32_t bad_numbers[] = {1, 26};
+    ck_assert_int_eq(dcm_filehandle_prefetch_frames(NULL,
+                                                    filehandle,
+                                                    bad_numbers,
+                                                    2), false);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_prefetch_position)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    free(file_path);
+
+    ck_assert_int_eq(dcm_filehandle_set_prefetch(NULL, filehandle, 6), true);
+
+    // a pan right, then down, then a jump back to the top corner ... the
+    // hints must never disturb the frames we read
+    uint32_t positions[][2] = {
+        {0, 0}, {1, 0}, {2, 0}, {2, 1}, {2, 2}, {0, 0},
+    };
+    for (size_t i = 0; i < sizeof(positions) / sizeof(positions[0]); i++) {
+        uint32_t frame_number;
+        ck_assert_int_eq(dcm_filehandle_get_frame_number(NULL,
+                                                         filehandle,
+                                                         positions[i][0],
+                                                         positions[i][1],
+                                                         &frame_number),
+                         true);
+        DcmFrame *frame = dcm_filehandle_read_frame_position(NULL,
+                                                             filehandle,
+                                                             positions[i][0],
+                                                             positions[i][1]);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_uint_eq(dcm_frame_get_number(frame), frame_number);
+        dcm_frame_destroy(frame);
+    }
+
+    ck_assert_int_eq(dcm_filehandle_set_prefetch(NULL, filehandle, 0), true);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+// a batch read must give the same frames as reading them one by one
+static void check_read_frames(const char *filename,
+                              const uint32_t *frame_numbers,
+                              uint32_t n_frames)
+{
+    char *file_path = fixture_path(filename);
+    DcmFilehandle *filehandle1 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    DcmFilehandle *filehandle2 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle2);
+    free(file_path);
+
+    DcmFrame *frames[32];
+    ck_assert_uint_le(n_frames, 32);
+    ck_assert_int_eq(dcm_filehandle_read_frames(NULL,
+                                                filehandle1,
+                                                frame_numbers,
+                                                n_frames,
+                                                frames), true);
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                    filehandle2,
+                                                    frame_numbers[i]);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_number(frames[i]), frame_numbers[i]);
+        ck_assert_uint_eq(dcm_frame_get_length(frames[i]),
+                          dcm_frame_get_length(frame));
+        ck_assert_mem_eq(dcm_frame_get_value(frames[i]),
+                         dcm_frame_get_value(frame),
+                         dcm_frame_get_length(frame));
+        dcm_frame_destroy(frame);
+        dcm_frame_destroy(frames[i]);
+    }
+
+    // all or nothing
+    uint32_t bad_numbers[] = {1, 0};
+    ck_assert_int_eq(dcm_filehandle_read_frames(NULL,
+                                                filehandle1,
+                                                bad_numbers,
+                                                2,
+                                                frames), false);
+    ck_assert_ptr_null(frames[0]);
+    ck_assert_ptr_null(frames[1]);
+
+    dcm_filehandle_destroy(filehandle1);
+    dcm_filehandle_destroy(filehandle2);
+}
+
+
+START_TEST(test_file_read_frames)
+{
+    // out of order, a repeat, and the last frame
+    uint32_t sm_numbers[] = {25, 3, 4, 3, 1, 12};
+    check_read_frames("data/test_files/sm_image.dcm", sm_numbers, 6);
+
+    // we can't batch the last encapsulated frame, so it's read on its own
+    uint32_t encapsulated_numbers[] = {2, 1};
+    check_read_frames("data/test_files/generated_encapsulated_defined_bot_2_to_2.dcm",
+                      encapsulated_numbers,
+                      2);
+}
+END_TEST
+
+
+static void record_frame(DcmError *error, DcmFrame *frame, void *user)
+{
+    uint32_t *number = (uint32_t *) user;
+
+    // we're on a worker thread, so we check results later
+    *number = error ? 0 : dcm_frame_get_number(frame);
+    dcm_frame_destroy(frame);
+}
+
+
+START_TEST(test_file_sm_image_read_frame_async)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle1 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    DcmFilehandle *filehandle2 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle2);
+    free(file_path);
+
+    DcmCompletionQueue *queue = dcm_completion_queue_create(NULL);
+    ck_assert_ptr_nonnull(queue);
+
+    // every frame, plus one which does not exist
+    for (uint32_t i = 1; i <= 26; i++) {
+        void *user = (void *) (uintptr_t) i;
+        ck_assert_int_eq(dcm_filehandle_read_frame_queued(NULL,
+                                                          filehandle1,
+                                                          i,
+                                                          queue,
+                                                          user), true);
+    }
+
+    uint32_t n_frames = 0;
+    uint32_t n_errors = 0;
+    DcmFrame *frame;
+    DcmError *error = NULL;
+    void *user;
+    while (dcm_completion_queue_next(queue, true, &frame, &error, &user)) {
+        if (frame) {
+            ck_assert_uint_eq(dcm_frame_get_number(frame), (uintptr_t) user);
+            ck_assert_uint_eq(dcm_frame_get_length(frame), 300);
+            dcm_frame_destroy(frame);
+            n_frames += 1;
+        } else {
+            ck_assert_ptr_nonnull(error);
+            ck_assert_uint_eq((uintptr_t) user, 26);
+            dcm_error_clear(&error);
+            n_errors += 1;
+        }
+    }
+    ck_assert_uint_eq(n_frames, 25);
+    ck_assert_uint_eq(n_errors, 1);
+    dcm_completion_queue_destroy(queue);
+
+    // destroy waits for the callbacks, so we can check their results after
+    uint32_t numbers[2] = {0, 0};
+    ck_assert_int_eq(dcm_filehandle_read_frame_async(NULL,
+                                                     filehandle2,
+                                                     7,
+                                                     record_frame,
+                                                     &numbers[0]), true);
+    ck_assert_int_eq(dcm_filehandle_read_frame_async(NULL,
+                                                     filehandle2,
+                                                     8,
+                                                     record_frame,
+                                                     &numbers[1]), true);
+    dcm_filehandle_destroy(filehandle2);
+    ck_assert_uint_eq(numbers[0], 7);
+    ck_assert_uint_eq(numbers[1], 8);
+
+    dcm_filehandle_destroy(filehandle1);
+}
+END_TEST
+
+
+#ifdef HAVE_SHM_OPEN
+START_TEST(test_file_sm_image_shm_frame_cache)
+{
+    const char *name = "/libdicom-check-frames";
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle1 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    DcmFilehandle *filehandle2 =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle2);
+    free(file_path);
+
+    // a failed earlier run may have left the cache behind
+    (void) dcm_shm_frame_cache_unlink(NULL, name);
+
+    // as if from two processes ... the second open attaches to the
+    // cache the first created
+    DcmShmFrameCache *cache1 = dcm_shm_frame_cache_open(NULL, name, 8, 1024);
+    ck_assert_ptr_nonnull(cache1);
+    DcmShmFrameCache *cache2 = dcm_shm_frame_cache_open(NULL, name, 1, 1);
+    ck_assert_ptr_nonnull(cache2);
+
+    ck_assert_int_eq(dcm_filehandle_set_shm_frame_cache(NULL,
+                                                        filehandle1,
+                                                        cache1), true);
+    ck_assert_int_eq(dcm_filehandle_set_shm_frame_cache(NULL,
+                                                        filehandle2,
+                                                        cache2), true);
+
+    DcmFrame *frame1 = dcm_filehandle_read_frame(NULL, filehandle1, 5);
+    ck_assert_ptr_nonnull(frame1);
+    DcmFrame *frame2 = dcm_filehandle_read_frame(NULL, filehandle2, 5);
+    ck_assert_ptr_nonnull(frame2);
+    ck_assert_ptr_ne(frame1, frame2);
+    ck_assert_uint_eq(dcm_frame_get_number(frame2), 5);
+    ck_assert_uint_eq(dcm_frame_get_length(frame2), 300);
+    ck_assert_uint_eq(dcm_frame_get_rows(frame2),
+                      dcm_frame_get_rows(frame1));
+    ck_assert_mem_eq(dcm_frame_get_value(frame1),
+                     dcm_frame_get_value(frame2),
+                     300);
+    dcm_frame_destroy(frame1);
+    dcm_frame_destroy(frame2);
+
+    uint64_t hits;
+    uint64_t misses;
+    dcm_shm_frame_cache_get_stats(cache1, &hits, &misses);
+    ck_assert_uint_eq(hits, 1);
+    ck_assert_uint_eq(misses, 1);
+
+    dcm_filehandle_destroy(filehandle1);
+    dcm_filehandle_destroy(filehandle2);
+    dcm_shm_frame_cache_destroy(cache1);
+    dcm_shm_frame_cache_destroy(cache2);
+    ck_assert_int_eq(dcm_shm_frame_cache_unlink(NULL, name), true);
+}
+END_TEST
+
+
+// read frames into a shared memory cache until we are killed
+static void shm_writer(const char *name)
+{
+    char *ct_path = fixture_path("data/test_files/ct_brain_single.dcm");
+    char *sm_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *ct = dcm_filehandle_create_from_file(NULL, ct_path);
+    DcmFilehandle *sm = dcm_filehandle_create_from_file(NULL, sm_path);
+    DcmShmFrameCache *cache = dcm_shm_frame_cache_open(NULL,
+                                                       name,
+                                                       4,
+                                                       1024 * 1024);
+    if (ct == NULL ||
+        sm == NULL ||
+        cache == NULL ||
+        !dcm_filehandle_set_shm_frame_cache(NULL, ct, cache) ||
+        !dcm_filehandle_set_shm_frame_cache(NULL, sm, cache)) {
+        _exit(1);
+    }
+
+    // the large CT frame is evicted by each set of small ones, so most of
+    // our time is spent writing it to the cache
+    for (uint32_t i = 0; ; i++) {
+        dcm_frame_destroy(dcm_filehandle_read_frame(NULL, ct, 1));
+        for (uint32_t j = 0; j < 4; j++) {
+            uint32_t number = 1 + (i * 4 + j) % 20;
+            dcm_frame_destroy(dcm_filehandle_read_frame(NULL, sm, number));
+        }
+    }
+}
+
+
+START_TEST(test_file_shm_frame_cache_dead_writer)
+{
+    const char *name = "/libdicom-check-dead-writer";
+
+    (void) dcm_shm_frame_cache_unlink(NULL, name);
+
+    // four frames make a single bucket
+    DcmShmFrameCache *cache = dcm_shm_frame_cache_open(NULL,
+                                                       name,
+                                                       4,
+                                                       1024 * 1024);
+    ck_assert_ptr_nonnull(cache);
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    ck_assert_int_eq(dcm_filehandle_set_shm_frame_cache(NULL,
+                                                        filehandle,
+                                                        cache), true);
+
+    // each kill lands in a write only some of the time, so try a few
+    for (int round = 0; round < 30; round++) {
+        pid_t writer = fork();
+        ck_assert_int_ge(writer, 0);
+        if (writer == 0) {
+            shm_writer(name);
+        }
+
+        // kill the writer, most likely in the middle of a write
+        struct timespec pause = {0, (5 + round % 10) * 1000000L};
+        (void) nanosleep(&pause, NULL);
+        ck_assert_int_eq(kill(writer, SIGKILL), 0);
+        int status;
+        ck_assert_int_eq(waitpid(writer, &status, 0), writer);
+        ck_assert_int_eq(WIFSIGNALED(status), true);
+
+        // all four slots in the bucket take frames again
+        for (uint32_t number = 21; number <= 24; number++) {
+            DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                        filehandle,
+                                                        number);
+            ck_assert_ptr_nonnull(frame);
+            dcm_frame_destroy(frame);
+        }
+        uint64_t hits_before;
+        uint64_t misses_before;
+        dcm_shm_frame_cache_get_stats(cache, &hits_before, &misses_before);
+        for (uint32_t number = 21; number <= 24; number++) {
+            DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                        filehandle,
+                                                        number);
+            ck_assert_ptr_nonnull(frame);
+            ck_assert_uint_eq(dcm_frame_get_number(frame), number);
+            dcm_frame_destroy(frame);
+        }
+        uint64_t hits;
+        uint64_t misses;
+        dcm_shm_frame_cache_get_stats(cache, &hits, &misses);
+        ck_assert_uint_eq(hits - hits_before, 4);
+    }
+
+    dcm_filehandle_destroy(filehandle);
+    dcm_shm_frame_cache_destroy(cache);
+    ck_assert_int_eq(dcm_shm_frame_cache_unlink(NULL, name), true);
+}
+END_TEST
+#endif
+
+
 START_TEST(test_file_sm_image_file_meta_memory)
 {
     DcmElement *element;
@@ -922,6 +2430,105 @@ START_TEST(test_encapsulated_defined_BOT_2_to_2)
 END_TEST
 
 
+static char *put_bytes(char *p, const char *bytes, size_t length)
+{
+    memcpy(p, bytes, length);
+    return p + length;
+}
+
+
+START_TEST(test_parse_nesting_limit)
+{
+    // a file meta group with just the transfer syntax, explicit VR little
+    // endian
+    static const char meta[] =
+        "DICM"
+        "\x02\x00\x00\x00" "UL" "\x04\x00" "\x1c\x00\x00\x00"
+        "\x02\x00\x10\x00" "UI" "\x14\x00" "1.2.840.10008.1.2.1\0";
+    // Content Sequence, undefined length, and an item of undefined length
+    static const char level[] =
+        "\x40\x00\x30\xa7" "SQ" "\x00\x00" "\xff\xff\xff\xff"
+        "\xfe\xff\x00\xe0" "\xff\xff\xff\xff";
+    int n_levels = 1000;
+    size_t length = 128 + sizeof(meta) - 1 + n_levels * (sizeof(level) - 1);
+
+    char *memory = calloc(1, length);
+    ck_assert_ptr_nonnull(memory);
+    char *p = put_bytes(memory + 128, meta, sizeof(meta) - 1);
+    for (int i = 0; i < n_levels; i++) {
+        p = put_bytes(p, level, sizeof(level) - 1);
+    }
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // hostile nesting fails cleanly
+    DcmError *error = NULL;
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(&error, filehandle);
+    ck_assert_ptr_null(metadata);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_parse_trusted)
+{
+    static const char meta[] =
+        "DICM"
+        "\x02\x00\x00\x00" "UL" "\x04\x00" "\x1c\x00\x00\x00"
+        "\x02\x00\x10\x00" "UI" "\x14\x00" "1.2.840.10008.1.2.1\0";
+    // Rows, which should be US
+    static const char rows[] =
+        "\x28\x00\x10\x00" "UL" "\x04\x00" "\x00\x02\x00\x00";
+    size_t length = 128 + sizeof(meta) - 1 + sizeof(rows) - 1;
+
+    char *memory = calloc(1, length);
+    ck_assert_ptr_nonnull(memory);
+    char *p = put_bytes(memory + 128, meta, sizeof(meta) - 1);
+    (void) put_bytes(p, rows, sizeof(rows) - 1);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // the VR is checked against the dictionary by default
+    DcmError *error = NULL;
+    DcmDataSet *metadata =
+        dcm_filehandle_read_metadata(&error, filehandle, NULL);
+    ck_assert_ptr_null(metadata);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_destroy(filehandle);
+
+    // but not for trusted files
+    filehandle = dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_trusted(filehandle, true);
+    metadata = dcm_filehandle_read_metadata(NULL, filehandle, NULL);
+    ck_assert_ptr_nonnull(metadata);
+
+    DcmElement *element = dcm_dataset_get(NULL, metadata, DCM_TAG_Rows);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_int_eq(dcm_element_get_vr(element), DCM_VR_UL);
+    int64_t value;
+    ck_assert_int_eq(dcm_element_get_value_integer(NULL, element, 0, &value),
+                     true);
+    ck_assert_int_eq(value, 512);
+
+    dcm_dataset_destroy(metadata);
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
 static Suite *create_main_suite(void)
 {
     Suite *suite = suite_create("main");
@@ -939,6 +2546,7 @@ static Suite *create_main_suite(void)
     tcase_add_test(dict_case, test_vr_validity_checks);
     tcase_add_test(dict_case, test_dict_tag_lookups);
     tcase_add_test(dict_case, test_dict_vr_lookups);
+    tcase_add_test(dict_case, test_dict_private_tags);
     suite_add_tcase(suite, dict_case);
 
     return suite;
@@ -963,6 +2571,7 @@ static Suite *create_data_suite(void)
     tcase_add_test(element_case, test_element_US);
     tcase_add_test(element_case, test_element_US_multivalue);
     tcase_add_test(element_case, test_element_US_multivalue_empty);
+    tcase_add_test(element_case, test_element_FD_array);
     suite_add_tcase(suite, element_case);
 
     TCase *dataset_case = tcase_create("dataset");
@@ -987,10 +2596,30 @@ static Suite *create_file_suite(void)
 
     TCase *metadata_case = tcase_create("metadata");
     tcase_add_test(metadata_case, test_file_sm_image_metadata);
+    tcase_add_test(metadata_case, test_file_sm_image_path);
+    tcase_add_test(metadata_case, test_file_sm_image_extract);
+    tcase_add_test(metadata_case, test_file_sm_image_bind);
+    tcase_add_test(metadata_case, test_file_sm_image_parse);
+    tcase_add_test(metadata_case, test_file_sm_image_reader);
+    tcase_add_test(metadata_case, test_file_sm_image_parser);
+    tcase_add_test(metadata_case, test_file_sm_image_borrowed);
+    tcase_add_test(metadata_case, test_file_sm_image_bulk);
+    tcase_add_test(metadata_case, test_file_sm_image_lazy_sequences);
+    tcase_add_test(metadata_case, test_file_sm_image_toc);
     suite_add_tcase(suite, metadata_case);
 
     TCase *frame_case = tcase_create("frame");
     tcase_add_test(frame_case, test_file_sm_image_frame);
+    tcase_add_test(frame_case, test_file_sm_image_frame_cache);
+    tcase_add_test(frame_case, test_file_sm_image_shared_frame_cache);
+    tcase_add_test(frame_case, test_file_sm_image_prefetch_frames);
+    tcase_add_test(frame_case, test_file_sm_image_prefetch_position);
+    tcase_add_test(frame_case, test_file_sm_image_read_frame_async);
+    tcase_add_test(frame_case, test_file_read_frames);
+#ifdef HAVE_SHM_OPEN
+    tcase_add_test(frame_case, test_file_sm_image_shm_frame_cache);
+    tcase_add_test(frame_case, test_file_shm_frame_cache_dead_writer);
+#endif
     suite_add_tcase(suite, frame_case);
 
     TCase *memory_case = tcase_create("memory");
@@ -1035,6 +2664,14 @@ static Suite *create_parse_suite(void)
     tcase_add_test(encapsulated_case5, test_encapsulated_defined_BOT_2_to_2);
     suite_add_tcase(suite, encapsulated_case5);
 
+    TCase *nesting_case = tcase_create("nesting_limit");
+    tcase_add_test(nesting_case, test_parse_nesting_limit);
+    suite_add_tcase(suite, nesting_case);
+
+    TCase *trusted_case = tcase_create("trusted");
+    tcase_add_test(trusted_case, test_parse_trusted);
+    suite_add_tcase(suite, trusted_case);
+
     return suite;
 }
 